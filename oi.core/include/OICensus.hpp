@@ -0,0 +1,77 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace oi { namespace core { namespace worker {
+
+    // Owner ids every process has; the rest are registered by name through Census::owner()
+    const uint16_t W_OWNER_UNTAGGED = 0;
+    const uint16_t W_OWNER_FREE = 1;
+    const uint16_t W_OWNER_QUEUE = 2; // an unnamed WorkerQueue
+
+    // Outstanding objects of one owner
+    struct CensusEntry {
+        std::string owner;
+        size_t count;
+        // Since when the owner holds them
+        uint64_t oldest_ns;
+        uint64_t mean_age_ns;
+    };
+
+    struct PoolCensus {
+        std::string pool;
+        size_t capacity;
+        size_t free;
+        // Largest holders first
+        std::vector<CensusEntry> owners;
+    };
+
+    // Who holds the objects of census enabled pools (ObjectPool::enable_census). Objects are
+    // tagged with the acquiring or dequeuing thread's name, or with the name of the
+    // WorkerQueue they wait in.
+    class Census {
+    public:
+        // Id of the owner with this name, registered on first use
+        static uint16_t owner(const std::string & name);
+        static std::string owner_name(uint16_t owner);
+        // Owner id of the calling thread (its Threads::name(), or "thread.N")
+        static uint16_t thread_owner();
+        // Forget the calling thread's cached owner; Threads::set_name calls this
+        static void reset_thread_owner();
+        // Census of every census enabled pool
+        static std::vector<PoolCensus> take();
+        static void print(const PoolCensus & census);
+        static void print();
+        // Pools register a function that takes their census while census is enabled
+        static void add_pool(const void * pool, std::function<PoolCensus()> census);
+        static void remove_pool(const void * pool);
+    private:
+        static std::mutex & _mutex();
+        static std::mutex & _pools_mutex();
+        static std::vector<std::string> & _names();
+        static std::vector<std::pair<const void *, std::function<PoolCensus()>>> & _pools();
+    };
+
+} } }
@@ -0,0 +1,97 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define OI_CLOCK_HAS_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define OI_CLOCK_HAS_TSC 1
+#endif
+
+namespace oi { namespace core {
+
+    // Where Clock::now_ns() reads its ticks from
+    //  W_CLOCK_MONOTONIC - steady_clock (CLOCK_MONOTONIC through the vDSO on Linux)
+    //  W_CLOCK_TSC       - the CPU time stamp counter, calibrated against the monotonic clock;
+    //                      only available where the TSC is invariant (constant rate, synced across cores)
+    enum W_CLOCK { W_CLOCK_MONOTONIC, W_CLOCK_TSC };
+
+    // How often the shared TimerWheel re-samples the wall clock offset
+    const std::chrono::seconds CLOCK_CALIBRATE_INTERVAL(10);
+
+    // Process wide time source. now_ns() is monotonic and never steps with NTP,
+    // so it is what deltas, timeouts and deadlines are measured with. Timestamps
+    // that go on the wire use wall_ns(), which maps the monotonic clock to epoch time
+    // through an offset sampled by calibrate().
+    class Clock {
+    public:
+        // Nanoseconds since an arbitrary origin
+        static uint64_t now_ns();
+        // Nanoseconds since the epoch: now_ns() plus the calibrated offset
+        static int64_t wall_ns();
+        static int64_t to_wall_ns(uint64_t mono_ns);
+        static uint64_t from_wall_ns(int64_t wall_ns);
+        // Samples the wall clock against now_ns() again. Steps of the wall clock only
+        // show up in wall_ns() after this, and never in now_ns().
+        static void calibrate();
+        // Switches the tick source; W_CLOCK_TSC fails (returns false) where the TSC
+        // is not invariant. Takes ~20ms to calibrate; call it at startup.
+        static bool set_source(W_CLOCK source);
+        static W_CLOCK source();
+        static bool tsc_invariant();
+    private:
+        static uint64_t _steady_ns();
+        static std::atomic<bool> _tsc;
+        static std::atomic<int64_t> _wall_offset;
+        static uint64_t _tsc_base;
+        static uint64_t _tsc_base_ns;
+        static double _ns_per_tick;
+    };
+
+    inline uint64_t Clock::_steady_ns() {
+        return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    inline uint64_t Clock::now_ns() {
+#ifdef OI_CLOCK_HAS_TSC
+        if (_tsc.load(std::memory_order_acquire)) {
+            return _tsc_base_ns + (uint64_t) ((double) (__rdtsc() - _tsc_base) * _ns_per_tick);
+        }
+#endif
+        return _steady_ns();
+    }
+
+    inline int64_t Clock::wall_ns() {
+        return to_wall_ns(now_ns());
+    }
+
+    inline int64_t Clock::to_wall_ns(uint64_t mono_ns) {
+        return (int64_t) mono_ns + _wall_offset.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t Clock::from_wall_ns(int64_t wall_ns) {
+        return (uint64_t) (wall_ns - _wall_offset.load(std::memory_order_relaxed));
+    }
+
+} }
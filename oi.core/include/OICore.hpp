@@ -17,14 +17,27 @@ along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
 #pragma once
 
 #include "OIIO.hpp"
+#include "OIClock.hpp"
 #include "OIWorker.hpp"
+#include "OIExecutor.hpp"
+#include "OIPipeline.hpp"
+#include "OISelect.hpp"
+#include "OITimer.hpp"
+#include "OIThread.hpp"
+#include "OIShared.hpp"
+#include "OISpan.hpp"
 
 namespace oi { namespace core {
     
     // Some config parser?
     
+    // Monotonic time (Clock::now_ns) for deltas, timeouts and scheduling; not epoch based
     std::chrono::milliseconds NOW();
     std::chrono::microseconds NOWu();
+    // Epoch time for timestamps that go on the wire
+    std::chrono::milliseconds WALL();
+    // Epoch time of a NOW() timestamp
+    std::chrono::milliseconds WALL(std::chrono::milliseconds now);
     
     void debugMemory(unsigned char * loc, size_t len);
     
@@ -0,0 +1,121 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#endif
+
+namespace oi { namespace core { namespace worker {
+
+    // Rounds await() polls before it sleeps; every 16th round yields the CPU
+    const size_t EVENTCOUNT_SPIN = 256;
+
+    // Tells the CPU it is in a spin-wait loop (saves power, frees the sibling hyperthread)
+    inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+        _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    // Lets threads sleep until a condition on lock-free state becomes true, without a lock
+    // on the notifying side. A waiter registers (prepare_wait), re-checks its condition and
+    // only then sleeps; a notify in between bumps the epoch, so the sleep returns at once.
+    // Notifying when nobody waits costs a fence and a load. Sleeps on a futex on Linux and
+    // on a mutex/condition variable pair elsewhere. A process shared EventCount (Linux only)
+    // may be placed in shared memory and waited on from several processes.
+    //
+    //   ec.await([&]{ return ring.try_pop(p); });   // consumer
+    //   ring.try_push(p); ec.notify_one();          // producer
+    class EventCount {
+    public:
+        typedef uint32_t Key;
+        explicit EventCount(bool process_shared = false);
+        Key prepare_wait();
+        void cancel_wait();
+        // Sleep until notified after prepare_wait returned key
+        void wait(Key key);
+        // As wait, but give up at deadline; false if it passed without a notify
+        bool wait_until(Key key, std::chrono::steady_clock::time_point deadline);
+        void notify_one();
+        void notify_all();
+        // Block until ready() returns true; ready() runs on the waiting thread and may consume state
+        template <class Pred>
+        void await(Pred ready);
+        // As await, but give up at deadline; returns the last result of ready().
+        // spins is the number of polling rounds before sleeping, 0 sleeps right away.
+        template <class Pred>
+        bool await_until(Pred ready, std::chrono::steady_clock::time_point deadline, size_t spins = EVENTCOUNT_SPIN);
+        // Busy-polls ready() until it holds or deadline passes, never sleeps
+        template <class Pred>
+        bool poll_until(Pred ready, std::chrono::steady_clock::time_point deadline);
+
+        EventCount(const EventCount&) = delete;
+        EventCount& operator=(const EventCount&) = delete;
+    private:
+        void _notify(bool all);
+        std::atomic<uint32_t> _epoch;
+        std::atomic<uint32_t> _waiters;
+        bool _shared;
+#ifndef __linux__
+        std::mutex _m;
+        std::condition_variable _cv;
+#endif
+    };
+
+    template <class Pred>
+    void EventCount::await(Pred ready) {
+        await_until(ready, std::chrono::steady_clock::time_point::max());
+    }
+
+    template <class Pred>
+    bool EventCount::await_until(Pred ready, std::chrono::steady_clock::time_point deadline, size_t spins) {
+        // Most waits are short; polling a little first keeps the futex out of the hot path
+        for (size_t i = 0; i < spins; i++) {
+            if (ready()) return true;
+            if (i % 16 == 15) std::this_thread::yield();
+            else cpu_relax();
+        }
+        while (true) {
+            Key key = prepare_wait();
+            if (ready()) {
+                cancel_wait();
+                return true;
+            }
+            if (!wait_until(key, deadline)) return ready();
+            if (ready()) return true;
+        }
+    }
+    template <class Pred>
+    bool EventCount::poll_until(Pred ready, std::chrono::steady_clock::time_point deadline) {
+        bool timed = deadline != std::chrono::steady_clock::time_point::max();
+        for (uint32_t i = 1; ; i++) {
+            if (ready()) return true;
+            // Reading the clock costs more than a round, check it every 64th
+            if (timed && i % 64 == 0 && std::chrono::steady_clock::now() >= deadline) return ready();
+            cpu_relax();
+        }
+    }
+} } }
@@ -0,0 +1,200 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "OIWorker.hpp"
+
+namespace oi { namespace core { namespace worker {
+
+    // Fixed set of worker threads, each with its own task deque. Workers run their own
+    // tasks newest first and steal the oldest tasks of other workers when they run dry,
+    // so tasks submitted from a task stay on the (cache warm) submitting worker.
+    class Executor {
+    public:
+        typedef std::function<void()> Task;
+        // n_workers 0 means one worker per hardware thread
+        explicit Executor(size_t n_workers);
+        ~Executor();
+        // Callable from any thread; from a worker of this executor the task goes to its own deque
+        void submit(Task task);
+        // Pin a worker to one CPU; false where unsupported or when the call fails
+        bool set_affinity(size_t worker, int cpu);
+        size_t n_workers();
+        // Index of the calling thread among this executor's workers, -1 for other threads
+        int current_worker();
+        uint64_t executed();
+        uint64_t stolen();
+        // Runs the tasks that are still queued, then joins the workers
+        void shutdown();
+        // Process wide executor with one worker per hardware thread
+        static Executor * shared();
+
+        Executor(const Executor&) = delete;
+        Executor& operator=(const Executor&) = delete;
+    private:
+        struct Worker {
+            std::mutex m;
+            std::deque<Task> tasks;
+            std::thread * thread;
+            std::atomic<uint64_t> executed;
+            std::atomic<uint64_t> stolen;
+            char _pad[OI_CACHE_LINE];
+        };
+        void _run(size_t index);
+        bool _pop(size_t index, Task & task);
+        bool _steal(size_t index, Task & task);
+        std::vector<Worker *> _workers;
+        std::atomic<size_t> _next;
+        std::atomic<int64_t> _pending;
+        std::atomic<int> _sleeping;
+        std::atomic<bool> _running;
+        std::mutex _m_sleep;
+        std::condition_variable _cv_sleep;
+    };
+
+    // Consumes a WorkerQueue with Executor tasks instead of a dedicated thread. Enqueueing
+    // schedules a task that handles up to budget objects and reschedules itself while the
+    // queue has more; at most max_tasks tasks consume the queue at the same time.
+    // fn must not block for long, it holds an executor worker while it runs.
+    template <class DataObjectT>
+    class ExecutorConsumer : public WorkerQueueListener {
+    public:
+        typedef std::function<void(DataObjectAcquisition<DataObjectT> & in)> ConsumeFn;
+        ExecutorConsumer(Executor * executor, WorkerQueue<DataObjectT> * q, size_t max_tasks, size_t budget, ConsumeFn fn);
+        ~ExecutorConsumer();
+        void start();
+        // Detach from the queue and wait for running tasks; objects stay queued
+        void stop();
+        uint64_t processed();
+        void on_enqueue();
+
+        ExecutorConsumer(const ExecutorConsumer&) = delete;
+        ExecutorConsumer& operator=(const ExecutorConsumer&) = delete;
+    private:
+        void _schedule();
+        void _drain();
+        Executor * _executor;
+        WorkerQueue<DataObjectT> * _queue;
+        size_t _max_tasks;
+        size_t _budget;
+        ConsumeFn _fn;
+        // Tasks scheduled or running (shifted left by one) and a flag for objects
+        // enqueued while all of them were busy
+        std::atomic<uint64_t> _state;
+        std::atomic<bool> _running;
+        std::atomic<uint64_t> _processed;
+    };
+
+
+    template <class DataObjectT>
+    ExecutorConsumer<DataObjectT>::ExecutorConsumer(Executor * executor, WorkerQueue<DataObjectT> * q, size_t max_tasks, size_t budget, ConsumeFn fn)
+    : _executor(executor)
+    , _queue(q)
+    , _max_tasks(max_tasks > 0 ? max_tasks : 1)
+    , _budget(budget > 0 ? budget : 1)
+    , _fn(fn) {
+        _state = 0;
+        _running = false;
+        _processed = 0;
+    }
+
+    template <class DataObjectT>
+    ExecutorConsumer<DataObjectT>::~ExecutorConsumer() {
+        stop();
+    }
+
+    template <class DataObjectT>
+    void ExecutorConsumer<DataObjectT>::start() {
+        if (_running) return;
+        _running = true;
+        _queue->set_listener(this);
+        // Objects enqueued before we listened
+        _schedule();
+    }
+
+    template <class DataObjectT>
+    void ExecutorConsumer<DataObjectT>::stop() {
+        if (!_running) return;
+        _running = false;
+        _queue->set_listener(nullptr);
+        while ((_state.load() >> 1) > 0) std::this_thread::yield();
+    }
+
+    template <class DataObjectT>
+    uint64_t ExecutorConsumer<DataObjectT>::processed() {
+        return _processed.load(std::memory_order_relaxed);
+    }
+
+    template <class DataObjectT>
+    void ExecutorConsumer<DataObjectT>::on_enqueue() {
+        _schedule();
+    }
+
+    template <class DataObjectT>
+    void ExecutorConsumer<DataObjectT>::_schedule() {
+        uint64_t state = _state.load();
+        while (_running) {
+            if ((state >> 1) < _max_tasks) {
+                if (_state.compare_exchange_weak(state, state + 2)) {
+                    _executor->submit([this]{ _drain(); });
+                    return;
+                }
+            } else if (state & 1) {
+                return;
+            } else if (_state.compare_exchange_weak(state, state | 1)) {
+                // A running task sees the flag before it gives up its slot
+                return;
+            }
+        }
+    }
+
+    template <class DataObjectT>
+    void ExecutorConsumer<DataObjectT>::_drain() {
+        while (true) {
+            size_t n = 0;
+            while (_running && n < _budget) {
+                DataObjectAcquisition<DataObjectT> doa(_queue, W_FLOW_NONBLOCKING);
+                if (!doa.data) break;
+                _fn(doa);
+                n++;
+            }
+            _processed.fetch_add(n, std::memory_order_relaxed);
+            if (_running && n == _budget) {
+                // Budget used up: requeue behind other tasks, keeping our slot
+                _executor->submit([this]{ _drain(); });
+                return;
+            }
+            // Queue looked empty. Leave, unless a producer flagged new objects meanwhile.
+            // Giving up the slot is the last access to this; stop() may delete us right after.
+            uint64_t state = _state.load();
+            while (true) {
+                if (state & 1) {
+                    if (_state.compare_exchange_weak(state, state & ~(uint64_t) 1)) break;
+                } else if (_state.compare_exchange_weak(state, state - 2)) {
+                    return;
+                }
+            }
+        }
+    }
+} } }
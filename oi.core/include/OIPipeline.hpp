@@ -0,0 +1,418 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "OIWorker.hpp"
+#include "OIExecutor.hpp"
+#include "OIThread.hpp"
+
+namespace oi { namespace core { namespace worker {
+
+    template <class DataObjectT>
+    class Pipeline;
+
+    // Objects a stage handles per executor task before it yields the worker to other tasks
+    const size_t PIPELINE_TASK_BUDGET = 64;
+
+    // Throughput of one stage since Pipeline::start()
+    struct PipelineStageStats {
+        std::string name;
+        size_t n_threads;
+        uint64_t processed;
+        double per_second;
+    };
+
+    // One node of a Pipeline: n_threads workers that take objects from the input queue
+    // (or generate them, for sources) and hand them to the output queues.
+    template <class DataObjectT>
+    class PipelineStage {
+    public:
+        typedef std::function<void(DataObjectAcquisition<DataObjectT> & in, PipelineStage<DataObjectT> & stage)> StageFn;
+        typedef std::function<void(PipelineStage<DataObjectT> & stage)> SourceFn;
+        // Add an output queue; returns the stage so outputs can be chained
+        PipelineStage<DataObjectT> & to(WorkerQueue<DataObjectT> * q);
+        WorkerQueue<DataObjectT> * in();
+        WorkerQueue<DataObjectT> * out(size_t i);
+        size_t n_outputs();
+        // Enqueue the object into every output queue; with several outputs it is shared, not copied
+        void forward(DataObjectAcquisition<DataObjectT> & doa);
+        // Count objects produced by a source stage
+        void produced(size_t n);
+        const std::string & name();
+        bool running();
+        PipelineStageStats stats();
+
+        PipelineStage(const PipelineStage&) = delete;
+        PipelineStage& operator=(const PipelineStage&) = delete;
+    private:
+        PipelineStage(Pipeline<DataObjectT> * pipeline, const std::string & name, WorkerQueue<DataObjectT> * in, size_t n_threads);
+        ~PipelineStage();
+        void _run();
+        void _source_task();
+        Pipeline<DataObjectT> * _pipeline;
+        std::string _name;
+        WorkerQueue<DataObjectT> * _in;
+        std::vector<WorkerQueue<DataObjectT> *> _out;
+        size_t _n_threads;
+        StageFn _fn;
+        SourceFn _source_fn;
+        std::vector<std::thread *> _threads;
+        Executor * _executor;
+        ExecutorConsumer<DataObjectT> * _consumer;
+        std::atomic<size_t> _source_tasks;
+        std::atomic<bool> _running;
+        std::atomic<uint64_t> _processed;
+    friend class Pipeline<DataObjectT>;
+    };
+
+    // A graph of stages connected by WorkerQueues. Declare queues and stages, then start().
+    // stop() (or the destructor) shuts the stages down from the sources downstream, so no
+    // worker is left blocked on a full queue, and returns queued objects to their pools.
+    // A stopped pipeline can not be started again.
+    //
+    //   Pipeline<Frame> p("rgbd");
+    //   WorkerQueue<Frame> * encoded = p.add_queue("encoded", W_BACKEND_LOCKFREE, 64);
+    //   p.add_stage("encode", raw, 4, encode).to(encoded);
+    //   p.add_stage("send", encoded, 1, send);
+    //   p.start();
+    template <class DataObjectT>
+    class Pipeline {
+    public:
+        Pipeline(const std::string & name);
+        ~Pipeline();
+        // Create a queue owned by the pipeline, named "<pipeline>.<name>" (see WorkerRegistry)
+        WorkerQueue<DataObjectT> * add_queue(const std::string & name, W_BACKEND backend, size_t capacity);
+        WorkerQueue<DataObjectT> * add_queue(const std::string & name, W_BACKEND backend, size_t capacity, W_OVERFLOW overflow, size_t limit);
+        // Stage taking objects from in; not owned queues may be passed, they are closed on stop()
+        PipelineStage<DataObjectT> & add_stage(const std::string & name, WorkerQueue<DataObjectT> * in, size_t n_threads,
+                                               typename PipelineStage<DataObjectT>::StageFn fn);
+        // Stage without input, fn is called in a loop until stop(); it must return regularly
+        PipelineStage<DataObjectT> & add_source(const std::string & name, size_t n_threads,
+                                                typename PipelineStage<DataObjectT>::SourceFn fn);
+        PipelineStage<DataObjectT> & stage(const std::string & name);
+        void start();
+        // Run the stages as tasks of executor instead of on their own threads. A stage's
+        // thread count becomes the number of tasks that may run it at the same time.
+        void start(Executor * executor);
+        void stop();
+        bool running();
+        const std::string & name();
+        std::vector<PipelineStageStats> stats();
+        void print_stats();
+
+        Pipeline(const Pipeline&) = delete;
+        Pipeline& operator=(const Pipeline&) = delete;
+    private:
+        void _sort_stages();
+        std::string _name;
+        std::vector<PipelineStage<DataObjectT> *> _stages;
+        std::vector<WorkerQueue<DataObjectT> *> _queues;
+        std::atomic<bool> _running;
+        bool _stopped;
+        std::chrono::steady_clock::time_point _started;
+    friend class PipelineStage<DataObjectT>;
+    };
+
+
+    template <class DataObjectT>
+    PipelineStage<DataObjectT>::PipelineStage(Pipeline<DataObjectT> * pipeline, const std::string & name, WorkerQueue<DataObjectT> * in, size_t n_threads)
+    : _pipeline(pipeline)
+    , _name(name)
+    , _in(in)
+    , _n_threads(n_threads) {
+        _executor = nullptr;
+        _consumer = nullptr;
+        _source_tasks = 0;
+        _running = false;
+        _processed = 0;
+    }
+
+    template <class DataObjectT>
+    PipelineStage<DataObjectT>::~PipelineStage() {
+        delete _consumer;
+    }
+
+    template <class DataObjectT>
+    PipelineStage<DataObjectT> & PipelineStage<DataObjectT>::to(WorkerQueue<DataObjectT> * q) {
+        if (q == nullptr) throw OIError("Pipeline stage output without queue.");
+        if (_out.size() >= W_MAX_FANOUT) throw OIError("Too many outputs for pipeline stage " + _name + ".");
+        _out.push_back(q);
+        return *this;
+    }
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT> * PipelineStage<DataObjectT>::in() {
+        return _in;
+    }
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT> * PipelineStage<DataObjectT>::out(size_t i) {
+        return _out.at(i);
+    }
+
+    template <class DataObjectT>
+    size_t PipelineStage<DataObjectT>::n_outputs() {
+        return _out.size();
+    }
+
+    template <class DataObjectT>
+    void PipelineStage<DataObjectT>::forward(DataObjectAcquisition<DataObjectT> & doa) {
+        if (_out.size() == 1) {
+            doa.enqueue(_out[0]);
+            return;
+        }
+        for (size_t i = 0; i < _out.size(); i++) doa.enqueue_shared(_out[i]);
+    }
+
+    template <class DataObjectT>
+    void PipelineStage<DataObjectT>::produced(size_t n) {
+        _processed.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    template <class DataObjectT>
+    const std::string & PipelineStage<DataObjectT>::name() {
+        return _name;
+    }
+
+    template <class DataObjectT>
+    bool PipelineStage<DataObjectT>::running() {
+        return _running;
+    }
+
+    template <class DataObjectT>
+    PipelineStageStats PipelineStage<DataObjectT>::stats() {
+        PipelineStageStats res;
+        res.name = _name;
+        res.n_threads = _n_threads;
+        res.processed = _processed.load(std::memory_order_relaxed);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _pipeline->_started).count();
+        res.per_second = seconds > 0 ? res.processed / seconds : 0.0;
+        return res;
+    }
+
+    template <class DataObjectT>
+    void PipelineStage<DataObjectT>::_run() {
+        while (_running) {
+            if (_in == nullptr) {
+                _source_fn(*this);
+                continue;
+            }
+            DataObjectAcquisition<DataObjectT> doa(_in, W_FLOW_BLOCKING);
+            if (!doa.data) continue;
+            _fn(doa, *this);
+            _processed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // One call of a source function per executor task
+    template <class DataObjectT>
+    void PipelineStage<DataObjectT>::_source_task() {
+        if (_running) _source_fn(*this);
+        if (_running) {
+            _executor->submit([this]{ _source_task(); });
+            return;
+        }
+        _source_tasks--;
+    }
+
+
+    template <class DataObjectT>
+    Pipeline<DataObjectT>::Pipeline(const std::string & name)
+    : _name(name) {
+        _running = false;
+        _stopped = false;
+    }
+
+    template <class DataObjectT>
+    Pipeline<DataObjectT>::~Pipeline() {
+        stop();
+        for (size_t i = 0; i < _stages.size(); i++) delete _stages[i];
+        for (size_t i = 0; i < _queues.size(); i++) delete _queues[i];
+    }
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT> * Pipeline<DataObjectT>::add_queue(const std::string & name, W_BACKEND backend, size_t capacity) {
+        return add_queue(name, backend, capacity, W_OVERFLOW_BLOCK, 0);
+    }
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT> * Pipeline<DataObjectT>::add_queue(const std::string & name, W_BACKEND backend, size_t capacity, W_OVERFLOW overflow, size_t limit) {
+        WorkerQueue<DataObjectT> * q = new WorkerQueue<DataObjectT>(backend, capacity, overflow, limit);
+        q->set_name(_name + "." + name);
+        _queues.push_back(q);
+        return q;
+    }
+
+    template <class DataObjectT>
+    PipelineStage<DataObjectT> & Pipeline<DataObjectT>::add_stage(const std::string & name, WorkerQueue<DataObjectT> * in, size_t n_threads,
+                                                                  typename PipelineStage<DataObjectT>::StageFn fn) {
+        if (_running || _stopped) throw OIError("Can not add stages to a started pipeline.");
+        if (in == nullptr) throw OIError("Pipeline stage " + name + " has no input queue.");
+        if (n_threads == 0) throw OIError("Pipeline stage " + name + " needs at least one thread.");
+        PipelineStage<DataObjectT> * s = new PipelineStage<DataObjectT>(this, name, in, n_threads);
+        s->_fn = fn;
+        _stages.push_back(s);
+        return *s;
+    }
+
+    template <class DataObjectT>
+    PipelineStage<DataObjectT> & Pipeline<DataObjectT>::add_source(const std::string & name, size_t n_threads,
+                                                                   typename PipelineStage<DataObjectT>::SourceFn fn) {
+        if (_running || _stopped) throw OIError("Can not add stages to a started pipeline.");
+        if (n_threads == 0) throw OIError("Pipeline stage " + name + " needs at least one thread.");
+        PipelineStage<DataObjectT> * s = new PipelineStage<DataObjectT>(this, name, nullptr, n_threads);
+        s->_source_fn = fn;
+        _stages.push_back(s);
+        return *s;
+    }
+
+    template <class DataObjectT>
+    PipelineStage<DataObjectT> & Pipeline<DataObjectT>::stage(const std::string & name) {
+        for (size_t i = 0; i < _stages.size(); i++) {
+            if (_stages[i]->_name == name) return *_stages[i];
+        }
+        throw OIError("No pipeline stage " + name + ".");
+    }
+
+    // Orders the stages so every stage comes after all stages writing into its input,
+    // keeping the declaration order where possible. Cycles can not be drained on stop().
+    template <class DataObjectT>
+    void Pipeline<DataObjectT>::_sort_stages() {
+        size_t n = _stages.size();
+        // Kahn's algorithm; an edge runs from a writer of queue q to every reader of q
+        std::vector<size_t> indegree(n, 0);
+        for (size_t a = 0; a < n; a++) {
+            for (size_t o = 0; o < _stages[a]->_out.size(); o++) {
+                for (size_t b = 0; b < n; b++) {
+                    if (_stages[b]->_in == _stages[a]->_out[o]) indegree[b]++;
+                }
+            }
+        }
+        std::vector<PipelineStage<DataObjectT> *> sorted;
+        std::vector<bool> done(n, false);
+        while (sorted.size() < n) {
+            size_t a = 0;
+            while (a < n && (done[a] || indegree[a] > 0)) a++;
+            if (a == n) throw OIError("Pipeline " + _name + " has a cycle.");
+            done[a] = true;
+            sorted.push_back(_stages[a]);
+            for (size_t o = 0; o < _stages[a]->_out.size(); o++) {
+                for (size_t b = 0; b < n; b++) {
+                    if (_stages[b]->_in == _stages[a]->_out[o]) indegree[b]--;
+                }
+            }
+        }
+        _stages = sorted;
+    }
+
+    template <class DataObjectT>
+    void Pipeline<DataObjectT>::start() {
+        start(nullptr);
+    }
+
+    template <class DataObjectT>
+    void Pipeline<DataObjectT>::start(Executor * executor) {
+        if (_running) return;
+        if (_stopped) throw OIError("Pipeline " + _name + " was stopped.");
+        _sort_stages();
+        _started = std::chrono::steady_clock::now();
+        _running = true;
+        for (size_t i = 0; i < _stages.size(); i++) {
+            PipelineStage<DataObjectT> * s = _stages[i];
+            s->_running = true;
+            s->_executor = executor;
+            if (executor == nullptr) {
+                for (size_t t = 0; t < s->_n_threads; t++) {
+                    s->_threads.push_back(Threads::spawn("oi.stage." + s->_name, [s] { s->_run(); }));
+                }
+            } else if (s->_in == nullptr) {
+                s->_source_tasks = s->_n_threads;
+                for (size_t t = 0; t < s->_n_threads; t++) executor->submit([s]{ s->_source_task(); });
+            } else {
+                s->_consumer = new ExecutorConsumer<DataObjectT>(executor, s->_in, s->_n_threads, PIPELINE_TASK_BUDGET,
+                    [s](DataObjectAcquisition<DataObjectT> & in) {
+                        s->_fn(in, *s);
+                        s->_processed.fetch_add(1, std::memory_order_relaxed);
+                    });
+                s->_consumer->start();
+            }
+        }
+    }
+
+    template <class DataObjectT>
+    void Pipeline<DataObjectT>::stop() {
+        if (!_running) return;
+        _running = false;
+        _stopped = true;
+        // Upstream first: downstream stages keep consuming until everything that
+        // feeds them has exited. Closing the input wakes workers blocked on it.
+        for (size_t i = 0; i < _stages.size(); i++) {
+            PipelineStage<DataObjectT> * s = _stages[i];
+            s->_running = false;
+            if (s->_consumer != nullptr) s->_consumer->stop();
+            while (s->_source_tasks > 0) std::this_thread::yield();
+            if (s->_in != nullptr) s->_in->close();
+            for (size_t t = 0; t < s->_threads.size(); t++) {
+                s->_threads[t]->join();
+                delete s->_threads[t];
+            }
+            s->_threads.clear();
+        }
+        // Objects still queued inside the graph go back to their pools
+        for (size_t i = 0; i < _stages.size(); i++) {
+            WorkerQueue<DataObjectT> * q = _stages[i]->_in;
+            if (q == nullptr) continue;
+            while (true) {
+                DataObjectBatch<DataObjectT> rest(q, 64, W_FLOW_NONBLOCKING);
+                if (rest.empty()) break;
+            }
+        }
+    }
+
+    template <class DataObjectT>
+    bool Pipeline<DataObjectT>::running() {
+        return _running;
+    }
+
+    template <class DataObjectT>
+    const std::string & Pipeline<DataObjectT>::name() {
+        return _name;
+    }
+
+    template <class DataObjectT>
+    std::vector<PipelineStageStats> Pipeline<DataObjectT>::stats() {
+        std::vector<PipelineStageStats> res;
+        for (size_t i = 0; i < _stages.size(); i++) res.push_back(_stages[i]->stats());
+        return res;
+    }
+
+    template <class DataObjectT>
+    void Pipeline<DataObjectT>::print_stats() {
+        std::vector<PipelineStageStats> all = stats();
+        for (size_t i = 0; i < all.size(); i++) {
+            printf("%s.%-16s %2zu threads %12llu objects %10.0f/s\n", _name.c_str(), all[i].name.c_str(),
+                   all[i].n_threads, (unsigned long long) all[i].processed, all[i].per_second);
+        }
+    }
+} } }
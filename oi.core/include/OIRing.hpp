@@ -0,0 +1,230 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace oi { namespace core { namespace worker {
+
+    const size_t OI_CACHE_LINE = 64;
+
+    inline size_t next_pow2(size_t v) {
+        size_t p = 1;
+        while (p < v) p <<= 1;
+        return p;
+    }
+
+    // Bounded multi-producer/multi-consumer ring (D. Vyukov).
+    // Every slot carries a sequence number, so producers and consumers only
+    // contend on their own position counter and never take a lock.
+    // Capacity is rounded up to a power of two.
+    template <class T>
+    class MPMCRing {
+    public:
+        explicit MPMCRing(size_t capacity);
+        ~MPMCRing();
+        bool try_push(const T & v);
+        bool try_pop(T & v);
+        bool empty() const;
+        size_t size() const;      // approximate while other threads are active
+        size_t capacity() const;
+
+        MPMCRing(const MPMCRing&) = delete;
+        MPMCRing& operator=(const MPMCRing&) = delete;
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+        char _pad0[OI_CACHE_LINE];
+        Cell * _buffer;
+        size_t _mask;
+        char _pad1[OI_CACHE_LINE - sizeof(Cell *) - sizeof(size_t)];
+        std::atomic<size_t> _enqueue_pos;
+        char _pad2[OI_CACHE_LINE - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> _dequeue_pos;
+        char _pad3[OI_CACHE_LINE - sizeof(std::atomic<size_t>)];
+    };
+
+    template <class T>
+    MPMCRing<T>::MPMCRing(size_t capacity) {
+        size_t n = next_pow2(capacity < 2 ? 2 : capacity);
+        _buffer = new Cell[n];
+        _mask = n - 1;
+        for (size_t i = 0; i < n; i++) {
+            _buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        _enqueue_pos.store(0, std::memory_order_relaxed);
+        _dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    template <class T>
+    MPMCRing<T>::~MPMCRing() {
+        delete [] _buffer;
+    }
+
+    template <class T>
+    bool MPMCRing<T>::try_push(const T & v) {
+        Cell * cell;
+        size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &_buffer[pos & _mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+            if (dif == 0) {
+                if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false; // full
+            } else {
+                pos = _enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = v;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <class T>
+    bool MPMCRing<T>::try_pop(T & v) {
+        Cell * cell;
+        size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &_buffer[pos & _mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (dif == 0) {
+                if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false; // empty
+            } else {
+                pos = _dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        v = cell->data;
+        cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <class T>
+    bool MPMCRing<T>::empty() const {
+        return size() == 0;
+    }
+
+    template <class T>
+    size_t MPMCRing<T>::size() const {
+        size_t head = _dequeue_pos.load(std::memory_order_acquire);
+        size_t tail = _enqueue_pos.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    template <class T>
+    size_t MPMCRing<T>::capacity() const {
+        return _mask + 1;
+    }
+
+    // Bounded single-producer/single-consumer ring.
+    // try_push may only be called from one thread and try_pop from one other thread.
+    // Each side keeps a cached copy of the opposite index on its own cache line,
+    // so the shared indices are only read when the cached view looks full/empty.
+    template <class T>
+    class SPSCRing {
+    public:
+        explicit SPSCRing(size_t capacity);
+        ~SPSCRing();
+        bool try_push(const T & v);
+        bool try_pop(T & v);
+        bool empty() const;
+        size_t size() const;      // approximate while other threads are active
+        size_t capacity() const;
+
+        SPSCRing(const SPSCRing&) = delete;
+        SPSCRing& operator=(const SPSCRing&) = delete;
+    private:
+        char _pad0[OI_CACHE_LINE];
+        T * _buffer;
+        size_t _mask;
+        char _pad1[OI_CACHE_LINE - sizeof(T *) - sizeof(size_t)];
+        // consumer side
+        std::atomic<size_t> _head;
+        size_t _tail_cache;
+        char _pad2[OI_CACHE_LINE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+        // producer side
+        std::atomic<size_t> _tail;
+        size_t _head_cache;
+        char _pad3[OI_CACHE_LINE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    };
+
+    template <class T>
+    SPSCRing<T>::SPSCRing(size_t capacity) {
+        size_t n = next_pow2(capacity < 2 ? 2 : capacity);
+        _buffer = new T[n];
+        _mask = n - 1;
+        _head.store(0, std::memory_order_relaxed);
+        _tail.store(0, std::memory_order_relaxed);
+        _head_cache = 0;
+        _tail_cache = 0;
+    }
+
+    template <class T>
+    SPSCRing<T>::~SPSCRing() {
+        delete [] _buffer;
+    }
+
+    template <class T>
+    bool SPSCRing<T>::try_push(const T & v) {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head_cache > _mask) {
+            _head_cache = _head.load(std::memory_order_acquire);
+            if (tail - _head_cache > _mask) return false; // full
+        }
+        _buffer[tail & _mask] = v;
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <class T>
+    bool SPSCRing<T>::try_pop(T & v) {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail_cache) {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+            if (head == _tail_cache) return false; // empty
+        }
+        v = _buffer[head & _mask];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <class T>
+    bool SPSCRing<T>::empty() const {
+        return size() == 0;
+    }
+
+    template <class T>
+    size_t SPSCRing<T>::size() const {
+        size_t head = _head.load(std::memory_order_acquire);
+        size_t tail = _tail.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    template <class T>
+    size_t SPSCRing<T>::capacity() const {
+        return _mask + 1;
+    }
+
+} } }
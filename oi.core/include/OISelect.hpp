@@ -0,0 +1,137 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "OIEventCount.hpp"
+#include "OIWorker.hpp"
+
+namespace oi { namespace core { namespace worker {
+
+    // Waits on several WorkerQueues at once (select/poll for queues). The selector attaches
+    // itself as the listener of every queue it watches, so a queue can be watched by one
+    // selector (or consumed by one ExecutorConsumer) at a time.
+    //
+    //   QueueSelector<T> in; in.add(qa); in.add(qb);
+    //   int i = in.wait(next_heartbeat);
+    //   if (i >= 0) { DataObjectAcquisition<T> doa(in.queue(i), W_FLOW_NONBLOCKING); ... }
+    template <class DataObjectT>
+    class QueueSelector : public WorkerQueueListener {
+    public:
+        QueueSelector();
+        ~QueueSelector();
+        // Watch q; wait() refers to it by the returned index
+        size_t add(WorkerQueue<DataObjectT> * q);
+        WorkerQueue<DataObjectT> * queue(size_t i);
+        size_t size();
+        // Block until one of the queues has a ready object or the deadline passes. Returns the
+        // index of a ready queue (taking turns when several are ready), -1 on timeout or notify_all().
+        // Other consumers of the queue may still take the object before the caller does.
+        int wait(W_DEADLINE deadline = W_NO_DEADLINE);
+        template <class Rep, class Period>
+        int wait_for(const std::chrono::duration<Rep, Period> & timeout);
+        // Make every current wait() return -1
+        void notify_all();
+        void on_enqueue();
+
+        QueueSelector(const QueueSelector&) = delete;
+        QueueSelector& operator=(const QueueSelector&) = delete;
+    private:
+        int _ready();
+        std::vector<WorkerQueue<DataObjectT> *> _queues;
+        EventCount _ec;
+        std::atomic<size_t> _next;
+        std::atomic<uint32_t> _wake_gen;
+    };
+
+
+    template <class DataObjectT>
+    QueueSelector<DataObjectT>::QueueSelector() {
+        _next = 0;
+        _wake_gen = 0;
+    }
+
+    template <class DataObjectT>
+    QueueSelector<DataObjectT>::~QueueSelector() {
+        for (size_t i = 0; i < _queues.size(); i++) _queues[i]->set_listener(nullptr);
+    }
+
+    template <class DataObjectT>
+    size_t QueueSelector<DataObjectT>::add(WorkerQueue<DataObjectT> * q) {
+        if (q->listener() != nullptr) throw OIError("WorkerQueue already has a listener.");
+        q->set_listener(this);
+        _queues.push_back(q);
+        return _queues.size() - 1;
+    }
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT> * QueueSelector<DataObjectT>::queue(size_t i) {
+        return _queues[i];
+    }
+
+    template <class DataObjectT>
+    size_t QueueSelector<DataObjectT>::size() {
+        return _queues.size();
+    }
+
+    template <class DataObjectT>
+    int QueueSelector<DataObjectT>::wait(W_DEADLINE deadline) {
+        uint32_t gen = _wake_gen;
+        int res = -1;
+        _ec.await_until([this, gen, &res]() -> bool {
+            res = _ready();
+            return res >= 0 || _wake_gen != gen;
+        }, deadline);
+        return res;
+    }
+
+    template <class DataObjectT>
+    template <class Rep, class Period>
+    int QueueSelector<DataObjectT>::wait_for(const std::chrono::duration<Rep, Period> & timeout) {
+        return wait(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+    }
+
+    template <class DataObjectT>
+    void QueueSelector<DataObjectT>::notify_all() {
+        _wake_gen++;
+        _ec.notify_all();
+    }
+
+    // Called by the queues after every enqueue; free while nobody waits
+    template <class DataObjectT>
+    void QueueSelector<DataObjectT>::on_enqueue() {
+        _ec.notify_all();
+    }
+
+    // Start scanning after the queue that fired last, so a busy queue can not starve the others
+    template <class DataObjectT>
+    int QueueSelector<DataObjectT>::_ready() {
+        size_t n = _queues.size();
+        size_t start = _next.load(std::memory_order_relaxed);
+        for (size_t k = 0; k < n; k++) {
+            size_t i = (start + k) % n;
+            if (_queues[i]->queue_size() > 0) {
+                _next.store(i + 1, std::memory_order_relaxed);
+                return (int) i;
+            }
+        }
+        return -1;
+    }
+
+} } }
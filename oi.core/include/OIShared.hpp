@@ -0,0 +1,132 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "OIWorker.hpp"
+
+namespace oi { namespace core { namespace worker {
+
+    // Buffer of a SharedObjectPool, as a slot index; handles mean the same in every
+    // process that maps the segment, pointers do not.
+    typedef uint32_t W_SHM_HANDLE;
+    const W_SHM_HANDLE W_SHM_NONE = 0xffffffff;
+    // Queues a shared segment can hold besides its pool
+    const size_t W_SHM_MAX_QUEUES = 8;
+
+    // Sits in front of every shared buffer; the payload starts one cache line later
+    struct SharedSlot {
+        uint32_t data_start;
+        uint32_t data_end;
+        // Free for the application, e.g. the message family of the payload
+        uint32_t tag;
+        uint32_t reserved;
+    };
+
+    class SharedWorkerQueue;
+
+    // ObjectPool and WorkerQueues in a named POSIX shared memory segment (Linux only), so a
+    // capture process and a streaming process exchange buffers without copying them. One
+    // process creates the segment, others open it by name; all of them acquire, enqueue,
+    // dequeue and release through lock-free rings in the segment and block on process
+    // shared futexes. The creator unlinks the name when it is destroyed; processes that
+    // still have the segment open keep using it until they close it too.
+    // Buffers held by a process that dies are not recovered.
+    class SharedObjectPool {
+    public:
+        // Creates name with n buffers of buffer_size bytes and n_queues queues, replacing a
+        // stale segment of that name. slab_flags: W_SLAB_PREFAULT and W_SLAB_MLOCK
+        SharedObjectPool(const std::string & name, size_t n, size_t buffer_size, size_t n_queues,
+                         uint32_t slab_flags = W_SLAB_DEFAULT);
+        // Opens a segment created by another process; throws OIError if there is none
+        explicit SharedObjectPool(const std::string & name);
+        ~SharedObjectPool();
+        // W_SHM_NONE when non-blocking and empty, on timeout or after notify_all
+        W_SHM_HANDLE acquire(W_FLOW flow, W_DEADLINE deadline = W_NO_DEADLINE);
+        void release(W_SHM_HANDLE handle);
+        SharedSlot * slot(W_SHM_HANDLE handle);
+        uint8_t * buffer(W_SHM_HANDLE handle);
+        SharedWorkerQueue * queue(size_t i);
+        size_t n_queues();
+        size_t buffer_size();
+        size_t pool_size();
+        size_t pool_capacity();
+        size_t segment_size();
+        std::string name();
+        // True in the process that created the segment
+        bool owner();
+        // Wakes blocked acquisitions in every process
+        void notify_all();
+
+        SharedObjectPool(const SharedObjectPool&) = delete;
+        SharedObjectPool& operator=(const SharedObjectPool&) = delete;
+    private:
+        void _map(int fd, size_t size);
+        void _attach();
+        std::string _name;
+        bool _owner;
+        uint8_t * _base;
+        size_t _size;
+        void * _header;
+        void * _pool_ring;
+        std::vector<SharedWorkerQueue *> _queues;
+    };
+
+    // Queue of filled buffers inside a SharedObjectPool's segment
+    class SharedWorkerQueue {
+    public:
+        void enqueue(W_SHM_HANDLE handle);
+        // W_SHM_NONE when non-blocking and empty, on timeout, after notify_all or once closed and empty
+        W_SHM_HANDLE dequeue(W_FLOW flow, W_DEADLINE deadline = W_NO_DEADLINE);
+        size_t queue_size();
+        // Seen by every process: the consumer drains what is queued and then gets W_SHM_NONE
+        void close();
+        bool closed();
+        void notify_all();
+        SharedObjectPool * pool();
+
+        SharedWorkerQueue(const SharedWorkerQueue&) = delete;
+        SharedWorkerQueue& operator=(const SharedWorkerQueue&) = delete;
+    private:
+        friend class SharedObjectPool;
+        SharedWorkerQueue(SharedObjectPool * pool, void * ring);
+        SharedObjectPool * _pool;
+        void * _ring;
+    };
+
+    // Scoped ownership of a shared buffer, like DataObjectAcquisition: the buffer goes
+    // back to the pool at the end of the scope unless it was enqueued.
+    class SharedAcquisition {
+    public:
+        SharedAcquisition(SharedObjectPool * pool, W_FLOW flow, W_DEADLINE deadline = W_NO_DEADLINE);
+        SharedAcquisition(SharedWorkerQueue * queue, W_FLOW flow, W_DEADLINE deadline = W_NO_DEADLINE);
+        ~SharedAcquisition();
+        void enqueue(SharedWorkerQueue * queue);
+        W_SHM_HANDLE handle;
+        // nullptr when nothing was acquired
+        SharedSlot * slot;
+        uint8_t * data;
+
+        SharedAcquisition(const SharedAcquisition&) = delete;
+        SharedAcquisition& operator=(const SharedAcquisition&) = delete;
+    private:
+        void _set(W_SHM_HANDLE h);
+        SharedObjectPool * _pool;
+    };
+
+} } }
@@ -0,0 +1,128 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "OIClock.hpp"
+
+// Timeline of what each thread was doing, for chrome://tracing or ui.perfetto.dev.
+// OI_TRACE_SPAN("name") records the enclosing scope as one span of the calling thread.
+// Spans are off until Spans::enable(); while off a span costs a relaxed load and a branch.
+// The name must be a string literal (only the pointer is kept).
+#define OI_SPAN_CONCAT2(a, b) a##b
+#define OI_SPAN_CONCAT(a, b) OI_SPAN_CONCAT2(a, b)
+#define OI_TRACE_SPAN(span_name) oi::core::worker::ScopedSpan OI_SPAN_CONCAT(_oi_span_, __LINE__)(span_name)
+
+namespace oi { namespace core { namespace worker {
+
+    // Spans each thread keeps; older ones are overwritten
+    const size_t W_SPAN_RING_SIZE = 4096;
+    // Spans nested this deep or deeper are not recorded
+    const size_t W_SPAN_MAX_DEPTH = 32;
+
+    // One thread's spans. Only the owning thread writes; the exporter reads concurrently
+    // and drops the spans that were overwritten while it copied them.
+    class SpanRing {
+    public:
+        SpanRing(uint64_t tid, const std::string & thread_name);
+        void push(const char * name, uint64_t start_ns, uint64_t end_ns, uint64_t arg);
+        struct Span {
+            const char * name;
+            uint64_t start_ns;
+            uint64_t end_ns;
+            uint64_t arg;
+        };
+        // Copies out the spans still held, oldest first
+        void read(std::vector<Span> & out) const;
+        void clear();
+        const uint64_t tid;
+        const std::string thread_name;
+    private:
+        struct Slot {
+            std::atomic<const char *> name;
+            std::atomic<uint64_t> start_ns;
+            std::atomic<uint64_t> end_ns;
+            std::atomic<uint64_t> arg;
+        };
+        Slot _slots[W_SPAN_RING_SIZE];
+        std::atomic<uint64_t> _head;
+    };
+
+    class Spans {
+    public:
+        // Record one in every sample_every outermost spans per thread (with everything nested
+        // in them); 1 records everything, 0 turns recording off
+        static void enable(uint32_t sample_every = 1);
+        static void disable();
+        static bool enabled();
+        static uint32_t sample_every();
+        // Chrome trace-event JSON of all spans held; false if the file cannot be written
+        static bool write(const std::string & path);
+        // Writes path when the process exits, and (where there is SIGUSR1) whenever it gets
+        // SIGUSR1. The signal only raises a flag; the file is written from the shared TimerWheel.
+        static void write_on_exit(const std::string & path);
+        static void write_on_signal(const std::string & path);
+        static void clear();
+        // Ring of the calling thread, created on first use
+        static SpanRing * ring();
+    private:
+        static std::atomic<uint32_t> _sample_every;
+    friend class ScopedSpan;
+        static std::mutex & _mutex();
+        static std::vector<SpanRing *> & _rings();
+        static std::string & _path();
+    };
+
+    // Records its lifetime as a span of the calling thread
+    class ScopedSpan {
+    public:
+        explicit ScopedSpan(const char * name);
+        ~ScopedSpan();
+        // Shows up as args.arg on the span, e.g. a sequence number or byte count
+        void arg(uint64_t value);
+
+        ScopedSpan(const ScopedSpan&) = delete;
+        ScopedSpan& operator=(const ScopedSpan&) = delete;
+    private:
+        void _begin();
+        void _end();
+        const char * _name;
+        uint64_t _start_ns;
+        uint64_t _arg;
+        bool _entered;
+        bool _recording;
+    };
+
+    inline ScopedSpan::ScopedSpan(const char * name)
+    : _name(name), _start_ns(0), _arg(0), _entered(false), _recording(false) {
+        if (Spans::_sample_every.load(std::memory_order_relaxed) != 0) _begin();
+    }
+
+    inline ScopedSpan::~ScopedSpan() {
+        if (_entered) _end();
+    }
+
+    inline void ScopedSpan::arg(uint64_t value) {
+        _arg = value;
+    }
+
+} } }
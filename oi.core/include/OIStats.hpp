@@ -0,0 +1,97 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace oi { namespace core { namespace worker {
+
+    // Point in time copy of the counters of one named queue or pool.
+    //  enqueued/dequeued - objects put in / taken out (for pools: returned / acquired)
+    //  depth             - objects held right now (for pools: free objects)
+    //  max_depth         - high-water mark of depth
+    //  min_depth         - low-water mark of depth (for pools: capacity - min_depth is the peak in use)
+    //  queued_ns         - total time dequeued objects spent in the queue (queues only)
+    //  waits/wait_ns     - number and total time of blocking waits for a ready/free object
+    struct WorkerStatsSnapshot {
+        std::string name;
+        std::string kind;
+        uint64_t enqueued;
+        uint64_t dequeued;
+        int64_t depth;
+        int64_t max_depth;
+        int64_t min_depth;
+        uint64_t queued_ns;
+        uint64_t waits;
+        uint64_t wait_ns;
+        // Mean time an object spent queued, in microseconds
+        double mean_queued_us() const;
+        // Mean blocking wait, in microseconds
+        double mean_wait_us() const;
+    };
+
+    // Lock-free counters of a WorkerQueue or ObjectPool, created by their set_name().
+    // Registered with the WorkerRegistry for as long as they exist.
+    class WorkerStats {
+    public:
+        WorkerStats(const std::string & name, const char * kind, int64_t depth);
+        ~WorkerStats();
+        const std::string name;
+        const char * const kind;
+        void on_put(size_t n);
+        void on_take(size_t n);
+        // Queued objects that were dropped by an overflow policy
+        void on_evict(size_t n);
+        void on_queued(uint64_t ns);
+        void on_wait(uint64_t ns);
+        WorkerStatsSnapshot snapshot() const;
+        // Monotonic timestamp for queued and wait times
+        static uint64_t now_ns();
+
+        WorkerStats(const WorkerStats&) = delete;
+        WorkerStats& operator=(const WorkerStats&) = delete;
+    private:
+        void _depth_changed(int64_t depth);
+        std::atomic<uint64_t> _enqueued;
+        std::atomic<uint64_t> _dequeued;
+        std::atomic<int64_t> _depth;
+        std::atomic<int64_t> _max_depth;
+        std::atomic<int64_t> _min_depth;
+        std::atomic<uint64_t> _queued_ns;
+        std::atomic<uint64_t> _waits;
+        std::atomic<uint64_t> _wait_ns;
+    };
+
+    // All named queues and pools of the process
+    class WorkerRegistry {
+    public:
+        static std::vector<WorkerStatsSnapshot> snapshot();
+        // One line per queue/pool on stdout
+        static void print();
+    private:
+        static void _add(WorkerStats * stats);
+        static void _remove(WorkerStats * stats);
+        static std::mutex & _mutex();
+        static std::vector<WorkerStats *> & _all();
+    friend class WorkerStats;
+    };
+} } }
@@ -0,0 +1,61 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace oi { namespace core { namespace worker {
+
+    // Longest thread name the OS keeps (pthread names are 16 bytes including the terminator)
+    const size_t W_THREAD_NAME_MAX = 15;
+
+    // Where and how a thread runs. No cpus means any CPU; priority 0 keeps the default
+    // policy, 1..99 runs the thread SCHED_FIFO (needs CAP_SYS_NICE or an rtprio limit).
+    struct ThreadConfig {
+        std::vector<int> cpus;
+        int priority = 0;
+    };
+
+    // Starts and names the library's threads and applies the affinity and priority
+    // configured for them. Configs are looked up by name prefix, the longest match wins,
+    // so "oi.udp" covers "oi.udp.send" and "oi.udp.recv" unless those have their own.
+    class Threads {
+    public:
+        static void configure(const std::string & prefix, const ThreadConfig & config);
+        // "prefix=cpus;prefix=cpus", cpus as "0,2,4-7"; throws OIError on malformed specs
+        static void configure_cpus(const std::string & spec);
+        // "prefix=priority;prefix=priority"; throws OIError on malformed specs
+        static void configure_priorities(const std::string & spec);
+        // Config that applies to a thread with this name
+        static ThreadConfig config(const std::string & name);
+        // Starts fn on a new thread that names itself and applies its config first
+        static std::thread * spawn(const std::string & name, std::function<void()> fn);
+        // Names the calling thread and applies its config; failures are logged, not thrown
+        static void apply(const std::string & name);
+
+        // Calling thread only; false where unsupported or when the call fails
+        static bool set_name(const std::string & name);
+        static std::string name();
+        static bool set_affinity(const std::vector<int> & cpus);
+        static std::vector<int> affinity();
+        static bool set_priority(int priority);
+    };
+
+} } }
@@ -0,0 +1,117 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "OIWorker.hpp"
+#include "OIExecutor.hpp"
+
+namespace oi { namespace core { namespace worker {
+
+    const size_t TIMER_LEVELS = 4;
+    const size_t TIMER_SLOTS = 256; // per level, 8 bits of the expiry tick each
+
+    // Hierarchical timer wheel (Varghese & Lauck). Level 0 has one slot per tick; a slot of
+    // level n covers 256^n ticks and is spread over the level below when its time comes.
+    // Scheduling and cancelling are O(1), and the wheel thread sleeps until the next
+    // non-empty slot instead of ticking, so idle timers cost nothing. Timers never fire
+    // early; they fire at most one tick late (plus scheduling jitter).
+    //
+    // Callbacks run on the wheel thread, or on executor when one is given. They should be
+    // short; long work belongs on an Executor or a WorkerQueue.
+    class TimerWheel {
+    public:
+        typedef std::function<void()> Callback;
+        typedef uint64_t TimerId; // 0 is never a valid id
+        explicit TimerWheel(std::chrono::microseconds tick);
+        TimerWheel(std::chrono::microseconds tick, Executor * executor);
+        ~TimerWheel();
+        TimerId schedule_at(W_DEADLINE when, Callback cb);
+        template <class Rep, class Period>
+        TimerId schedule(const std::chrono::duration<Rep, Period> & delay, Callback cb);
+        // First run after one period; a run that is late does not shift the ones after it
+        template <class Rep, class Period>
+        TimerId schedule_every(const std::chrono::duration<Rep, Period> & period, Callback cb);
+        // False if the timer already fired (one-shot) or was cancelled. Without an executor,
+        // a callback of this timer that is running on the wheel thread finishes before cancel returns.
+        bool cancel(TimerId id);
+        size_t pending();
+        std::chrono::microseconds tick();
+        // Stops the wheel thread; pending timers are dropped
+        void shutdown();
+        // Process wide wheel with 100us ticks, callbacks on its own thread
+        static TimerWheel * shared();
+
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+    private:
+        struct Timer {
+            uint64_t expiry;    // in ticks since _origin
+            W_DEADLINE when;
+            std::chrono::steady_clock::duration period;
+            Callback cb;
+            uint32_t gen;
+            int32_t slot;       // level * TIMER_SLOTS + index, _far_slot, or -1 when free
+            int32_t prev;
+            int32_t next;
+        };
+        TimerId _add(W_DEADLINE when, std::chrono::steady_clock::duration period, Callback cb);
+        void _link(int32_t t);
+        void _unlink(int32_t t);
+        void _release(int32_t t);
+        uint64_t _tick_of(W_DEADLINE when);
+        bool _next_event(uint64_t & tick);
+        void _process(uint64_t tick, std::vector<int32_t> & fired);
+        void _run();
+        std::chrono::steady_clock::time_point _origin;
+        std::chrono::steady_clock::duration _tick;
+        Executor * _executor;
+        std::vector<Timer> _timers;
+        std::vector<int32_t> _free;
+        int32_t _heads[TIMER_LEVELS * TIMER_SLOTS + 1];
+        uint64_t _occupied[TIMER_LEVELS][TIMER_SLOTS / 64];
+        int32_t _far_slot;  // timers more than 256^4 ticks ahead
+        uint64_t _current;  // next tick to process
+        uint64_t _wake_at;  // tick the wheel thread sleeps until, UINT64_MAX when idle
+        size_t _pending;
+        TimerId _firing;
+        bool _running;
+        std::mutex _m;
+        std::condition_variable _cv;
+        std::condition_variable _cv_fired;
+        std::thread * _thread;
+    };
+
+    template <class Rep, class Period>
+    TimerWheel::TimerId TimerWheel::schedule(const std::chrono::duration<Rep, Period> & delay, Callback cb) {
+        return schedule_at(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay), cb);
+    }
+
+    template <class Rep, class Period>
+    TimerWheel::TimerId TimerWheel::schedule_every(const std::chrono::duration<Rep, Period> & period, Callback cb) {
+        std::chrono::steady_clock::duration p = std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+        if (p.count() <= 0) throw OIError("Timer period must be positive.");
+        return _add(std::chrono::steady_clock::now() + p, p, cb);
+    }
+
+} } }
@@ -0,0 +1,113 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "OIClock.hpp"
+
+// Per-packet latency tracing. Built with OI_TRACE (cmake -DOI_TRACE=ON) every DataObject
+// carries up to W_TRACE_MAX_STAMPS (stage, Clock::now_ns()) stamps: named queues stamp
+// objects going in and coming out, producers and senders stamp with OI_TRACE_STAMP.
+// When the object goes back to its pool the time between consecutive stamps is added to
+// the histogram of the later stage, so each stage shows how long it took to get there.
+// Objects fanned out to several queues keep being stamped on every branch; there a stamp
+// follows the last one its thread made (a queue's wait stamp: that queue's enq stamp).
+// Without OI_TRACE objects carry no stamps and OI_TRACE_STAMP compiles to nothing.
+#ifdef OI_TRACE
+#define OI_TRACE_STAMP(obj, stage_name) do { \
+        static const uint16_t _oi_trace_stage = oi::core::worker::Tracer::stage(stage_name); \
+        (obj)->trace(_oi_trace_stage); \
+    } while (0)
+// Stamp with an earlier Clock::now_ns() time, e.g. when the frame was captured
+#define OI_TRACE_STAMP_AT(obj, stage_name, ns) do { \
+        static const uint16_t _oi_trace_stage = oi::core::worker::Tracer::stage(stage_name); \
+        (obj)->trace(_oi_trace_stage, (ns)); \
+    } while (0)
+#else
+#define OI_TRACE_STAMP(obj, stage_name) do {} while (0)
+#define OI_TRACE_STAMP_AT(obj, stage_name, ns) do {} while (0)
+#endif
+
+namespace oi { namespace core { namespace worker {
+
+    const size_t W_TRACE_MAX_STAMPS = 12;
+    const size_t W_TRACE_MAX_STAGES = 64;
+    // Linear sub-buckets per power of two: values are kept to within 1/8 (12.5%)
+    const size_t W_HIST_SUB_BITS = 3;
+    const size_t W_HIST_SUB = 1 << W_HIST_SUB_BITS;
+    const size_t W_HIST_BUCKETS = (64 - W_HIST_SUB_BITS + 1) * W_HIST_SUB;
+
+    struct TraceStamp {
+        uint16_t stage;
+        // Stage of the stamp this one is measured from, 0: the one before it
+        uint16_t after;
+        // Stamping thread, only compared for stamps made while the object was shared
+        uint16_t thread;
+        bool shared;
+        uint64_t ns;
+    };
+
+    // HDR style histogram of nanosecond latencies: log2 buckets split in W_HIST_SUB linear
+    // sub-buckets, so it covers 1ns to hours in a fixed 4KB with bounded relative error.
+    // record() is a relaxed atomic add and may be called from any thread.
+    class LatencyHistogram {
+    public:
+        LatencyHistogram();
+        void record(uint64_t ns);
+        void clear();
+        uint64_t count() const;
+        uint64_t max() const;
+        double mean() const;
+        // Upper bound of the bucket holding the p-th percentile (0 < p <= 100); 0 when empty
+        uint64_t percentile(double p) const;
+        static size_t bucket(uint64_t ns);
+        static uint64_t bucket_max(size_t i);
+
+        LatencyHistogram(const LatencyHistogram&) = delete;
+        LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+    private:
+        std::atomic<uint64_t> _buckets[W_HIST_BUCKETS];
+        std::atomic<uint64_t> _count;
+        std::atomic<uint64_t> _sum;
+        std::atomic<uint64_t> _max;
+    };
+
+    // Process wide trace stages and their histograms. Stage 0 holds the total time from
+    // the first to the last stamp of each object.
+    class Tracer {
+    public:
+        // Id of the stage with this name, registered on first use; 0 once W_TRACE_MAX_STAGES are taken
+        static uint16_t stage(const std::string & name);
+        static std::string stage_name(uint16_t stage);
+        static LatencyHistogram * histogram(uint16_t stage);
+        // Adds the delta of every stamp to the one it follows to the stage histograms
+        static void collect(const TraceStamp * stamps, size_t n);
+        static void clear();
+        // One line per stage that saw objects, on stdout
+        static void print();
+    private:
+        static std::mutex & _mutex();
+        static std::vector<std::string> & _names();
+        static std::atomic<LatencyHistogram *> _histograms[W_TRACE_MAX_STAGES];
+    };
+
+} } }
@@ -16,40 +16,292 @@ along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
 */
 #pragma once
 
+#include <algorithm>
 #include <queue>
+#include <deque>
 #include <string>
 #include <exception>
+#include <functional>
+#include <stdexcept>
 #include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <vector>
+#include "OIRing.hpp"
+#include "OIEventCount.hpp"
+#include "OIStats.hpp"
+#include "OITrace.hpp"
+#include "OICensus.hpp"
 
 namespace oi { namespace core { namespace worker {
-    
+
     enum W_TYPE { W_TYPE_UNUSED, W_TYPE_QUEUED };
     enum W_FLOW { W_FLOW_BLOCKING, W_FLOW_NONBLOCKING };
+    // Point in time at which a blocking acquisition gives up and returns an empty object
+    typedef std::chrono::steady_clock::time_point W_DEADLINE;
+    const W_DEADLINE W_NO_DEADLINE = W_DEADLINE::max();
     enum Q_IO { Q_IO_IN, Q_IO_MIDDLEWARE, Q_IO_OUT };
-    
+
+    // Storage behind the unused pool and the ready queue:
+    //  W_BACKEND_MUTEX    - std::queue guarded by a mutex (unbounded)
+    //  W_BACKEND_LOCKFREE - bounded MPMCRing, no lock on the enqueue/dequeue path
+    enum W_BACKEND { W_BACKEND_MUTEX, W_BACKEND_LOCKFREE };
+
+    // How a blocking dequeue waits for a WorkerQueue to fill:
+    //  W_WAIT_BLOCK - sleep right away; no CPU while idle, every object pays a futex wakeup
+    //  W_WAIT_SPIN  - poll for a number of rounds, then sleep (default)
+    //  W_WAIT_POLL  - never sleep; burns a core, for consumers pinned to a dedicated CPU
+    enum W_WAIT { W_WAIT_BLOCK, W_WAIT_SPIN, W_WAIT_POLL };
+
+    // What WorkerQueue::enqueue does when the queue holds its limit of objects:
+    //  W_OVERFLOW_BLOCK       - wait for a consumer to make room, or until the queue is closed (default)
+    //  W_OVERFLOW_DROP_NEWEST - release the incoming object back to its pool
+    //  W_OVERFLOW_DROP_OLDEST - evict the oldest queued objects back to their pool, so only the latest limit stay queued
+    enum W_OVERFLOW { W_OVERFLOW_BLOCK, W_OVERFLOW_DROP_NEWEST, W_OVERFLOW_DROP_OLDEST };
+
+    // How a WorkerQueue with several priority lanes picks the next object (higher lanes first):
+    //  W_LANES_STRICT   - always the highest non-empty lane
+    //  W_LANES_WEIGHTED - up to weight[i] objects from lane i per round, so low lanes keep moving
+    enum W_LANES { W_LANES_STRICT, W_LANES_WEIGHTED };
+
+    // Maximum number of queues a single DataObjectAcquisition can fan out to
+    const size_t W_MAX_FANOUT = 8;
+
+    // Maximum number of segments a DataObject chains behind its payload
+    const size_t W_MAX_SEGMENTS = 8;
+
+    // ObjectPool slab options
+    const uint32_t W_SLAB_DEFAULT    = 0;
+    const uint32_t W_SLAB_HUGEPAGES  = 1 << 0; // MAP_HUGETLB, falling back to transparent huge pages
+    const uint32_t W_SLAB_PREFAULT   = 1 << 1; // touch every page up front
+    const uint32_t W_SLAB_MLOCK      = 1 << 2; // keep the slab resident (needs RLIMIT_MEMLOCK)
+
+    // Number of magazines of an ObjectPool. The first W_MAGAZINE_SLOTS threads to acquire from
+    // a pool claim one each for good; later ones take from the shared pool directly.
+    const size_t W_MAGAZINE_SLOTS = 16;
+
+    // Queue policies, selected at compile time: WorkerQueue<T, SPSC>
+    //  MPMC - any number of producers and consumers (default)
+    //  SPSC - exactly one producer thread and one consumer thread, wait-free SPSCRing
+    struct MPMC {};
+    struct SPSC {};
+
     template <class DataObjectT>
     class DataObjectAcquisition;
-    
+
+    template <class DataObjectT>
+    class DataObjectBatch;
+
+    template <class DataObjectT, class QueuePolicy = MPMC>
+    class WorkerQueue;
+
+    template <class DataObjectT>
+    class TieredObjectPool;
+
+    // Common size classes of a TieredObjectPool: control messages and small payloads
+    const size_t W_TIER_SMALL   = 512;
+    const size_t W_TIER_MEDIUM  = 4096;
+
+    class OIError : public std::runtime_error {
+    public:
+        OIError(std::string m) : runtime_error(m) {}
+    };
+
+    class DataObject;
+
+    // Part of a message that stays in memory the DataObject does not own (a string body,
+    // device or encoder output). release, if set, runs once the object no longer needs it.
+    struct DataSegment {
+        const uint8_t * data;
+        size_t size;
+        std::function<void()> release;
+    };
+
+    // Called on the producer's thread after objects were enqueued into a WorkerQueue
+    // (see ExecutorConsumer). Must not enqueue into the same queue.
+    class WorkerQueueListener {
+    public:
+        virtual ~WorkerQueueListener() {}
+        virtual void on_enqueue() = 0;
+    };
+
+    // Type independent part of ObjectPool: one contiguous, cache line aligned slab
+    // that all object buffers of the pool are carved from.
+    class ObjectPoolBase {
+    public:
+        ObjectPoolBase(size_t n, size_t buffer_size, uint32_t slab_flags);
+        ~ObjectPoolBase();
+        size_t slab_size();
+        size_t buffer_size();
+        size_t buffer_stride();
+        bool huge_pages();
+        bool locked();
+
+        ObjectPoolBase(const ObjectPoolBase&) = delete;
+        ObjectPoolBase& operator=(const ObjectPoolBase&) = delete;
+    protected:
+        // Small per-thread index, assigned on first use
+        static size_t _thread_slot();
+        uint8_t * _carve(size_t buffer_size);
+        bool _contains(const uint8_t * p);
+        uint8_t * _slab;
+        size_t _slab_size;
+        size_t _buffer_size;
+        size_t _stride;
+        size_t _n_slots;
+        size_t _n_carved;
+        bool _mapped;
+        bool _huge_pages;
+        bool _locked;
+        // Objects keep their owner tags up to date (ObjectPool::enable_census)
+        std::atomic<bool> _census;
+    friend class DataObject;
+    };
+
     template <class DataObjectT>
-    class ObjectPool {
+    class ObjectPool : public ObjectPoolBase {
     public:
         ObjectPool(size_t n, size_t buffer_size);
-        std::condition_variable have_unused_cv;
+        ObjectPool(size_t n, size_t buffer_size, W_BACKEND backend);
+        ObjectPool(size_t n, size_t buffer_size, W_BACKEND backend, uint32_t slab_flags);
+        ~ObjectPool();
         std::queue<std::unique_ptr<DataObjectT>> _queue_unused;
         size_t pool_size();
+        size_t pool_capacity();
+        W_BACKEND backend();
+        void notify_all();
+        // Give every thread that acquires from the pool a cache of up to magazine_size free objects.
+        // Acquire and release then only touch the thread's own magazine; it is refilled from and
+        // flushed to the shared pool in batches of magazine_size/2. Threads that only release
+        // (a sender returning what the device thread acquired) put objects straight back into the
+        // shared pool, where the acquiring thread picks them up with its next refill.
+        // Call before the pool is used by other threads.
+        void enable_magazines(size_t magazine_size);
+        bool magazines_enabled();
+        uint64_t magazine_hits();
+        uint64_t magazine_misses();
+        double magazine_hit_rate();
+        // Name the pool and start counting acquisitions, returns and blocking waits (see WorkerRegistry)
+        void set_name(const std::string & name);
+        std::string name();
+        WorkerStats * stats();
+        // Reserve room in front of and behind the payload of every object, so headers and
+        // trailers can be added without moving it (see DataObject::push_header).
+        // Call while every object is in the pool, before the pool is shared.
+        void set_headroom(size_t headroom, size_t tailroom = 0);
+        size_t headroom();
+        size_t tailroom();
+        // Payload bytes an object holds with the reserved room taken off
+        size_t payload_capacity();
+        // Tag objects with who holds them (the acquiring or dequeuing thread, the named queue they
+        // wait in) and since when, and report it per owner with census() and Census::print().
+        // Call while every object is in the pool; throws OIError otherwise.
+        void enable_census();
+        bool census_enabled();
+        PoolCensus census();
         std::mutex _m_unused; // move to private?
-        std::mutex _m_wait; // move to private?
     private:
+        std::unique_ptr<DataObjectT> _take(W_FLOW f, W_DEADLINE deadline = W_NO_DEADLINE);
         void _return(std::unique_ptr<DataObjectT> p);
+        std::unique_ptr<DataObjectT> _take_unused(W_FLOW f, W_DEADLINE deadline = W_NO_DEADLINE);
+        void _return_unused(std::unique_ptr<DataObjectT> p);
+        struct Magazine {
+            std::atomic_flag lock;
+            std::atomic<size_t> n;
+            DataObjectT ** objects;
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            char _pad[OI_CACHE_LINE];
+        };
+        // The calling thread's magazine; claim takes a free one for it. nullptr if it has none.
+        Magazine * _own_magazine(bool claim);
+        std::unique_ptr<DataObjectT> _take_magazine(W_FLOW f, W_DEADLINE deadline);
+        void _return_magazine(DataObjectT * p);
+        DataObjectT * _steal();
+        size_t _take_batch(DataObjectT ** out, size_t n);
+        void _return_batch(DataObjectT ** in, size_t n);
+        size_t _take_many(DataObjectT ** out, size_t n, W_FLOW f);
+        void _return_many(DataObjectT ** in, size_t n);
+        template <class Ready>
+        bool _wait_unused(Ready ready, W_DEADLINE deadline);
+        // Runs fn on every object, if all of them are in the pool; returns false otherwise
+        template <class Fn>
+        bool _with_all_unused(Fn fn);
+        size_t _n_objects;
+        std::vector<DataObjectT *> _objects;
+        W_BACKEND _backend;
+        MPMCRing<DataObjectT *> * _ring_unused;
+        EventCount _unused_ec;
+        std::atomic<uint32_t> _wake_gen;
+        Magazine * _magazines;
+        // Thread slot + 1 of the thread owning each magazine, 0 while unclaimed. Kept apart from
+        // the magazines so looking up one's own never reads a line another thread writes.
+        std::atomic<size_t> * _magazine_owners;
+        // Acquisitions by threads that found no magazine left to claim
+        std::atomic<uint64_t> _magazine_bypass;
+        size_t _magazine_size;
+        WorkerStats * _stats;
+        size_t _headroom;
+        size_t _tailroom;
     template<class>
     friend class DataObjectAcquisition;
+    template<class>
+    friend class DataObjectBatch;
+    template<class, class>
+    friend class WorkerQueue;
+    template<class>
+    friend class TieredObjectPool;
+    };
+
+    // A set of ObjectPools with increasing buffer sizes. Acquiring by size takes an object
+    // from the smallest class that fits, so small messages do not pin frame sized buffers.
+    // Requests larger than the largest class get a one-off heap object (a "large blob")
+    // that is freed instead of returned when released.
+    template <class DataObjectT>
+    class TieredObjectPool {
+    public:
+        TieredObjectPool();
+        ~TieredObjectPool();
+        // Add an existing pool as a size class; it is not deleted by the TieredObjectPool.
+        void add_class(ObjectPool<DataObjectT> * pool);
+        // Create and own a pool for a new size class.
+        ObjectPool<DataObjectT> * add_class(size_t n, size_t buffer_size, W_BACKEND backend, uint32_t slab_flags);
+        // Pool of the smallest class holding size bytes, nullptr if size exceeds all classes
+        ObjectPool<DataObjectT> * pool_for(size_t size);
+        // ObjectPool::set_headroom for every class, including ones added later, and for large
+        // blobs; classes are then picked by payload capacity
+        void set_headroom(size_t headroom, size_t tailroom = 0);
+        size_t headroom();
+        size_t tailroom();
+        // ObjectPool::enable_census for every class, including ones added later
+        void enable_census();
+        size_t n_classes();
+        ObjectPool<DataObjectT> * class_pool(size_t i);
+        size_t max_buffer_size();
+        size_t pool_size();
+        size_t pool_capacity();
+        size_t footprint();
+        void notify_all();
+
+        TieredObjectPool(const TieredObjectPool&) = delete;
+        TieredObjectPool& operator=(const TieredObjectPool&) = delete;
+    private:
+        std::unique_ptr<DataObjectT> _take(size_t size, W_FLOW f);
+        size_t _take_many(size_t size, DataObjectT ** out, size_t n, W_FLOW f);
+        std::vector<ObjectPool<DataObjectT> *> _pools;
+        std::vector<size_t> _sizes;
+        std::vector<bool> _owned;
+        size_t _headroom;
+        size_t _tailroom;
+        bool _census;
+    friend class DataObjectAcquisition<DataObjectT>;
+    friend class DataObjectBatch<DataObjectT>;
     };
-    
-    
-    
+
     class DataObject {
     public:
         DataObject(size_t buffer_size, ObjectPool<DataObject> * _pool);
@@ -57,264 +309,1997 @@ namespace oi { namespace core { namespace worker {
         size_t data_start;
         const size_t buffer_size;
         uint8_t * const buffer;
+        // Priority lane in the next WorkerQueue (0 is the lowest); reset when returned to the pool
+        uint8_t lane;
+        // Empties the object; the payload starts after the reserved headroom
         virtual void reset();
+        // The payload is buffer[data_start, data_end). Payload writers put() at the back of an
+        // empty object, lower layers then push_header() their headers in front of it without
+        // moving the payload, as long as the object was created with enough headroom
+        // (see ObjectPool::set_headroom).
+        void reserve(size_t headroom, size_t tailroom);
+        size_t reserved_headroom() const;
+        size_t reserved_tailroom() const;
+        uint8_t * payload();
+        size_t payload_size() const;
+        // Most a payload writer can put() into an empty object
+        size_t payload_capacity() const;
+        // Free bytes in front of and behind the payload
+        size_t headroom() const;
+        size_t tailroom() const;
+        // Grow the payload by n bytes at the front, returns its new start; throws OIError without headroom
+        uint8_t * push_header(size_t n);
+        // Strip n bytes from the front of the payload, returns where they start
+        uint8_t * pull_header(size_t n);
+        // Grow the payload by n bytes at the back, returns where they start. put() stays out of
+        // the reserved tailroom, push_trailer() (for lower layers) may use it. Both throw OIError when full.
+        uint8_t * put(size_t n);
+        uint8_t * push_trailer(size_t n);
+        // Chain size bytes at data behind the payload without copying them; senders gather
+        // payload and segments into one datagram. release runs when the object is reset
+        // (subclasses overriding reset() must call DataObject::reset()). Throws OIError
+        // beyond W_MAX_SEGMENTS, after running release.
+        void add_segment(const uint8_t * data, size_t size, std::function<void()> release);
+        size_t n_segments() const;
+        const DataSegment & segment(size_t i) const;
+        // Payload plus segments: the size of the message on the wire
+        size_t message_size() const;
+        // Copy payload and segments into out for consumers that need the message in one
+        // block; returns the bytes copied, 0 if out is smaller than message_size()
+        size_t gather(uint8_t * out, size_t size) const;
         virtual ~DataObject();
+        // True while the object is referenced by more than one queue/consumer (see enqueue_shared).
+        // Shared objects must be treated as read-only.
+        bool shared() const;
+        // Census owner id (see ObjectPool::enable_census) and since when (Clock::now_ns) it holds the object
+        uint16_t owner() const;
+        uint64_t owned_since() const;
+        // Tag the object as held by owner (a Census::owner id), e.g. while the application keeps it;
+        // a no-op unless the pool has census enabled
+        void set_owner(uint16_t owner);
+#ifdef OI_TRACE
+        // Appends a (stage, Clock::now_ns()) stamp; a no-op once W_TRACE_MAX_STAMPS are taken.
+        // Safe on every branch of a shared object. Stamps are collected by the Tracer on reset().
+        void trace(uint16_t stage);
+        void trace(uint16_t stage, uint64_t ns);
+        size_t n_trace() const;
+        const TraceStamp & trace_stamp(size_t i) const;
+#endif
     private:
         // TODO: could be stack?
         ObjectPool<DataObject> * _return_to_pool;
+        std::atomic<uint32_t> _refs;
+        // When the object entered its current queue, only stamped by named queues
+        std::atomic<uint64_t> _queued_at;
+        bool _owns_buffer;
+        size_t _headroom;
+        size_t _tailroom;
+        std::vector<DataSegment> _segments;
+        void _release_segments();
+        const std::atomic<bool> * _census;
+        std::atomic<uint16_t> _owner;
+        std::atomic<uint64_t> _owned_at;
+        void _set_thread_owner();
+#ifdef OI_TRACE
+        // Stamp measured from the last stamp of stage after (see TraceStamp)
+        void _trace_after(uint16_t stage, uint16_t after, uint64_t ns);
+        TraceStamp _trace[W_TRACE_MAX_STAMPS];
+        // Slots handed out so far; may run past W_TRACE_MAX_STAMPS, only read in reset()
+        std::atomic<size_t> _n_trace;
+#endif
+        static uint8_t * _allocate_buffer(size_t buffer_size, ObjectPool<DataObject> * pool);
     template<class>
     friend class DataObjectAcquisition;
+    template<class>
+    friend class DataObjectBatch;
+    template<class, class>
+    friend class WorkerQueue;
+    template<class>
+    friend class ObjectPool;
     };
-    
-    template <class DataObjectT>
+
+    inline void DataObject::set_owner(uint16_t owner) {
+        if (_census == nullptr || !_census->load(std::memory_order_relaxed)) return;
+        _owner.store(owner, std::memory_order_relaxed);
+        _owned_at.store(Clock::now_ns(), std::memory_order_relaxed);
+    }
+
+    inline void DataObject::_set_thread_owner() {
+        if (_census == nullptr || !_census->load(std::memory_order_relaxed)) return;
+        set_owner(Census::thread_owner());
+    }
+
+    template <class DataObjectT, class QueuePolicy>
     class WorkerQueue {
         static_assert(std::is_base_of<DataObject, DataObjectT>::value, "DataObjectT in WorkerQueue must derive from DataObject");
+        static_assert(std::is_same<QueuePolicy, MPMC>::value, "Unknown WorkerQueue policy");
     public:
+        WorkerQueue();
         WorkerQueue(ObjectPool<DataObjectT> * objectPool);
-        ~WorkerQueue();
+        WorkerQueue(W_BACKEND backend, size_t capacity);
+        WorkerQueue(W_BACKEND backend, size_t capacity, W_OVERFLOW overflow, size_t limit);
+        WorkerQueue(ObjectPool<DataObjectT> * objectPool, W_BACKEND backend);
+        virtual ~WorkerQueue();
         ObjectPool<DataObjectT> * object_pool();
+        W_BACKEND backend();
+        virtual size_t queue_size();
+        // limit is the number of queued objects at which the policy kicks in; 0 means the ring
+        // capacity, or unbounded for the mutex backend (W_OVERFLOW_BLOCK only).
+        // Blocked producers give up when the queue is closed and release their object.
+        // Applies to every lane; see set_lane_overflow to treat lanes differently.
+        void set_overflow(W_OVERFLOW overflow, size_t limit);
+        W_OVERFLOW overflow();
+        size_t limit();
+        // Policy and limit of a single lane, e.g. to shed bulk data while control messages never drop.
+        // Evicting an object that was fanned out only releases this queue's reference.
+        virtual void set_lane_overflow(size_t lane, W_OVERFLOW overflow, size_t limit);
+        W_OVERFLOW lane_overflow(size_t lane);
+        size_t lane_limit(size_t lane);
+        // Objects released by the overflow policy instead of being delivered
+        uint64_t dropped();
+        // Split the queue into weights.size() lanes; objects go into lane DataObject::lane
+        // (clamped to the highest lane). Every lane starts out with the set_overflow policy
+        // and limit, counted per lane. Set before the queue is shared between threads.
+        virtual void set_lanes(const std::vector<uint32_t> & weights, W_LANES mode);
+        void set_lanes(size_t n_lanes);
+        size_t n_lanes();
+        size_t lane_size(size_t lane);
+        // Name the queue and start counting objects, queued time and consumer waits (see WorkerRegistry)
+        void set_name(const std::string & name);
+        std::string name();
+        WorkerStats * stats();
+        // At most one listener; replacing or clearing it waits for calls in progress
+        void set_listener(WorkerQueueListener * listener);
+        WorkerQueueListener * listener();
+        // spins only applies to W_WAIT_SPIN; takes effect for the next wait
+        void set_wait_strategy(W_WAIT wait, size_t spins = EVENTCOUNT_SPIN);
+        W_WAIT wait_strategy();
         void close();
         void notify_all();
     protected:
-        std::unique_ptr<DataObjectT> _get_data(W_TYPE t, W_FLOW f);
-        void _enqueue(std::unique_ptr<DataObjectT> p);
-        std::queue<std::unique_ptr<DataObjectT>> _queue_ready;
-        std::condition_variable have_queued_cv;
+        virtual std::unique_ptr<DataObjectT> _get_data(W_TYPE t, W_FLOW f, W_DEADLINE deadline);
+        virtual void _enqueue(std::unique_ptr<DataObjectT> p);
+        // Move up to n ready objects into out; blocking waits for the first one only
+        virtual size_t _get_batch(DataObjectT ** out, size_t n, W_FLOW f);
+        // Enqueue n objects with one lock round trip and one wakeup
+        virtual void _enqueue_batch(DataObjectT ** in, size_t n);
+        bool _push_ring(DataObjectT * p);
+        bool _push_queue(std::unique_ptr<DataObjectT> p, std::unique_lock<std::mutex> & lk);
+        template <class Pred>
+        bool _wait_queued(Pred ready, W_DEADLINE deadline = W_NO_DEADLINE);
+        void _notify_queued(size_t n = 1);
+        template <class HasSpace>
+        bool _wait_space(HasSpace has_space);
+        void _drop(DataObjectT * p);
+        void _release(DataObjectT * p);
+        void _evict(DataObjectT * p);
+        void _taken(DataObjectT * p);
+        void _notify_listener();
+        size_t _lane_of(DataObjectT * p);
+        template <class TryLane>
+        bool _next_lane(TryLane try_lane);
+        bool _rings_empty();
+        bool _queues_empty();
+        std::deque<std::queue<std::unique_ptr<DataObjectT>>> _queue_lanes;
+        EventCount _queued_ec;
+        // Producers waiting for room under W_OVERFLOW_BLOCK
+        EventCount _space_ec;
         std::mutex _m_ready;
-        std::mutex _m_wait;
         std::atomic<bool> _running;
         ObjectPool<DataObjectT> * _object_pool;
+        W_BACKEND _backend;
+        std::vector<MPMCRing<DataObjectT *> *> _ring_lanes;
+        size_t _ring_capacity;
+        W_LANES _lane_mode;
+        std::vector<uint32_t> _lane_weights;
+        std::atomic<int> * _lane_credits;
+        std::atomic<uint32_t> _wake_gen;
+        std::atomic<W_WAIT> _wait;
+        std::atomic<size_t> _spins;
+        std::atomic<W_OVERFLOW> _overflow;
+        std::atomic<size_t> _limit;
+        std::atomic<W_OVERFLOW> * _lane_overflow;
+        std::atomic<size_t> * _lane_limit;
+        std::atomic<uint64_t> _dropped;
+        WorkerStats * _stats;
+        // Census owner of queued objects: the queue's name, or W_OWNER_QUEUE
+        uint16_t _owner;
+#ifdef OI_TRACE
+        // Trace stages of named queues: "<name>.enq" when an object goes in, "<name>.wait" when it comes out
+        uint16_t _trace_enq;
+        uint16_t _trace_wait;
+#endif
+        std::atomic<WorkerQueueListener *> _listener;
+        std::atomic<int> _listener_calls;
+    private:
+        void _init(ObjectPool<DataObjectT> * objectPool, W_BACKEND backend, size_t capacity);
     friend class DataObjectAcquisition<DataObjectT>;
+    friend class DataObjectBatch<DataObjectT>;
     };
-    
-    // Simple wrapper of an input and output queue using the same object pool
+
+    // Single producer/single consumer queue. Derives from the MPMC queue, so it can be
+    // used wherever a WorkerQueue<T> * is expected; only the ready path is replaced.
+    // Enqueueing from more than one thread, or dequeueing from more than one thread, is undefined.
     template <class DataObjectT>
+    class WorkerQueue<DataObjectT, SPSC> : public WorkerQueue<DataObjectT, MPMC> {
+    public:
+        WorkerQueue(size_t capacity);
+        // Only the producer may release objects, so SPSC supports W_OVERFLOW_BLOCK and W_OVERFLOW_DROP_NEWEST
+        WorkerQueue(size_t capacity, W_OVERFLOW overflow);
+        WorkerQueue(ObjectPool<DataObjectT> * objectPool);
+        ~WorkerQueue();
+        size_t queue_size();
+        void set_lane_overflow(size_t lane, W_OVERFLOW overflow, size_t limit);
+        // SPSC queues have a single lane
+        void set_lanes(const std::vector<uint32_t> & weights, W_LANES mode);
+    protected:
+        std::unique_ptr<DataObjectT> _get_data(W_TYPE t, W_FLOW f, W_DEADLINE deadline);
+        void _enqueue(std::unique_ptr<DataObjectT> p);
+        size_t _get_batch(DataObjectT ** out, size_t n, W_FLOW f);
+        void _enqueue_batch(DataObjectT ** in, size_t n);
+        bool _push_spsc(DataObjectT * p);
+        SPSCRing<DataObjectT *> * _ring_spsc;
+    };
+
+    // Simple wrapper of an input and output queue using the same object pool
+    template <class DataObjectT, class QueuePolicy = MPMC>
     class IOWorker {
         static_assert(std::is_base_of<DataObject, DataObjectT>::value, "DataObjectT in WorkerQueue must derive from DataObject");
-        friend class WorkerQueue<DataObjectT>;
+        friend class WorkerQueue<DataObjectT, QueuePolicy>;
     public:
         IOWorker(ObjectPool<DataObjectT> * objectPool);
+        IOWorker(ObjectPool<DataObjectT> * objectPool, W_BACKEND backend);
         //ObjectPool<DataObjectT> * object_pool();
-        WorkerQueue<DataObjectT> * in();
-        WorkerQueue<DataObjectT> * out();
+        WorkerQueue<DataObjectT, QueuePolicy> * in();
+        WorkerQueue<DataObjectT, QueuePolicy> * out();
         void close();
     protected:
-        WorkerQueue<DataObjectT> * _in;
-        WorkerQueue<DataObjectT> * _out;
+        WorkerQueue<DataObjectT, QueuePolicy> * _in;
+        WorkerQueue<DataObjectT, QueuePolicy> * _out;
     };
-    
-    template <class DataObjectT>
-    IOWorker<DataObjectT>::IOWorker(ObjectPool<DataObjectT> * object_pool) {
-        _in = new worker::WorkerQueue<DataObjectT>(object_pool);
-        _out = new worker::WorkerQueue<DataObjectT>(object_pool);
+
+    template <class DataObjectT, class QueuePolicy>
+    IOWorker<DataObjectT, QueuePolicy>::IOWorker(ObjectPool<DataObjectT> * object_pool) {
+        _in = new worker::WorkerQueue<DataObjectT, QueuePolicy>(object_pool);
+        _out = new worker::WorkerQueue<DataObjectT, QueuePolicy>(object_pool);
     }
-    
-    template <class DataObjectT>
-    WorkerQueue<DataObjectT> * IOWorker<DataObjectT>::in() {
+
+    template <class DataObjectT, class QueuePolicy>
+    IOWorker<DataObjectT, QueuePolicy>::IOWorker(ObjectPool<DataObjectT> * object_pool, W_BACKEND backend) {
+        _in = new worker::WorkerQueue<DataObjectT, QueuePolicy>(object_pool, backend);
+        _out = new worker::WorkerQueue<DataObjectT, QueuePolicy>(object_pool, backend);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueue<DataObjectT, QueuePolicy> * IOWorker<DataObjectT, QueuePolicy>::in() {
         return _in;
     }
-    
-    template <class DataObjectT>
-    WorkerQueue<DataObjectT> * IOWorker<DataObjectT>::out() {
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueue<DataObjectT, QueuePolicy> * IOWorker<DataObjectT, QueuePolicy>::out() {
         return _out;
     }
-    
-    template <class DataObjectT>
-    void IOWorker<DataObjectT>::close() {
+
+    template <class DataObjectT, class QueuePolicy>
+    void IOWorker<DataObjectT, QueuePolicy>::close() {
         _in->close();
         _out->close();
     }
-    
-    
+
+
     template <class DataObjectT>
     class DataObjectAcquisition {
         static_assert(std::is_base_of<DataObject, DataObjectT>::value, "DataObjectT in DataObjectTRef must derive from DataObject");
     public:
         explicit DataObjectAcquisition(WorkerQueue<DataObjectT> * q, W_TYPE t, W_FLOW f);
+        // Take the next ready object from a queue
+        explicit DataObjectAcquisition(WorkerQueue<DataObjectT> * q, W_FLOW f);
+        // Block for the next ready object until deadline or for at most timeout;
+        // data is empty if nothing arrived in time
+        explicit DataObjectAcquisition(WorkerQueue<DataObjectT> * q, W_DEADLINE deadline);
+        template <class Rep, class Period>
+        explicit DataObjectAcquisition(WorkerQueue<DataObjectT> * q, const std::chrono::duration<Rep, Period> & timeout);
+        // Take an unused object straight from a pool
+        explicit DataObjectAcquisition(ObjectPool<DataObjectT> * p, W_FLOW f);
+        explicit DataObjectAcquisition(ObjectPool<DataObjectT> * p, W_DEADLINE deadline);
+        template <class Rep, class Period>
+        explicit DataObjectAcquisition(ObjectPool<DataObjectT> * p, const std::chrono::duration<Rep, Period> & timeout);
+        // Take an unused object with a buffer of at least size bytes
+        explicit DataObjectAcquisition(TieredObjectPool<DataObjectT> * p, size_t size, W_FLOW f);
         ~DataObjectAcquisition();
         void enqueue(WorkerQueue<DataObjectT> * q);
+        // Enqueue into priority lane `lane` of q (and of any queue the object is forwarded to later)
+        void enqueue(WorkerQueue<DataObjectT> * q, uint8_t lane);
         void enqueue();
+        // Hand the same object to several queues without copying. The object goes back
+        // to its pool once the last consumer releases it.
+        void enqueue_shared(WorkerQueue<DataObjectT> * q);
         void release();
         std::unique_ptr<DataObjectT> data;
-        
+
         DataObjectAcquisition(const DataObjectAcquisition&) = delete;
         DataObjectAcquisition& operator=(const DataObjectAcquisition&) = delete;
         DataObjectAcquisition(DataObjectAcquisition&& that);
         DataObjectAcquisition& operator=(DataObjectAcquisition&& that);
     private:
+        void _finish();
+        void _release_data();
         W_TYPE _ref_obj_type;
-        ObjectPool<DataObject>  * _return_to; // ...
+        ObjectPool<DataObjectT> * _return_to;
         WorkerQueue<DataObjectT> * _enqueue_next;
         //WorkerQueue<DataObjectT> * _next;
+        WorkerQueue<DataObjectT> * _enqueue_shared[W_MAX_FANOUT];
+        size_t _n_shared;
         bool _enqueue;
     };
-    
-    class OIError : public std::runtime_error {
+
+    // Up to n objects that are acquired, enqueued or released together, so pool and queue
+    // locks and wakeups are paid once per batch instead of once per object.
+    template <class DataObjectT>
+    class DataObjectBatch {
+        static_assert(std::is_base_of<DataObject, DataObjectT>::value, "DataObjectT in DataObjectBatch must derive from DataObject");
     public:
-        OIError(std::string m) : runtime_error(m) {}
+        // Take up to n unused objects from a pool; blocking only waits for the first one
+        explicit DataObjectBatch(ObjectPool<DataObjectT> * p, size_t n, W_FLOW f);
+        // Take up to n unused objects with buffers of at least size bytes
+        explicit DataObjectBatch(TieredObjectPool<DataObjectT> * p, size_t size, size_t n, W_FLOW f);
+        // Take up to n ready objects from a queue; blocking only waits for the first one
+        explicit DataObjectBatch(WorkerQueue<DataObjectT> * q, size_t n, W_FLOW f);
+        ~DataObjectBatch();
+        size_t size();
+        bool empty();
+        DataObjectT * operator[](size_t i);
+        // Enqueue all objects, in order, into q when the batch goes out of scope
+        void enqueue(WorkerQueue<DataObjectT> * q);
+        void enqueue(WorkerQueue<DataObjectT> * q, uint8_t lane);
+        void release();
+
+        DataObjectBatch(const DataObjectBatch&) = delete;
+        DataObjectBatch& operator=(const DataObjectBatch&) = delete;
+    private:
+        void _finish();
+        void _release_data();
+        std::vector<DataObjectT *> _data;
+        WorkerQueue<DataObjectT> * _enqueue_next;
+        bool _enqueue;
     };
-    
+
+    template <class DataObjectT>
+    ObjectPool<DataObjectT>::ObjectPool(size_t n_worker_objects, size_t buffer_size)
+    : ObjectPool(n_worker_objects, buffer_size, W_BACKEND_MUTEX, W_SLAB_DEFAULT) {}
+
+    template <class DataObjectT>
+    ObjectPool<DataObjectT>::ObjectPool(size_t n_worker_objects, size_t buffer_size, W_BACKEND backend)
+    : ObjectPool(n_worker_objects, buffer_size, backend, W_SLAB_DEFAULT) {}
+
     template <class DataObjectT>
-    ObjectPool<DataObjectT>::ObjectPool(size_t n_worker_objects, size_t buffer_size) {
+    ObjectPool<DataObjectT>::ObjectPool(size_t n_worker_objects, size_t buffer_size, W_BACKEND backend, uint32_t slab_flags)
+    : ObjectPoolBase(n_worker_objects, buffer_size, slab_flags) {
+        _n_objects = n_worker_objects;
+        _backend = backend;
+        _ring_unused = nullptr;
+        _wake_gen = 0;
+        _magazines = nullptr;
+        _magazine_owners = nullptr;
+        _magazine_bypass = 0;
+        _magazine_size = 0;
+        _stats = nullptr;
+        _headroom = 0;
+        _tailroom = 0;
+        if (_backend == W_BACKEND_LOCKFREE) {
+            _ring_unused = new MPMCRing<DataObjectT *>(n_worker_objects);
+        }
         std::unique_lock<std::mutex> lk(_m_unused);
         for (int i = 0; i < n_worker_objects; i++) {
-         std::unique_ptr<DataObjectT> wo(new DataObjectT(buffer_size, (ObjectPool<DataObjectT> *) this));
-         _queue_unused.push(std::move(wo));
+            DataObjectT * wo = new DataObjectT(buffer_size, (ObjectPool<DataObjectT> *) this);
+            _objects.push_back(wo);
+            if (_ring_unused) _ring_unused->try_push(wo);
+            else _queue_unused.push(std::unique_ptr<DataObjectT>(wo));
         }
     }
-    
-    
+
+    // Objects that are still acquired or queued elsewhere when the pool is destroyed
+    // point into freed memory; drain all queues before deleting a pool.
     template <class DataObjectT>
-    size_t ObjectPool<DataObjectT>::pool_size() {
+    ObjectPool<DataObjectT>::~ObjectPool() {
+        if (census_enabled()) Census::remove_pool(this);
+        delete _stats;
+        if (_magazines) {
+            for (size_t i = 0; i < W_MAGAZINE_SLOTS; i++) {
+                for (size_t j = 0; j < _magazines[i].n; j++) delete _magazines[i].objects[j];
+                delete [] _magazines[i].objects;
+            }
+            delete [] _magazines;
+            delete [] _magazine_owners;
+        }
+        if (_ring_unused) {
+            DataObjectT * p;
+            while (_ring_unused->try_pop(p)) delete p;
+            delete _ring_unused;
+        }
         std::unique_lock<std::mutex> lk(_m_unused);
-        return _queue_unused.size();
+        while (!_queue_unused.empty()) _queue_unused.pop();
     }
-    
-    
+
     template <class DataObjectT>
-    void ObjectPool<DataObjectT>::_return(std::unique_ptr<DataObjectT> p) {
-        if (!p) throw OIError("Returned NULL.");
+    size_t ObjectPool<DataObjectT>::pool_size() {
+        size_t res = 0;
+        if (_magazines) {
+            for (size_t i = 0; i < W_MAGAZINE_SLOTS; i++) res += _magazines[i].n.load(std::memory_order_relaxed);
+        }
+        if (_ring_unused) return res + _ring_unused->size();
         std::unique_lock<std::mutex> lk(_m_unused);
-        _queue_unused.push(std::move(p));
-        have_unused_cv.notify_one();
+        return res + _queue_unused.size();
     }
-    
-    
-    
+
     template <class DataObjectT>
-    WorkerQueue<DataObjectT>::WorkerQueue(ObjectPool<DataObjectT> * objectPool) {
-        _object_pool = objectPool;
-        _running = true;
+    void ObjectPool<DataObjectT>::enable_magazines(size_t magazine_size) {
+        if (_magazines) throw OIError("ObjectPool magazines already enabled.");
+        if (magazine_size < 2) throw OIError("ObjectPool magazines need room for at least two objects.");
+        _magazine_size = magazine_size;
+        _magazines = new Magazine[W_MAGAZINE_SLOTS];
+        _magazine_owners = new std::atomic<size_t>[W_MAGAZINE_SLOTS];
+        for (size_t i = 0; i < W_MAGAZINE_SLOTS; i++) {
+            _magazine_owners[i] = 0;
+            _magazines[i].lock.clear();
+            _magazines[i].n = 0;
+            _magazines[i].objects = new DataObjectT*[magazine_size];
+            _magazines[i].hits = 0;
+            _magazines[i].misses = 0;
+        }
+    }
+
+    template <class DataObjectT>
+    bool ObjectPool<DataObjectT>::magazines_enabled() {
+        return _magazines != nullptr;
     }
-    
+
     template <class DataObjectT>
-    ObjectPool<DataObjectT> * WorkerQueue<DataObjectT>::object_pool() {
-        return _object_pool;
+    uint64_t ObjectPool<DataObjectT>::magazine_hits() {
+        uint64_t res = 0;
+        if (!_magazines) return res;
+        for (size_t i = 0; i < W_MAGAZINE_SLOTS; i++) res += _magazines[i].hits.load(std::memory_order_relaxed);
+        return res;
     }
-    
-    
+
     template <class DataObjectT>
-    WorkerQueue<DataObjectT>::~WorkerQueue() {
-        close();
-    };
-    
+    uint64_t ObjectPool<DataObjectT>::magazine_misses() {
+        uint64_t res = 0;
+        if (!_magazines) return res;
+        res = _magazine_bypass.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < W_MAGAZINE_SLOTS; i++) res += _magazines[i].misses.load(std::memory_order_relaxed);
+        return res;
+    }
+
+    // Fraction of acquisitions served from the calling thread's magazine
     template <class DataObjectT>
-    void WorkerQueue<DataObjectT>::close() {
-        if (_running) {
-            _running = false;
-            notify_all();
+    double ObjectPool<DataObjectT>::magazine_hit_rate() {
+        uint64_t hits = magazine_hits();
+        uint64_t total = hits + magazine_misses();
+        if (total == 0) return 0.0;
+        return (double) hits / (double) total;
+    }
+
+    template <class DataObjectT>
+    size_t ObjectPool<DataObjectT>::pool_capacity() {
+        return _n_objects;
+    }
+
+    template <class DataObjectT>
+    W_BACKEND ObjectPool<DataObjectT>::backend() {
+        return _backend;
+    }
+
+    template <class DataObjectT>
+    void ObjectPool<DataObjectT>::notify_all() {
+        _wake_gen++;
+        _unused_ec.notify_all();
+    }
+
+    template <class DataObjectT>
+    void ObjectPool<DataObjectT>::set_name(const std::string & name) {
+        delete _stats;
+        _stats = new WorkerStats(name, "pool", (int64_t) pool_size());
+    }
+
+    template <class DataObjectT>
+    std::string ObjectPool<DataObjectT>::name() {
+        if (_stats == nullptr) return std::string();
+        return _stats->name;
+    }
+
+    template <class DataObjectT>
+    WorkerStats * ObjectPool<DataObjectT>::stats() {
+        return _stats;
+    }
+
+    template <class DataObjectT>
+    template <class Fn>
+    bool ObjectPool<DataObjectT>::_with_all_unused(Fn fn) {
+        std::unique_lock<std::mutex> lk(_m_unused);
+        // Take everything out so only objects known to be unused are touched
+        std::vector<DataObjectT *> objects;
+        if (_ring_unused) {
+            DataObjectT * p;
+            while (_ring_unused->try_pop(p)) objects.push_back(p);
+        } else {
+            while (!_queue_unused.empty()) {
+                objects.push_back(_queue_unused.front().release());
+                _queue_unused.pop();
+            }
+        }
+        size_t n = objects.size();
+        if (_magazines) {
+            for (size_t i = 0; i < W_MAGAZINE_SLOTS; i++) n += _magazines[i].n;
+        }
+        if (n == _n_objects) {
+            for (size_t i = 0; i < objects.size(); i++) fn(objects[i]);
+            if (_magazines) {
+                for (size_t i = 0; i < W_MAGAZINE_SLOTS; i++) {
+                    for (size_t j = 0; j < _magazines[i].n; j++) fn(_magazines[i].objects[j]);
+                }
+            }
+        }
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (_ring_unused) _ring_unused->try_push(objects[i]);
+            else _queue_unused.push(std::unique_ptr<DataObjectT>(objects[i]));
         }
+        return n == _n_objects;
     }
-    
+
     template <class DataObjectT>
-    void WorkerQueue<DataObjectT>::notify_all() {
-        _object_pool->have_unused_cv.notify_all();
-        have_queued_cv.notify_all();
+    void ObjectPool<DataObjectT>::set_headroom(size_t headroom, size_t tailroom) {
+        if (headroom + tailroom >= buffer_size()) throw OIError("ObjectPool headroom leaves no room for a payload.");
+        if (!_with_all_unused([headroom, tailroom](DataObjectT * p) { p->reserve(headroom, tailroom); })) {
+            throw OIError("ObjectPool headroom must be set while every object is in the pool.");
+        }
+        _headroom = headroom;
+        _tailroom = tailroom;
     }
-    
+
     template <class DataObjectT>
-    void WorkerQueue<DataObjectT>::_enqueue(std::unique_ptr<DataObjectT> p) {
-        if (!p) throw OIError("Returned NULL.");
-        std::unique_lock<std::mutex> lk(_m_ready);
-        _queue_ready.push(std::move(p));
-        have_queued_cv.notify_one();
+    void ObjectPool<DataObjectT>::enable_census() {
+        if (census_enabled()) return;
+        uint64_t now = Clock::now_ns();
+        if (!_with_all_unused([now](DataObjectT * p) { p->_owner = W_OWNER_FREE; p->_owned_at = now; })) {
+            throw OIError("ObjectPool census must be enabled while every object is in the pool.");
+        }
+        _census = true;
+        Census::add_pool(this, [this] { return census(); });
     }
-    
+
     template <class DataObjectT>
-    std::unique_ptr<DataObjectT> WorkerQueue<DataObjectT>::_get_data(W_TYPE t, W_FLOW f) {
-        if (t == W_TYPE_QUEUED) {
-            std::unique_lock<std::mutex> lk(_m_ready);
-            //while (_running && f == W_FLOW_BLOCKING && _queue_ready.empty()) {
-            if (_running && f == W_FLOW_BLOCKING && _queue_ready.empty()) {
-                lk.unlock();
-                std::unique_lock<std::mutex> lk2(_m_wait);
-                //have_queued_cv.wait_for(lk2, std::chrono::milliseconds(1000)); // , [this]{ return !_queue_ready.empty(); }
-                have_queued_cv.wait(lk2);
-                lk.lock();
+    bool ObjectPool<DataObjectT>::census_enabled() {
+        return _census.load(std::memory_order_relaxed);
+    }
+
+    // Objects change hands while they are counted, so the result is approximate under load
+    template <class DataObjectT>
+    PoolCensus ObjectPool<DataObjectT>::census() {
+        PoolCensus res;
+        res.pool = name();
+        res.capacity = _objects.size();
+        res.free = 0;
+        if (!census_enabled()) return res;
+        uint64_t now = Clock::now_ns();
+        std::vector<uint16_t> owners;
+        std::vector<CensusEntry> entries;
+        std::vector<uint64_t> age_sum;
+        for (size_t i = 0; i < _objects.size(); i++) {
+            uint16_t owner = _objects[i]->owner();
+            if (owner == W_OWNER_FREE) {
+                res.free++;
+                continue;
             }
-            if (_queue_ready.empty()) return std::unique_ptr<DataObjectT>(nullptr);
-            std::unique_ptr<DataObjectT> res(std::move(_queue_ready.front()));
-            _queue_ready.pop();
-            return res;
-        } else if (t == W_TYPE_UNUSED) {
-            std::unique_lock<std::mutex> lk(_object_pool->_m_unused);
-            //while (_running && f == W_FLOW_BLOCKING && _object_pool->_queue_unused.empty()) {
-            if (_running && f == W_FLOW_BLOCKING && _object_pool->_queue_unused.empty()) {
-                lk.unlock();
-                std::unique_lock<std::mutex> lk2(_object_pool->_m_wait);
-                //_object_pool->have_unused_cv.wait_for(lk2, std::chrono::milliseconds(1000)); // , [this]{ return !_object_pool->_queue_unused.empty(); }
-                _object_pool->have_unused_cv.wait(lk2);
-                lk.lock();
+            uint64_t since = _objects[i]->owned_since();
+            uint64_t age = now > since ? now - since : 0;
+            size_t e = std::find(owners.begin(), owners.end(), owner) - owners.begin();
+            if (e == owners.size()) {
+                owners.push_back(owner);
+                CensusEntry entry;
+                entry.owner = Census::owner_name(owner);
+                entry.count = 0;
+                entry.oldest_ns = 0;
+                entry.mean_age_ns = 0;
+                entries.push_back(entry);
+                age_sum.push_back(0);
             }
-            if (_object_pool->_queue_unused.empty()) return std::unique_ptr<DataObjectT>(nullptr);
-            std::unique_ptr<DataObjectT> res(std::move(_object_pool->_queue_unused.front()));
-            _object_pool->_queue_unused.pop();
-            return res;
-        } else {
-            return std::unique_ptr<DataObjectT>(nullptr);
+            entries[e].count++;
+            entries[e].oldest_ns = std::max(entries[e].oldest_ns, age);
+            age_sum[e] += age;
         }
+        for (size_t e = 0; e < entries.size(); e++) entries[e].mean_age_ns = age_sum[e] / entries[e].count;
+        std::sort(entries.begin(), entries.end(), [](const CensusEntry & a, const CensusEntry & b) { return a.count > b.count; });
+        res.owners = entries;
+        return res;
     }
-    
+
     template <class DataObjectT>
-    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(WorkerQueue<DataObjectT> * q, W_TYPE t, W_FLOW f)
-    : data(q->_get_data(t, f)) {
-        _ref_obj_type = t;
-        _enqueue = false;
-        _enqueue_next = q;
-        if (data) _return_to = data->_return_to_pool;
-        else if (f == W_FLOW_BLOCKING && t == W_TYPE_UNUSED && q->_running ) {
-            throw OIError("OIBufferQueue has no free elements.");
+    size_t ObjectPool<DataObjectT>::headroom() {
+        return _headroom;
+    }
+
+    template <class DataObjectT>
+    size_t ObjectPool<DataObjectT>::tailroom() {
+        return _tailroom;
+    }
+
+    template <class DataObjectT>
+    size_t ObjectPool<DataObjectT>::payload_capacity() {
+        return buffer_size() - _headroom - _tailroom;
+    }
+
+    template <class DataObjectT>
+    std::unique_ptr<DataObjectT> ObjectPool<DataObjectT>::_take(W_FLOW f, W_DEADLINE deadline) {
+        std::unique_ptr<DataObjectT> res = _take_unused(f, deadline);
+        if (res) res->_set_thread_owner();
+        if (_stats && res) _stats->on_take(1);
+        return res;
+    }
+
+    template <class DataObjectT>
+    void ObjectPool<DataObjectT>::_return(std::unique_ptr<DataObjectT> p) {
+        if (p) p->set_owner(W_OWNER_FREE);
+        if (_stats && p) _stats->on_put(1);
+        _return_unused(std::move(p));
+    }
+
+    template <class DataObjectT>
+    std::unique_ptr<DataObjectT> ObjectPool<DataObjectT>::_take_unused(W_FLOW f, W_DEADLINE deadline) {
+        if (_magazines) return _take_magazine(f, deadline);
+        if (_ring_unused) {
+            DataObjectT * p = nullptr;
+            if (!_ring_unused->try_pop(p) && f == W_FLOW_BLOCKING) {
+                _wait_unused([this, &p]{ return _ring_unused->try_pop(p); }, deadline);
+            }
+            return std::unique_ptr<DataObjectT>(p);
         }
-    };
-    
+
+        std::unique_ptr<DataObjectT> res;
+        auto try_take = [this, &res]() -> bool {
+            std::unique_lock<std::mutex> lk(_m_unused);
+            if (_queue_unused.empty()) return false;
+            res = std::move(_queue_unused.front());
+            _queue_unused.pop();
+            return true;
+        };
+        if (!try_take() && f == W_FLOW_BLOCKING) _wait_unused(try_take, deadline);
+        return res;
+    }
+
+    // Sleep until ready() succeeds, notify_all() is called or the deadline passes; false in the
+    // latter cases. ready() takes the object itself, so a wakeup can never be stolen between
+    // check and take.
     template <class DataObjectT>
-    DataObjectAcquisition<DataObjectT>::~DataObjectAcquisition() {
-        if (!data) return;
-        if (_enqueue && _enqueue_next != nullptr) {
-            _enqueue_next->_enqueue(std::move(data));
-        } else {
-            data->reset();
-            _return_to->_return(std::move(data));
+    template <class Ready>
+    bool ObjectPool<DataObjectT>::_wait_unused(Ready ready, W_DEADLINE deadline) {
+        uint32_t gen = _wake_gen;
+        uint64_t t0 = _stats ? WorkerStats::now_ns() : 0;
+        bool res = true;
+        bool woken = _unused_ec.await_until([this, gen, &ready, &res]() -> bool {
+            if (ready()) return true;
+            if (_wake_gen == gen) return false;
+            res = false;
+            return true;
+        }, deadline);
+        if (!woken) res = false;
+        if (_stats) _stats->on_wait(WorkerStats::now_ns() - t0);
+        return res;
+    }
+
+    template <class DataObjectT>
+    void ObjectPool<DataObjectT>::_return_unused(std::unique_ptr<DataObjectT> p) {
+        if (!p) throw OIError("Returned NULL.");
+        if (_magazines) {
+            _return_magazine(p.release());
+            return;
         }
-    };
-    
+        if (_ring_unused) {
+            // Never full: the ring holds at least as many slots as the pool has objects.
+            _ring_unused->try_push(p.release());
+            _unused_ec.notify_one();
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lk(_m_unused);
+            _queue_unused.push(std::move(p));
+        }
+        _unused_ec.notify_one();
+    }
+
+
+    // Threads claim the first free magazine probing from their slot on; claims are never
+    // given back, so a release that finds a free magazine before its own has none.
     template <class DataObjectT>
-    void DataObjectAcquisition<DataObjectT>::enqueue() {
-        _enqueue = true;
-    };
-    
+    typename ObjectPool<DataObjectT>::Magazine * ObjectPool<DataObjectT>::_own_magazine(bool claim) {
+        size_t me = _thread_slot() + 1;
+        for (size_t k = 0; k < W_MAGAZINE_SLOTS; k++) {
+            size_t i = (me + k) % W_MAGAZINE_SLOTS;
+            size_t owner = _magazine_owners[i].load(std::memory_order_acquire);
+            if (owner == me) return &_magazines[i];
+            if (owner != 0) continue;
+            if (!claim) return nullptr;
+            if (_magazine_owners[i].compare_exchange_strong(owner, me, std::memory_order_acq_rel)) return &_magazines[i];
+        }
+        return nullptr;
+    }
+
+    // Only the owner and _steal take the magazine lock, so it is uncontended unless
+    // the pool ran dry and another thread is looking for objects.
     template <class DataObjectT>
-    void DataObjectAcquisition<DataObjectT>::enqueue(WorkerQueue<DataObjectT> * q) {
-        _enqueue = true;
-        _enqueue_next = q;
-    };
-    
+    std::unique_ptr<DataObjectT> ObjectPool<DataObjectT>::_take_magazine(W_FLOW f, W_DEADLINE deadline) {
+        Magazine * m = _own_magazine(true);
+        DataObjectT * p = nullptr;
+        if (m != nullptr) {
+            while (m->lock.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+            size_t n = m->n.load(std::memory_order_relaxed);
+            if (n == 0) {
+                m->misses.store(m->misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                n = _take_batch(m->objects, _magazine_size / 2);
+            } else {
+                m->hits.store(m->hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+            if (n > 0) p = m->objects[--n];
+            m->n.store(n, std::memory_order_relaxed);
+            m->lock.clear(std::memory_order_release);
+        } else {
+            _magazine_bypass.fetch_add(1, std::memory_order_relaxed);
+            _take_batch(&p, 1);
+        }
+
+        if (p == nullptr) p = _steal();
+        if (p != nullptr || f != W_FLOW_BLOCKING) return std::unique_ptr<DataObjectT>(p);
+
+        // Everything is in use; every return notifies
+        _wait_unused([this, &p]() -> bool {
+            if (_take_batch(&p, 1) == 0) p = _steal();
+            return p != nullptr;
+        }, deadline);
+        return std::unique_ptr<DataObjectT>(p);
+    }
+
     template <class DataObjectT>
-    void DataObjectAcquisition<DataObjectT>::release() {
-        _enqueue = false;
-        _enqueue_next = nullptr;
-    };
-    
+    void ObjectPool<DataObjectT>::_return_magazine(DataObjectT * p) {
+        Magazine * m = _own_magazine(false);
+        if (m == nullptr) {
+            // Not an acquiring thread: parking objects here would put them out of the acquirer's reach
+            _return_batch(&p, 1);
+            _unused_ec.notify_one();
+            return;
+        }
+        while (m->lock.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+        size_t n = m->n.load(std::memory_order_relaxed);
+        if (n == _magazine_size) {
+            // Full: hand the older half back to the shared pool
+            size_t k = _magazine_size / 2;
+            _return_batch(m->objects, k);
+            for (size_t i = k; i < n; i++) m->objects[i - k] = m->objects[i];
+            n -= k;
+        }
+        m->objects[n++] = p;
+        m->n.store(n, std::memory_order_relaxed);
+        m->lock.clear(std::memory_order_release);
+        _unused_ec.notify_one();
+    }
+
+    // Take one object from any magazine that is not locked right now
     template <class DataObjectT>
-    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(DataObjectAcquisition&& that) {
-        data = std::move(that.data);
-        _enqueue = that._enqueue;
-        _return_to = that._return_to;
-        _enqueue_next = that._enqueue_next;
-        that._enqueue = false;
-        that._return_to = nullptr;
-        that._enqueue_next = nullptr;
-    };
-    
+    DataObjectT * ObjectPool<DataObjectT>::_steal() {
+        for (size_t i = 0; i < W_MAGAZINE_SLOTS; i++) {
+            Magazine & m = _magazines[i];
+            if (m.n.load(std::memory_order_relaxed) == 0) continue;
+            if (m.lock.test_and_set(std::memory_order_acquire)) continue;
+            DataObjectT * p = nullptr;
+            size_t n = m.n.load(std::memory_order_relaxed);
+            if (n > 0) {
+                p = m.objects[--n];
+                m.n.store(n, std::memory_order_relaxed);
+            }
+            m.lock.clear(std::memory_order_release);
+            if (p != nullptr) return p;
+        }
+        return nullptr;
+    }
+
     template <class DataObjectT>
-    DataObjectAcquisition<DataObjectT>& DataObjectAcquisition<DataObjectT>::operator=(DataObjectAcquisition<DataObjectT>&& that) {
-        data = std::move(that.data);
-        _enqueue = that._enqueue;
+    size_t ObjectPool<DataObjectT>::_take_batch(DataObjectT ** out, size_t n) {
+        size_t res = 0;
+        if (_ring_unused) {
+            while (res < n && _ring_unused->try_pop(out[res])) res++;
+            return res;
+        }
+        std::unique_lock<std::mutex> lk(_m_unused);
+        while (res < n && !_queue_unused.empty()) {
+            out[res++] = _queue_unused.front().release();
+            _queue_unused.pop();
+        }
+        return res;
+    }
+
+    template <class DataObjectT>
+    void ObjectPool<DataObjectT>::_return_batch(DataObjectT ** in, size_t n) {
+        if (_ring_unused) {
+            for (size_t i = 0; i < n; i++) _ring_unused->try_push(in[i]);
+            return;
+        }
+        std::unique_lock<std::mutex> lk(_m_unused);
+        for (size_t i = 0; i < n; i++) _queue_unused.push(std::unique_ptr<DataObjectT>(in[i]));
+    }
+
+    template <class DataObjectT>
+    size_t ObjectPool<DataObjectT>::_take_many(DataObjectT ** out, size_t n, W_FLOW f) {
+        size_t res = 0;
+        if (!_magazines) res = _take_batch(out, n);
+        while (res < n) {
+            std::unique_ptr<DataObjectT> p = _take_unused(res == 0 ? f : W_FLOW_NONBLOCKING);
+            if (!p) break;
+            out[res++] = p.release();
+        }
+        for (size_t i = 0; i < res; i++) out[i]->_set_thread_owner();
+        if (_stats && res > 0) _stats->on_take(res);
+        return res;
+    }
+
+    template <class DataObjectT>
+    void ObjectPool<DataObjectT>::_return_many(DataObjectT ** in, size_t n) {
+        for (size_t i = 0; i < n; i++) in[i]->set_owner(W_OWNER_FREE);
+        if (_stats) _stats->on_put(n);
+        if (_magazines && _own_magazine(false) != nullptr) {
+            for (size_t i = 0; i < n; i++) _return_magazine(in[i]);
+            return;
+        }
+        _return_batch(in, n);
+        if (n == 1) _unused_ec.notify_one();
+        else if (n > 1) _unused_ec.notify_all();
+    }
+
+
+    template <class DataObjectT>
+    TieredObjectPool<DataObjectT>::TieredObjectPool() {
+        _headroom = 0;
+        _tailroom = 0;
+        _census = false;
+    }
+
+    template <class DataObjectT>
+    TieredObjectPool<DataObjectT>::~TieredObjectPool() {
+        for (size_t i = 0; i < _pools.size(); i++) {
+            if (_owned[i]) delete _pools[i];
+        }
+    }
+
+    template <class DataObjectT>
+    void TieredObjectPool<DataObjectT>::add_class(ObjectPool<DataObjectT> * pool) {
+        if (pool == nullptr) throw OIError("Size class without pool.");
+        if (_headroom > 0 || _tailroom > 0) pool->set_headroom(_headroom, _tailroom);
+        if (_census) pool->enable_census();
+        size_t size = pool->payload_capacity();
+        size_t i = 0;
+        while (i < _sizes.size() && _sizes[i] <= size) i++;
+        _pools.insert(_pools.begin() + i, pool);
+        _sizes.insert(_sizes.begin() + i, size);
+        _owned.insert(_owned.begin() + i, false);
+    }
+
+    template <class DataObjectT>
+    ObjectPool<DataObjectT> * TieredObjectPool<DataObjectT>::add_class(size_t n, size_t buffer_size, W_BACKEND backend, uint32_t slab_flags) {
+        ObjectPool<DataObjectT> * pool = new ObjectPool<DataObjectT>(n, buffer_size, backend, slab_flags);
+        add_class(pool);
+        for (size_t i = 0; i < _pools.size(); i++) {
+            if (_pools[i] == pool) _owned[i] = true;
+        }
+        return pool;
+    }
+
+    template <class DataObjectT>
+    ObjectPool<DataObjectT> * TieredObjectPool<DataObjectT>::pool_for(size_t size) {
+        for (size_t i = 0; i < _sizes.size(); i++) {
+            if (size <= _sizes[i]) return _pools[i];
+        }
+        return nullptr;
+    }
+
+    template <class DataObjectT>
+    void TieredObjectPool<DataObjectT>::set_headroom(size_t headroom, size_t tailroom) {
+        _headroom = headroom;
+        _tailroom = tailroom;
+        for (size_t i = 0; i < _pools.size(); i++) {
+            _pools[i]->set_headroom(headroom, tailroom);
+            _sizes[i] = _pools[i]->payload_capacity();
+        }
+    }
+
+    template <class DataObjectT>
+    void TieredObjectPool<DataObjectT>::enable_census() {
+        _census = true;
+        for (size_t i = 0; i < _pools.size(); i++) _pools[i]->enable_census();
+    }
+
+    template <class DataObjectT>
+    size_t TieredObjectPool<DataObjectT>::headroom() {
+        return _headroom;
+    }
+
+    template <class DataObjectT>
+    size_t TieredObjectPool<DataObjectT>::tailroom() {
+        return _tailroom;
+    }
+
+    template <class DataObjectT>
+    size_t TieredObjectPool<DataObjectT>::n_classes() {
+        return _pools.size();
+    }
+
+    template <class DataObjectT>
+    ObjectPool<DataObjectT> * TieredObjectPool<DataObjectT>::class_pool(size_t i) {
+        return _pools.at(i);
+    }
+
+    template <class DataObjectT>
+    size_t TieredObjectPool<DataObjectT>::max_buffer_size() {
+        if (_sizes.empty()) return 0;
+        return _sizes.back();
+    }
+
+    template <class DataObjectT>
+    size_t TieredObjectPool<DataObjectT>::pool_size() {
+        size_t res = 0;
+        for (size_t i = 0; i < _pools.size(); i++) res += _pools[i]->pool_size();
+        return res;
+    }
+
+    template <class DataObjectT>
+    size_t TieredObjectPool<DataObjectT>::pool_capacity() {
+        size_t res = 0;
+        for (size_t i = 0; i < _pools.size(); i++) res += _pools[i]->pool_capacity();
+        return res;
+    }
+
+    // Bytes of buffer memory reserved by all classes
+    template <class DataObjectT>
+    size_t TieredObjectPool<DataObjectT>::footprint() {
+        size_t res = 0;
+        for (size_t i = 0; i < _pools.size(); i++) res += _pools[i]->slab_size();
+        return res;
+    }
+
+    template <class DataObjectT>
+    void TieredObjectPool<DataObjectT>::notify_all() {
+        for (size_t i = 0; i < _pools.size(); i++) _pools[i]->notify_all();
+    }
+
+    // Prefers the smallest fitting class, but takes a free object from a larger class
+    // before blocking. Blocking waits happen on the smallest fitting class only.
+    template <class DataObjectT>
+    std::unique_ptr<DataObjectT> TieredObjectPool<DataObjectT>::_take(size_t size, W_FLOW f) {
+        size_t first = 0;
+        while (first < _sizes.size() && size > _sizes[first]) first++;
+        if (first == _sizes.size()) {
+            std::unique_ptr<DataObjectT> blob(new DataObjectT(_headroom + size + _tailroom, nullptr));
+            blob->reserve(_headroom, _tailroom);
+            return blob;
+        }
+        for (size_t i = first; i < _pools.size(); i++) {
+            std::unique_ptr<DataObjectT> res = _pools[i]->_take(W_FLOW_NONBLOCKING);
+            if (res) return res;
+        }
+        if (f != W_FLOW_BLOCKING) return std::unique_ptr<DataObjectT>(nullptr);
+        return _pools[first]->_take(W_FLOW_BLOCKING);
+    }
+
+    template <class DataObjectT>
+    size_t TieredObjectPool<DataObjectT>::_take_many(size_t size, DataObjectT ** out, size_t n, W_FLOW f) {
+        size_t first = 0;
+        while (first < _sizes.size() && size > _sizes[first]) first++;
+        if (first == _sizes.size()) {
+            for (size_t i = 0; i < n; i++) {
+                out[i] = new DataObjectT(_headroom + size + _tailroom, nullptr);
+                out[i]->reserve(_headroom, _tailroom);
+            }
+            return n;
+        }
+        size_t res = 0;
+        for (size_t i = first; i < _pools.size() && res < n; i++) {
+            res += _pools[i]->_take_many(out + res, n - res, W_FLOW_NONBLOCKING);
+        }
+        if (res == 0 && f == W_FLOW_BLOCKING) res = _pools[first]->_take_many(out, n, W_FLOW_BLOCKING);
+        return res;
+    }
+
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueue<DataObjectT, QueuePolicy>::WorkerQueue() {
+        _init(nullptr, W_BACKEND_MUTEX, 0);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueue<DataObjectT, QueuePolicy>::WorkerQueue(ObjectPool<DataObjectT> * objectPool) {
+        _init(objectPool, W_BACKEND_MUTEX, 0);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueue<DataObjectT, QueuePolicy>::WorkerQueue(W_BACKEND backend, size_t capacity) {
+        _init(nullptr, backend, capacity);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueue<DataObjectT, QueuePolicy>::WorkerQueue(W_BACKEND backend, size_t capacity, W_OVERFLOW overflow, size_t limit) {
+        _init(nullptr, backend, capacity);
+        set_overflow(overflow, limit);
+    }
+
+    // A ready queue never holds more objects than its pool, so the pool size is used as capacity
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueue<DataObjectT, QueuePolicy>::WorkerQueue(ObjectPool<DataObjectT> * objectPool, W_BACKEND backend) {
+        size_t capacity = 0;
+        if (objectPool != nullptr) capacity = objectPool->pool_capacity();
+        _init(objectPool, backend, capacity);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_init(ObjectPool<DataObjectT> * objectPool, W_BACKEND backend, size_t capacity) {
+        _object_pool = objectPool;
+        _backend = backend;
+        _ring_capacity = capacity;
+        _wake_gen = 0;
+        _wait = W_WAIT_SPIN;
+        _spins = EVENTCOUNT_SPIN;
+        _overflow = W_OVERFLOW_BLOCK;
+        _limit = 0;
+        _dropped = 0;
+        _stats = nullptr;
+        _owner = W_OWNER_QUEUE;
+#ifdef OI_TRACE
+        _trace_enq = 0;
+        _trace_wait = 0;
+#endif
+        _listener = nullptr;
+        _listener_calls = 0;
+        _lane_credits = nullptr;
+        _lane_overflow = nullptr;
+        _lane_limit = nullptr;
+        if (_backend == W_BACKEND_LOCKFREE && capacity == 0) throw OIError("Lock-free WorkerQueue needs a capacity.");
+        set_lanes(std::vector<uint32_t>(1, 1), W_LANES_STRICT);
+        _running = true;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::set_lanes(const std::vector<uint32_t> & weights, W_LANES mode) {
+        if (weights.empty() || weights.size() > 256) throw OIError("WorkerQueue needs between 1 and 256 lanes.");
+        if (queue_size() > 0) throw OIError("Can not change lanes of a non-empty WorkerQueue.");
+        for (size_t i = 0; i < _ring_lanes.size(); i++) delete _ring_lanes[i];
+        _ring_lanes.clear();
+        delete [] _lane_credits;
+        delete [] _lane_overflow;
+        delete [] _lane_limit;
+        _queue_lanes.clear();
+        _queue_lanes.resize(weights.size());
+        if (_backend == W_BACKEND_LOCKFREE) {
+            for (size_t i = 0; i < weights.size(); i++) _ring_lanes.push_back(new MPMCRing<DataObjectT *>(_ring_capacity));
+            if (_limit == 0) _limit = _ring_lanes[0]->capacity();
+        }
+        _lane_mode = mode;
+        _lane_weights = weights;
+        _lane_credits = new std::atomic<int>[weights.size()];
+        _lane_overflow = new std::atomic<W_OVERFLOW>[weights.size()];
+        _lane_limit = new std::atomic<size_t>[weights.size()];
+        for (size_t i = 0; i < weights.size(); i++) {
+            _lane_credits[i] = (int) weights[i];
+            _lane_overflow[i] = _overflow.load();
+            _lane_limit[i] = _limit.load();
+        }
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::set_lanes(size_t n_lanes) {
+        set_lanes(std::vector<uint32_t>(n_lanes, 1), W_LANES_STRICT);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    size_t WorkerQueue<DataObjectT, QueuePolicy>::n_lanes() {
+        return _lane_weights.size();
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    size_t WorkerQueue<DataObjectT, QueuePolicy>::lane_size(size_t lane) {
+        if (lane >= n_lanes()) return 0;
+        if (!_ring_lanes.empty()) return _ring_lanes[lane]->size();
+        std::unique_lock<std::mutex> lk(_m_ready);
+        return _queue_lanes[lane].size();
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    size_t WorkerQueue<DataObjectT, QueuePolicy>::_lane_of(DataObjectT * p) {
+        size_t lane = p->lane;
+        if (lane >= _lane_weights.size()) lane = _lane_weights.size() - 1;
+        return lane;
+    }
+
+    // Calls try_lane(i) on lanes in service order until one yields an object.
+    // Weighted credits are shared by all consumers and only approximate under contention.
+    template <class DataObjectT, class QueuePolicy>
+    template <class TryLane>
+    bool WorkerQueue<DataObjectT, QueuePolicy>::_next_lane(TryLane try_lane) {
+        size_t n = _lane_weights.size();
+        if (_lane_mode == W_LANES_STRICT || n == 1) {
+            for (size_t i = n; i-- > 0;) {
+                if (try_lane(i)) return true;
+            }
+            return false;
+        }
+        for (int pass = 0; pass < 2; pass++) {
+            for (size_t i = n; i-- > 0;) {
+                if (_lane_credits[i].load(std::memory_order_relaxed) <= 0) continue;
+                if (try_lane(i)) {
+                    _lane_credits[i].fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            // Every lane with data used up its credits: start a new round
+            for (size_t i = 0; i < n; i++) _lane_credits[i].store((int) _lane_weights[i], std::memory_order_relaxed);
+        }
+        return false;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    bool WorkerQueue<DataObjectT, QueuePolicy>::_rings_empty() {
+        for (size_t i = 0; i < _ring_lanes.size(); i++) {
+            if (!_ring_lanes[i]->empty()) return false;
+        }
+        return true;
+    }
+
+    // Call with _m_ready held
+    template <class DataObjectT, class QueuePolicy>
+    bool WorkerQueue<DataObjectT, QueuePolicy>::_queues_empty() {
+        for (size_t i = 0; i < _queue_lanes.size(); i++) {
+            if (!_queue_lanes[i].empty()) return false;
+        }
+        return true;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::set_name(const std::string & name) {
+        delete _stats;
+        _stats = new WorkerStats(name, "queue", (int64_t) queue_size());
+        _owner = Census::owner(name);
+#ifdef OI_TRACE
+        _trace_enq = Tracer::stage(name + ".enq");
+        _trace_wait = Tracer::stage(name + ".wait");
+#endif
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    std::string WorkerQueue<DataObjectT, QueuePolicy>::name() {
+        if (_stats == nullptr) return std::string();
+        return _stats->name;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerStats * WorkerQueue<DataObjectT, QueuePolicy>::stats() {
+        return _stats;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::set_listener(WorkerQueueListener * listener) {
+        _listener.store(listener);
+        while (_listener_calls.load() > 0) std::this_thread::yield();
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueueListener * WorkerQueue<DataObjectT, QueuePolicy>::listener() {
+        return _listener.load();
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::set_wait_strategy(W_WAIT wait, size_t spins) {
+        _spins = spins;
+        _wait = wait;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    W_WAIT WorkerQueue<DataObjectT, QueuePolicy>::wait_strategy() {
+        return _wait;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_notify_listener() {
+        if (_listener.load(std::memory_order_relaxed) == nullptr) return;
+        _listener_calls.fetch_add(1);
+        WorkerQueueListener * listener = _listener.load();
+        if (listener != nullptr) listener->on_enqueue();
+        _listener_calls.fetch_sub(1);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    ObjectPool<DataObjectT> * WorkerQueue<DataObjectT, QueuePolicy>::object_pool() {
+        return _object_pool;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    W_BACKEND WorkerQueue<DataObjectT, QueuePolicy>::backend() {
+        return _backend;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    size_t WorkerQueue<DataObjectT, QueuePolicy>::queue_size() {
+        size_t res = 0;
+        for (size_t i = 0; i < _ring_lanes.size(); i++) res += _ring_lanes[i]->size();
+        std::unique_lock<std::mutex> lk(_m_ready);
+        for (size_t i = 0; i < _queue_lanes.size(); i++) res += _queue_lanes[i].size();
+        return res;
+    }
+
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::set_overflow(W_OVERFLOW overflow, size_t limit) {
+        for (size_t i = 0; i < n_lanes(); i++) set_lane_overflow(i, overflow, limit);
+        _overflow = overflow;
+        _limit = lane_limit(0);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::set_lane_overflow(size_t lane, W_OVERFLOW overflow, size_t limit) {
+        if (lane >= n_lanes()) throw OIError("WorkerQueue has no such lane.");
+        if (limit == 0 && !_ring_lanes.empty()) limit = _ring_lanes[lane]->capacity();
+        if (limit == 0 && overflow != W_OVERFLOW_BLOCK) throw OIError("Unbounded WorkerQueue needs a limit to drop objects.");
+        _lane_overflow[lane] = overflow;
+        _lane_limit[lane] = limit;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    W_OVERFLOW WorkerQueue<DataObjectT, QueuePolicy>::lane_overflow(size_t lane) {
+        if (lane >= n_lanes()) return _overflow;
+        return _lane_overflow[lane];
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    size_t WorkerQueue<DataObjectT, QueuePolicy>::lane_limit(size_t lane) {
+        if (lane >= n_lanes()) return _limit;
+        return _lane_limit[lane];
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    W_OVERFLOW WorkerQueue<DataObjectT, QueuePolicy>::overflow() {
+        return _overflow;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    size_t WorkerQueue<DataObjectT, QueuePolicy>::limit() {
+        return _limit;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    uint64_t WorkerQueue<DataObjectT, QueuePolicy>::dropped() {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+    // Drop an object instead of queueing it
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_drop(DataObjectT * p) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        _release(p);
+    }
+
+    // Release one reference held by the queue; shared objects stay with their other consumers.
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_release(DataObjectT * p) {
+        if (p->_refs.fetch_sub(1, std::memory_order_acq_rel) > 1) return;
+        ObjectPool<DataObjectT> * pool = (ObjectPool<DataObjectT> *) p->_return_to_pool;
+        if (pool == nullptr) {
+            delete p;
+            return;
+        }
+        p->_refs.store(1, std::memory_order_relaxed);
+        p->lane = 0;
+        p->reset();
+        pool->_return(std::unique_ptr<DataObjectT>(p));
+    }
+
+    // Drop an object that was already queued
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_evict(DataObjectT * p) {
+        if (_stats) _stats->on_evict(1);
+        _drop(p);
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_taken(DataObjectT * p) {
+        p->_set_thread_owner();
+        size_t lane = _lane_of(p);
+        if (_lane_overflow[lane].load(std::memory_order_relaxed) == W_OVERFLOW_BLOCK && _lane_limit[lane].load(std::memory_order_relaxed) > 0) {
+            _space_ec.notify_one();
+        }
+#ifdef OI_TRACE
+        if (_trace_wait) p->_trace_after(_trace_wait, _trace_enq, Clock::now_ns());
+#endif
+        if (_stats == nullptr) return;
+        _stats->on_take(1);
+        _stats->on_queued(WorkerStats::now_ns() - p->_queued_at.load(std::memory_order_relaxed));
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    WorkerQueue<DataObjectT, QueuePolicy>::~WorkerQueue() {
+        close();
+        // Objects still queued go back to their pools, which must outlive the queue;
+        // fanned out objects are only freed by their last holder.
+        for (size_t i = 0; i < _ring_lanes.size(); i++) {
+            DataObjectT * p;
+            while (_ring_lanes[i]->try_pop(p)) _release(p);
+            delete _ring_lanes[i];
+        }
+        for (size_t i = 0; i < _queue_lanes.size(); i++) {
+            while (!_queue_lanes[i].empty()) {
+                _release(_queue_lanes[i].front().release());
+                _queue_lanes[i].pop();
+            }
+        }
+        delete [] _lane_credits;
+        delete [] _lane_overflow;
+        delete [] _lane_limit;
+        delete _stats;
+    };
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::close() {
+        if (_running) {
+            _running = false;
+            notify_all();
+            _space_ec.notify_all();
+        }
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::notify_all() {
+        if (_object_pool != nullptr) _object_pool->notify_all();
+        _wake_gen++;
+        _queued_ec.notify_all();
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_enqueue(std::unique_ptr<DataObjectT> p) {
+        if (!p) throw OIError("Returned NULL.");
+        if (!_ring_lanes.empty()) {
+            if (_push_ring(p.release())) {
+                _notify_queued();
+                _notify_listener();
+            }
+            return;
+        }
+        std::unique_lock<std::mutex> lk(_m_ready);
+        if (!_push_queue(std::move(p), lk)) return;
+        lk.unlock();
+        _notify_queued();
+        _notify_listener();
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_enqueue_batch(DataObjectT ** in, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (in[i] == nullptr) throw OIError("Returned NULL.");
+        }
+        size_t pushed = 0;
+        if (!_ring_lanes.empty()) {
+            for (size_t i = 0; i < n; i++) {
+                if (_push_ring(in[i])) pushed++;
+            }
+            if (pushed > 0) {
+                _notify_queued(pushed);
+                _notify_listener();
+            }
+            return;
+        }
+        std::unique_lock<std::mutex> lk(_m_ready);
+        for (size_t i = 0; i < n; i++) {
+            if (_push_queue(std::unique_ptr<DataObjectT>(in[i]), lk)) pushed++;
+        }
+        lk.unlock();
+        if (pushed > 0) {
+            _notify_queued(pushed);
+            _notify_listener();
+        }
+    }
+
+    // Pushes into the object's lane ring, applying the overflow policy.
+    // Returns false if p was dropped instead.
+    template <class DataObjectT, class QueuePolicy>
+    bool WorkerQueue<DataObjectT, QueuePolicy>::_push_ring(DataObjectT * p) {
+        size_t lane = _lane_of(p);
+        MPMCRing<DataObjectT *> * ring = _ring_lanes[lane];
+        W_OVERFLOW overflow = _lane_overflow[lane];
+        p->set_owner(_owner);
+#ifdef OI_TRACE
+        if (_trace_enq) p->trace(_trace_enq);
+#endif
+        if (_stats) p->_queued_at.store(WorkerStats::now_ns(), std::memory_order_relaxed);
+        size_t limit = _lane_limit[lane];
+        if (overflow == W_OVERFLOW_DROP_NEWEST && ring->size() >= limit) {
+            _drop(p);
+            return false;
+        }
+        if (overflow == W_OVERFLOW_DROP_OLDEST) {
+            DataObjectT * old;
+            while (ring->size() >= limit && ring->try_pop(old)) _evict(old);
+        }
+        // Producers check the size before pushing, so concurrent ones may overshoot the limit by a few
+        if (overflow == W_OVERFLOW_BLOCK && !_wait_space([ring, limit] { return ring->size() < limit; })) {
+            _drop(p);
+            return false;
+        }
+        // Counted before it becomes visible, so consumers never see a negative depth
+        if (_stats) _stats->on_put(1);
+        while (!ring->try_push(p)) {
+            DataObjectT * old;
+            if (overflow == W_OVERFLOW_DROP_NEWEST) {
+                _evict(p);
+                return false;
+            } else if (overflow != W_OVERFLOW_BLOCK && ring->try_pop(old)) {
+                _evict(old);
+            } else if (!_wait_space([ring] { return ring->size() < ring->capacity(); })) {
+                // Closed while another producer held the last slot
+                _evict(p);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Call with lk holding _m_ready; W_OVERFLOW_BLOCK releases it while waiting for room
+    template <class DataObjectT, class QueuePolicy>
+    bool WorkerQueue<DataObjectT, QueuePolicy>::_push_queue(std::unique_ptr<DataObjectT> p, std::unique_lock<std::mutex> & lk) {
+        size_t lane = _lane_of(p.get());
+        std::queue<std::unique_ptr<DataObjectT>> & queue = _queue_lanes[lane];
+        W_OVERFLOW overflow = _lane_overflow[lane];
+        size_t limit = _lane_limit[lane];
+        if (overflow == W_OVERFLOW_BLOCK && limit > 0) {
+            while (queue.size() >= limit) {
+                lk.unlock();
+                bool room = _wait_space([this, &queue, limit]() -> bool {
+                    std::unique_lock<std::mutex> lk_ready(_m_ready);
+                    return queue.size() < limit;
+                });
+                lk.lock();
+                if (!room) {
+                    _drop(p.release());
+                    return false;
+                }
+            }
+        } else if (overflow != W_OVERFLOW_BLOCK && queue.size() >= limit) {
+            if (overflow == W_OVERFLOW_DROP_NEWEST) {
+                _drop(p.release());
+                return false;
+            }
+            while (queue.size() >= limit) {
+                _evict(queue.front().release());
+                queue.pop();
+            }
+        }
+        p->set_owner(_owner);
+#ifdef OI_TRACE
+        if (_trace_enq) p->trace(_trace_enq);
+#endif
+        if (_stats) {
+            p->_queued_at.store(WorkerStats::now_ns(), std::memory_order_relaxed);
+            _stats->on_put(1);
+        }
+        queue.push(std::move(p));
+        return true;
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    std::unique_ptr<DataObjectT> WorkerQueue<DataObjectT, QueuePolicy>::_get_data(W_TYPE t, W_FLOW f, W_DEADLINE deadline) {
+        if (t == W_TYPE_QUEUED && !_ring_lanes.empty()) {
+            DataObjectT * p = nullptr;
+            auto try_lane = [this, &p](size_t i) { return _ring_lanes[i]->try_pop(p); };
+            while (!_next_lane(try_lane)) {
+                if (!_running || f != W_FLOW_BLOCKING) return std::unique_ptr<DataObjectT>(nullptr);
+                if (!_wait_queued([this]{ return !_rings_empty(); }, deadline)) {
+                    if (!_next_lane(try_lane)) return std::unique_ptr<DataObjectT>(nullptr);
+                    break;
+                }
+            }
+            _taken(p);
+            return std::unique_ptr<DataObjectT>(p);
+        } else if (t == W_TYPE_QUEUED) {
+            std::unique_ptr<DataObjectT> res;
+            auto try_lane = [this, &res](size_t i) -> bool {
+                if (_queue_lanes[i].empty()) return false;
+                res = std::move(_queue_lanes[i].front());
+                _queue_lanes[i].pop();
+                return true;
+            };
+            auto try_pop = [this, &try_lane]() -> bool {
+                std::unique_lock<std::mutex> lk(_m_ready);
+                return _next_lane(try_lane);
+            };
+            if (!try_pop() && _running && f == W_FLOW_BLOCKING) _wait_queued(try_pop, deadline);
+            if (res) _taken(res.get());
+            return res;
+        } else if (t == W_TYPE_UNUSED) {
+            if (_object_pool == nullptr) throw OIError("WorkerQueue has no object pool.");
+            return _object_pool->_take(_running ? f : W_FLOW_NONBLOCKING, deadline);
+        } else {
+            return std::unique_ptr<DataObjectT>(nullptr);
+        }
+    }
+
+    template <class DataObjectT, class QueuePolicy>
+    size_t WorkerQueue<DataObjectT, QueuePolicy>::_get_batch(DataObjectT ** out, size_t n, W_FLOW f) {
+        size_t res = 0;
+        if (!_ring_lanes.empty()) {
+            auto try_lane = [this, out, &res](size_t i) { return _ring_lanes[i]->try_pop(out[res]); };
+            while (res < n && _next_lane(try_lane)) res++;
+            while (res == 0 && _running && f == W_FLOW_BLOCKING) {
+                bool ready = _wait_queued([this]{ return !_rings_empty(); });
+                while (res < n && _next_lane(try_lane)) res++;
+                if (!ready) break;
+            }
+            for (size_t i = 0; i < res; i++) _taken(out[i]);
+            return res;
+        }
+        auto try_lane = [this, out, &res](size_t i) -> bool {
+            if (_queue_lanes[i].empty()) return false;
+            out[res] = _queue_lanes[i].front().release();
+            _queue_lanes[i].pop();
+            return true;
+        };
+        auto try_pop = [this, n, &res, &try_lane]() -> bool {
+            std::unique_lock<std::mutex> lk(_m_ready);
+            while (res < n && _next_lane(try_lane)) res++;
+            return res > 0;
+        };
+        if (!try_pop() && _running && f == W_FLOW_BLOCKING) _wait_queued(try_pop);
+        for (size_t i = 0; i < res; i++) _taken(out[i]);
+        return res;
+    }
+
+    // Sleeps until ready() holds, the queue is closed, notify_all() is called or the deadline
+    // passes; returns false in the last two cases. ready() may take the object itself, which the mutex backend
+    // does so that another consumer can not take it between the check and the pop.
+    template <class DataObjectT, class QueuePolicy>
+    template <class Pred>
+    bool WorkerQueue<DataObjectT, QueuePolicy>::_wait_queued(Pred ready, W_DEADLINE deadline) {
+        uint32_t gen = _wake_gen;
+        uint64_t t0 = _stats ? WorkerStats::now_ns() : 0;
+        auto pred = [this, gen, &ready]() -> bool { return ready() || !_running || _wake_gen != gen; };
+        W_WAIT wait = _wait.load(std::memory_order_relaxed);
+        bool woken;
+        if (wait == W_WAIT_POLL) woken = _queued_ec.poll_until(pred, deadline);
+        else woken = _queued_ec.await_until(pred, deadline, wait == W_WAIT_BLOCK ? 0 : _spins.load(std::memory_order_relaxed));
+        if (_stats) _stats->on_wait(WorkerStats::now_ns() - t0);
+        return woken && _wake_gen == gen;
+    }
+
+    // Wakes one waiting consumer, or all of them when n objects became ready at once.
+    // Costs a fence and a load while nobody is asleep.
+    template <class DataObjectT, class QueuePolicy>
+    void WorkerQueue<DataObjectT, QueuePolicy>::_notify_queued(size_t n) {
+        if (n > 1) _queued_ec.notify_all();
+        else _queued_ec.notify_one();
+    }
+
+    // Sleeps until has_space() holds; false if the queue was closed first. Consumers wake
+    // one producer per object they take, so a full queue moves in step with its consumers.
+    template <class DataObjectT, class QueuePolicy>
+    template <class HasSpace>
+    bool WorkerQueue<DataObjectT, QueuePolicy>::_wait_space(HasSpace has_space) {
+        if (has_space()) return true;
+        bool res = false;
+        _space_ec.await([this, &has_space, &res]() -> bool {
+            res = has_space();
+            return res || !_running;
+        });
+        return res;
+    }
+
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT, SPSC>::WorkerQueue(size_t capacity)
+    : WorkerQueue<DataObjectT, MPMC>() {
+        _ring_spsc = new SPSCRing<DataObjectT *>(capacity);
+        this->set_overflow(W_OVERFLOW_BLOCK, 0);
+    }
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT, SPSC>::WorkerQueue(size_t capacity, W_OVERFLOW overflow)
+    : WorkerQueue(capacity) {
+        this->set_overflow(overflow, 0);
+    }
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT, SPSC>::WorkerQueue(ObjectPool<DataObjectT> * objectPool)
+    : WorkerQueue<DataObjectT, MPMC>(objectPool) {
+        _ring_spsc = new SPSCRing<DataObjectT *>(objectPool->pool_capacity());
+        this->set_overflow(W_OVERFLOW_BLOCK, 0);
+    }
+
+    template <class DataObjectT>
+    WorkerQueue<DataObjectT, SPSC>::~WorkerQueue() {
+        this->close();
+        DataObjectT * p;
+        while (_ring_spsc->try_pop(p)) this->_release(p);
+        delete _ring_spsc;
+    }
+
+    template <class DataObjectT>
+    size_t WorkerQueue<DataObjectT, SPSC>::queue_size() {
+        return _ring_spsc->size();
+    }
+
+    template <class DataObjectT>
+    void WorkerQueue<DataObjectT, SPSC>::set_lane_overflow(size_t lane, W_OVERFLOW overflow, size_t limit) {
+        if (overflow == W_OVERFLOW_DROP_OLDEST) {
+            throw OIError("SPSC WorkerQueue can not evict queued objects.");
+        }
+        if (limit == 0) limit = _ring_spsc->capacity();
+        WorkerQueue<DataObjectT, MPMC>::set_lane_overflow(lane, overflow, limit);
+    }
+
+    template <class DataObjectT>
+    void WorkerQueue<DataObjectT, SPSC>::set_lanes(const std::vector<uint32_t> & weights, W_LANES mode) {
+        if (weights.size() != 1) throw OIError("SPSC WorkerQueue has a single lane.");
+        WorkerQueue<DataObjectT, MPMC>::set_lanes(weights, mode);
+    }
+
+    template <class DataObjectT>
+    void WorkerQueue<DataObjectT, SPSC>::_enqueue(std::unique_ptr<DataObjectT> p) {
+        if (!p) throw OIError("Returned NULL.");
+        if (_push_spsc(p.release())) {
+            this->_notify_queued();
+            this->_notify_listener();
+        }
+    }
+
+    template <class DataObjectT>
+    void WorkerQueue<DataObjectT, SPSC>::_enqueue_batch(DataObjectT ** in, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (in[i] == nullptr) throw OIError("Returned NULL.");
+        }
+        size_t pushed = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (_push_spsc(in[i])) pushed++;
+        }
+        if (pushed > 0) {
+            this->_notify_queued();
+            this->_notify_listener();
+        }
+    }
+
+    template <class DataObjectT>
+    bool WorkerQueue<DataObjectT, SPSC>::_push_spsc(DataObjectT * p) {
+        p->set_owner(this->_owner);
+#ifdef OI_TRACE
+        if (this->_trace_enq) p->trace(this->_trace_enq);
+#endif
+        if (this->_stats) p->_queued_at.store(WorkerStats::now_ns(), std::memory_order_relaxed);
+        W_OVERFLOW overflow = this->_lane_overflow[0];
+        size_t limit = this->_lane_limit[0];
+        if (_ring_spsc->size() >= limit) {
+            if (overflow == W_OVERFLOW_DROP_NEWEST || !this->_wait_space([this, limit] { return _ring_spsc->size() < limit; })) {
+                this->_drop(p);
+                return false;
+            }
+        }
+        if (this->_stats) this->_stats->on_put(1);
+        // The only producer saw room, so the push can only fail if limit exceeds the ring
+        while (!_ring_spsc->try_push(p)) {
+            if (overflow == W_OVERFLOW_DROP_NEWEST || !this->_wait_space([this] { return _ring_spsc->size() < _ring_spsc->capacity(); })) {
+                this->_evict(p);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <class DataObjectT>
+    std::unique_ptr<DataObjectT> WorkerQueue<DataObjectT, SPSC>::_get_data(W_TYPE t, W_FLOW f, W_DEADLINE deadline) {
+        if (t != W_TYPE_QUEUED) return WorkerQueue<DataObjectT, MPMC>::_get_data(t, f, deadline);
+        DataObjectT * p = nullptr;
+        while (!_ring_spsc->try_pop(p)) {
+            if (!this->_running || f != W_FLOW_BLOCKING) return std::unique_ptr<DataObjectT>(nullptr);
+            if (!this->_wait_queued([this]{ return !_ring_spsc->empty(); }, deadline)) {
+                if (!_ring_spsc->try_pop(p)) return std::unique_ptr<DataObjectT>(nullptr);
+                break;
+            }
+        }
+        this->_taken(p);
+        return std::unique_ptr<DataObjectT>(p);
+    }
+
+    template <class DataObjectT>
+    size_t WorkerQueue<DataObjectT, SPSC>::_get_batch(DataObjectT ** out, size_t n, W_FLOW f) {
+        size_t res = 0;
+        while (res < n && _ring_spsc->try_pop(out[res])) res++;
+        while (res == 0 && this->_running && f == W_FLOW_BLOCKING) {
+            bool ready = this->_wait_queued([this]{ return !_ring_spsc->empty(); });
+            while (res < n && _ring_spsc->try_pop(out[res])) res++;
+            if (!ready) break;
+        }
+        for (size_t i = 0; i < res; i++) this->_taken(out[i]);
+        return res;
+    }
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(WorkerQueue<DataObjectT> * q, W_TYPE t, W_FLOW f)
+    : data(q->_get_data(t, f, W_NO_DEADLINE)) {
+        _ref_obj_type = t;
+        _enqueue = false;
+        _n_shared = 0;
+        _enqueue_next = q;
+        _return_to = nullptr;
+        if (data) _return_to = (ObjectPool<DataObjectT> *) data->_return_to_pool;
+        else if (f == W_FLOW_BLOCKING && t == W_TYPE_UNUSED && q->_running ) {
+            throw OIError("OIBufferQueue has no free elements.");
+        }
+    };
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(WorkerQueue<DataObjectT> * q, W_FLOW f)
+    : data(q->_get_data(W_TYPE_QUEUED, f, W_NO_DEADLINE)) {
+        _ref_obj_type = W_TYPE_QUEUED;
+        _enqueue = false;
+        _n_shared = 0;
+        _enqueue_next = q;
+        _return_to = nullptr;
+        if (data) _return_to = (ObjectPool<DataObjectT> *) data->_return_to_pool;
+    };
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(WorkerQueue<DataObjectT> * q, W_DEADLINE deadline)
+    : data(q->_get_data(W_TYPE_QUEUED, W_FLOW_BLOCKING, deadline)) {
+        _ref_obj_type = W_TYPE_QUEUED;
+        _enqueue = false;
+        _n_shared = 0;
+        _enqueue_next = q;
+        _return_to = nullptr;
+        if (data) _return_to = (ObjectPool<DataObjectT> *) data->_return_to_pool;
+    };
+
+    template <class DataObjectT>
+    template <class Rep, class Period>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(WorkerQueue<DataObjectT> * q, const std::chrono::duration<Rep, Period> & timeout)
+    : DataObjectAcquisition(q, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout)) {}
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(ObjectPool<DataObjectT> * p, W_FLOW f)
+    : data(p->_take(f)) {
+        _ref_obj_type = W_TYPE_UNUSED;
+        _enqueue = false;
+        _n_shared = 0;
+        _enqueue_next = nullptr;
+        _return_to = p;
+    };
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(ObjectPool<DataObjectT> * p, W_DEADLINE deadline)
+    : data(p->_take(W_FLOW_BLOCKING, deadline)) {
+        _ref_obj_type = W_TYPE_UNUSED;
+        _enqueue = false;
+        _n_shared = 0;
+        _enqueue_next = nullptr;
+        _return_to = p;
+    };
+
+    template <class DataObjectT>
+    template <class Rep, class Period>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(ObjectPool<DataObjectT> * p, const std::chrono::duration<Rep, Period> & timeout)
+    : DataObjectAcquisition(p, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout)) {}
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(TieredObjectPool<DataObjectT> * p, size_t size, W_FLOW f)
+    : data(p->_take(size, f)) {
+        _ref_obj_type = W_TYPE_UNUSED;
+        _enqueue = false;
+        _n_shared = 0;
+        _enqueue_next = nullptr;
+        _return_to = nullptr;
+        if (data) _return_to = (ObjectPool<DataObjectT> *) data->_return_to_pool;
+    };
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>::~DataObjectAcquisition() {
+        _finish();
+    };
+
+    template <class DataObjectT>
+    void DataObjectAcquisition<DataObjectT>::_finish() {
+        if (!data) return;
+        if (_n_shared > 0) {
+            if (_enqueue && _enqueue_next != nullptr) {
+                _enqueue_shared[_n_shared++] = _enqueue_next;
+            }
+            // Every target queue holds its own reference; ours is passed on to the first one.
+            data->_refs.fetch_add((uint32_t) _n_shared - 1, std::memory_order_relaxed);
+            DataObjectT * raw = data.release();
+            for (size_t i = 0; i < _n_shared; i++) {
+                _enqueue_shared[i]->_enqueue(std::unique_ptr<DataObjectT>(raw));
+            }
+        } else if (_enqueue && _enqueue_next != nullptr) {
+            _enqueue_next->_enqueue(std::move(data));
+        } else {
+            _release_data();
+        }
+    };
+
+    template <class DataObjectT>
+    void DataObjectAcquisition<DataObjectT>::_release_data() {
+        if (data->_refs.fetch_sub(1, std::memory_order_acq_rel) > 1) {
+            // Still referenced from another queue; the last holder returns it.
+            data.release();
+            return;
+        }
+        if (_return_to == nullptr) {
+            // Large blob without a pool
+            data.reset();
+            return;
+        }
+        data->_refs.store(1, std::memory_order_relaxed);
+        data->lane = 0;
+        data->reset();
+        _return_to->_return(std::move(data));
+    };
+
+    template <class DataObjectT>
+    void DataObjectAcquisition<DataObjectT>::enqueue() {
+        _enqueue = true;
+    };
+
+    template <class DataObjectT>
+    void DataObjectAcquisition<DataObjectT>::enqueue(WorkerQueue<DataObjectT> * q) {
+        _enqueue = true;
+        _enqueue_next = q;
+    };
+
+    template <class DataObjectT>
+    void DataObjectAcquisition<DataObjectT>::enqueue(WorkerQueue<DataObjectT> * q, uint8_t lane) {
+        if (data) data->lane = lane;
+        enqueue(q);
+    };
+
+    template <class DataObjectT>
+    void DataObjectAcquisition<DataObjectT>::enqueue_shared(WorkerQueue<DataObjectT> * q) {
+        if (_n_shared + 1 >= W_MAX_FANOUT) throw OIError("Too many queues in fan-out.");
+        _enqueue_shared[_n_shared++] = q;
+    };
+
+    template <class DataObjectT>
+    void DataObjectAcquisition<DataObjectT>::release() {
+        _enqueue = false;
+        _enqueue_next = nullptr;
+        _n_shared = 0;
+    };
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>::DataObjectAcquisition(DataObjectAcquisition&& that) {
+        data = std::move(that.data);
+        _ref_obj_type = that._ref_obj_type;
+        _enqueue = that._enqueue;
         _return_to = that._return_to;
-        _enqueue_next = that._next;
+        _enqueue_next = that._enqueue_next;
+        _n_shared = that._n_shared;
+        for (size_t i = 0; i < _n_shared; i++) _enqueue_shared[i] = that._enqueue_shared[i];
+        that._enqueue = false;
+        that._return_to = nullptr;
+        that._enqueue_next = nullptr;
+        that._n_shared = 0;
+    };
+
+    template <class DataObjectT>
+    DataObjectAcquisition<DataObjectT>& DataObjectAcquisition<DataObjectT>::operator=(DataObjectAcquisition<DataObjectT>&& that) {
+        if (this == &that) return *this;
+        _finish();
+        data = std::move(that.data);
+        _ref_obj_type = that._ref_obj_type;
+        _enqueue = that._enqueue;
+        _return_to = that._return_to;
+        _enqueue_next = that._enqueue_next;
+        _n_shared = that._n_shared;
+        for (size_t i = 0; i < _n_shared; i++) _enqueue_shared[i] = that._enqueue_shared[i];
         that._enqueue = false;
         that._return_to = nullptr;
-        that._next = nullptr;
+        that._enqueue_next = nullptr;
+        that._n_shared = 0;
         return *this;
     };
+
+
+    template <class DataObjectT>
+    DataObjectBatch<DataObjectT>::DataObjectBatch(ObjectPool<DataObjectT> * p, size_t n, W_FLOW f)
+    : _data(n) {
+        _data.resize(n == 0 ? 0 : p->_take_many(&_data[0], n, f));
+        _enqueue_next = nullptr;
+        _enqueue = false;
+    };
+
+    template <class DataObjectT>
+    DataObjectBatch<DataObjectT>::DataObjectBatch(TieredObjectPool<DataObjectT> * p, size_t size, size_t n, W_FLOW f)
+    : _data(n) {
+        _data.resize(n == 0 ? 0 : p->_take_many(size, &_data[0], n, f));
+        _enqueue_next = nullptr;
+        _enqueue = false;
+    };
+
+    template <class DataObjectT>
+    DataObjectBatch<DataObjectT>::DataObjectBatch(WorkerQueue<DataObjectT> * q, size_t n, W_FLOW f)
+    : _data(n) {
+        _data.resize(n == 0 ? 0 : q->_get_batch(&_data[0], n, f));
+        _enqueue_next = q;
+        _enqueue = false;
+    };
+
+    template <class DataObjectT>
+    DataObjectBatch<DataObjectT>::~DataObjectBatch() {
+        _finish();
+    };
+
+    template <class DataObjectT>
+    size_t DataObjectBatch<DataObjectT>::size() {
+        return _data.size();
+    };
+
+    template <class DataObjectT>
+    bool DataObjectBatch<DataObjectT>::empty() {
+        return _data.empty();
+    };
+
+    template <class DataObjectT>
+    DataObjectT * DataObjectBatch<DataObjectT>::operator[](size_t i) {
+        return _data[i];
+    };
+
+    template <class DataObjectT>
+    void DataObjectBatch<DataObjectT>::enqueue(WorkerQueue<DataObjectT> * q) {
+        _enqueue = true;
+        _enqueue_next = q;
+    };
+
+    template <class DataObjectT>
+    void DataObjectBatch<DataObjectT>::enqueue(WorkerQueue<DataObjectT> * q, uint8_t lane) {
+        for (size_t i = 0; i < _data.size(); i++) _data[i]->lane = lane;
+        enqueue(q);
+    };
+
+    template <class DataObjectT>
+    void DataObjectBatch<DataObjectT>::release() {
+        _enqueue = false;
+        _enqueue_next = nullptr;
+    };
+
+    template <class DataObjectT>
+    void DataObjectBatch<DataObjectT>::_finish() {
+        if (_data.empty()) return;
+        if (_enqueue && _enqueue_next != nullptr) {
+            _enqueue_next->_enqueue_batch(&_data[0], _data.size());
+        } else {
+            _release_data();
+        }
+        _data.clear();
+    };
+
+    // Same rules as DataObjectAcquisition::_release_data, but consecutive objects
+    // of the same pool go back in one call.
+    template <class DataObjectT>
+    void DataObjectBatch<DataObjectT>::_release_data() {
+        size_t n = 0;
+        for (size_t i = 0; i < _data.size(); i++) {
+            DataObjectT * p = _data[i];
+            if (p->_refs.fetch_sub(1, std::memory_order_acq_rel) > 1) continue;
+            if (p->_return_to_pool == nullptr) {
+                delete p;
+                continue;
+            }
+            p->_refs.store(1, std::memory_order_relaxed);
+            p->lane = 0;
+            p->reset();
+            _data[n++] = p;
+        }
+        size_t i = 0;
+        while (i < n) {
+            ObjectPool<DataObjectT> * pool = (ObjectPool<DataObjectT> *) _data[i]->_return_to_pool;
+            size_t j = i + 1;
+            while (j < n && (ObjectPool<DataObjectT> *) _data[j]->_return_to_pool == pool) j++;
+            pool->_return_many(&_data[i], j - i);
+            i = j;
+        }
+    };
 } } }
@@ -0,0 +1,119 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OICensus.hpp"
+#include "OIThread.hpp"
+#include <algorithm>
+#include <cstdio>
+
+namespace oi { namespace core { namespace worker {
+
+    static thread_local uint16_t t_owner = W_OWNER_UNTAGGED;
+
+    std::mutex & Census::_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    std::vector<std::string> & Census::_names() {
+        static std::vector<std::string> names = { "untagged", "free", "queue" };
+        return names;
+    }
+
+    // Held while a census runs, so pools cannot go away under it
+    std::mutex & Census::_pools_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    std::vector<std::pair<const void *, std::function<PoolCensus()>>> & Census::_pools() {
+        static std::vector<std::pair<const void *, std::function<PoolCensus()>>> pools;
+        return pools;
+    }
+
+    uint16_t Census::owner(const std::string & name) {
+        std::unique_lock<std::mutex> lk(_mutex());
+        std::vector<std::string> & names = _names();
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) return (uint16_t) i;
+        }
+        if (names.size() > UINT16_MAX) return W_OWNER_UNTAGGED;
+        names.push_back(name);
+        return (uint16_t) (names.size() - 1);
+    }
+
+    std::string Census::owner_name(uint16_t owner) {
+        std::unique_lock<std::mutex> lk(_mutex());
+        if (owner >= _names().size()) return std::string();
+        return _names()[owner];
+    }
+
+    uint16_t Census::thread_owner() {
+        if (t_owner != W_OWNER_UNTAGGED) return t_owner;
+        std::string name = Threads::name();
+        if (name.empty()) {
+            static std::atomic<uint32_t> n_unnamed(0);
+            name = "thread." + std::to_string(++n_unnamed);
+        }
+        t_owner = owner(name);
+        return t_owner;
+    }
+
+    void Census::reset_thread_owner() {
+        t_owner = W_OWNER_UNTAGGED;
+    }
+
+    void Census::add_pool(const void * pool, std::function<PoolCensus()> census) {
+        std::unique_lock<std::mutex> lk(_pools_mutex());
+        _pools().push_back(std::make_pair(pool, census));
+    }
+
+    void Census::remove_pool(const void * pool) {
+        std::unique_lock<std::mutex> lk(_pools_mutex());
+        std::vector<std::pair<const void *, std::function<PoolCensus()>>> & pools = _pools();
+        for (size_t i = 0; i < pools.size(); i++) {
+            if (pools[i].first == pool) {
+                pools.erase(pools.begin() + i);
+                return;
+            }
+        }
+    }
+
+    std::vector<PoolCensus> Census::take() {
+        std::unique_lock<std::mutex> lk(_pools_mutex());
+        std::vector<std::pair<const void *, std::function<PoolCensus()>>> & pools = _pools();
+        std::vector<PoolCensus> res;
+        for (size_t i = 0; i < pools.size(); i++) res.push_back(pools[i].second());
+        return res;
+    }
+
+    void Census::print(const PoolCensus & census) {
+        printf("%-20s %zu/%zu in use\n", census.pool.empty() ? "(pool)" : census.pool.c_str(),
+               census.capacity - census.free, census.capacity);
+        for (size_t i = 0; i < census.owners.size(); i++) {
+            const CensusEntry & e = census.owners[i];
+            printf("    %-24s %6zu  oldest %10.1f ms  mean %10.1f ms\n", e.owner.c_str(), e.count,
+                   e.oldest_ns / 1000000.0, e.mean_age_ns / 1000000.0);
+        }
+    }
+
+    void Census::print() {
+        std::vector<PoolCensus> all = take();
+        for (size_t i = 0; i < all.size(); i++) print(all[i]);
+    }
+
+} } }
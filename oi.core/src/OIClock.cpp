@@ -0,0 +1,106 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OIClock.hpp"
+#include <cstdio>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace oi { namespace core {
+
+    static int64_t _sample_wall_offset() {
+        // Keep the sample with the tightest monotonic bracket around the wall clock read
+        int64_t best_offset = 0;
+        uint64_t best_gap = UINT64_MAX;
+        for (int i = 0; i < 3; i++) {
+            uint64_t m0 = Clock::now_ns();
+            int64_t wall = (int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            uint64_t m1 = Clock::now_ns();
+            if (m1 - m0 < best_gap) {
+                best_gap = m1 - m0;
+                best_offset = wall - (int64_t) (m0 + (m1 - m0) / 2);
+            }
+        }
+        return best_offset;
+    }
+
+    std::atomic<bool> Clock::_tsc(false);
+    std::atomic<int64_t> Clock::_wall_offset(_sample_wall_offset());
+    uint64_t Clock::_tsc_base = 0;
+    uint64_t Clock::_tsc_base_ns = 0;
+    double Clock::_ns_per_tick = 0.0;
+
+    void Clock::calibrate() {
+        _wall_offset.store(_sample_wall_offset(), std::memory_order_relaxed);
+    }
+
+    bool Clock::tsc_invariant() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned int a, b, c, d;
+        if (!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007) return false;
+        __get_cpuid(0x80000007, &a, &b, &c, &d);
+        return (d & (1u << 8)) != 0;
+#elif defined(_M_X64) || defined(_M_IX86)
+        int r[4];
+        __cpuid(r, 0x80000000);
+        if ((unsigned int) r[0] < 0x80000007) return false;
+        __cpuid(r, 0x80000007);
+        return (r[3] & (1 << 8)) != 0;
+#else
+        return false;
+#endif
+    }
+
+    bool Clock::set_source(W_CLOCK source) {
+        if (source == W_CLOCK_MONOTONIC) {
+            _tsc.store(false, std::memory_order_release);
+            calibrate();
+            return true;
+        }
+#ifdef OI_CLOCK_HAS_TSC
+        if (!tsc_invariant()) {
+            printf("Clock: TSC is not invariant, staying on the monotonic clock\n");
+            return false;
+        }
+        _tsc.store(false, std::memory_order_release);
+        uint64_t t0 = _steady_ns();
+        uint64_t c0 = __rdtsc();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uint64_t t1 = _steady_ns();
+        uint64_t c1 = __rdtsc();
+        if (c1 <= c0) return false;
+        _ns_per_tick = (double) (t1 - t0) / (double) (c1 - c0);
+        _tsc_base = c1;
+        _tsc_base_ns = t1;
+        _tsc.store(true, std::memory_order_release);
+        calibrate();
+        printf("Clock: using the TSC at %.3f GHz\n", 1.0 / _ns_per_tick);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    W_CLOCK Clock::source() {
+        return _tsc.load(std::memory_order_relaxed) ? W_CLOCK_TSC : W_CLOCK_MONOTONIC;
+    }
+
+} }
@@ -22,13 +22,25 @@ namespace oi { namespace core {
     
     std::chrono::milliseconds NOW() {
         return std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch()
+            std::chrono::nanoseconds(Clock::now_ns())
         );
     }
     
     std::chrono::microseconds NOWu() {
         return std::chrono::duration_cast<std::chrono::microseconds>(
-            std::chrono::system_clock::now().time_since_epoch()
+            std::chrono::nanoseconds(Clock::now_ns())
+        );
+    }
+    
+    std::chrono::milliseconds WALL() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::nanoseconds(Clock::wall_ns())
+        );
+    }
+    
+    std::chrono::milliseconds WALL(std::chrono::milliseconds now) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::nanoseconds(Clock::to_wall_ns((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()))
         );
     }
     
@@ -0,0 +1,134 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OIEventCount.hpp"
+#include "OIWorker.hpp"
+#include <climits>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+namespace oi { namespace core { namespace worker {
+    
+#ifdef __linux__
+    // Private futexes skip the lookup of the backing page, shared ones work across processes
+    static void futex_wait(std::atomic<uint32_t> * addr, uint32_t expected, const struct timespec * timeout, bool shared) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,
+                expected, timeout, nullptr, 0);
+    }
+    
+    static void futex_wake(std::atomic<uint32_t> * addr, int n, bool shared) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,
+                n, nullptr, nullptr, 0);
+    }
+#endif
+    
+    EventCount::EventCount(bool process_shared) {
+#ifndef __linux__
+        if (process_shared) throw OIError("Process shared EventCount needs Linux futexes.");
+#endif
+        _epoch = 0;
+        _waiters = 0;
+        _shared = process_shared;
+    }
+    
+    // The waiter count is raised before the epoch is read; a notifier that changed the
+    // condition and then sees no waiters is ordered before our re-check of the condition.
+    EventCount::Key EventCount::prepare_wait() {
+        _waiters.fetch_add(1, std::memory_order_seq_cst);
+        return _epoch.load(std::memory_order_seq_cst);
+    }
+    
+    void EventCount::cancel_wait() {
+        _waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+    
+    void EventCount::wait(Key key) {
+#ifdef __linux__
+        while (_epoch.load(std::memory_order_acquire) == key) futex_wait(&_epoch, key, nullptr, _shared);
+#else
+        {
+            std::unique_lock<std::mutex> lk(_m);
+            while (_epoch.load(std::memory_order_acquire) == key) _cv.wait(lk);
+        }
+#endif
+        _waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+    
+    bool EventCount::wait_until(Key key, std::chrono::steady_clock::time_point deadline) {
+        if (deadline == std::chrono::steady_clock::time_point::max()) {
+            wait(key);
+            return true;
+        }
+        bool notified = true;
+#ifdef __linux__
+        // FUTEX_WAIT takes a relative timeout, measured against CLOCK_MONOTONIC like steady_clock
+        while (_epoch.load(std::memory_order_acquire) == key) {
+            std::chrono::nanoseconds left = deadline - std::chrono::steady_clock::now();
+            if (left.count() <= 0) {
+                notified = false;
+                break;
+            }
+            struct timespec ts;
+            ts.tv_sec = (time_t) (left.count() / 1000000000);
+            ts.tv_nsec = (long) (left.count() % 1000000000);
+            futex_wait(&_epoch, key, &ts, _shared);
+        }
+#else
+        {
+            std::unique_lock<std::mutex> lk(_m);
+            while (_epoch.load(std::memory_order_acquire) == key) {
+                if (_cv.wait_until(lk, deadline) == std::cv_status::timeout) {
+                    notified = _epoch.load(std::memory_order_acquire) != key;
+                    break;
+                }
+            }
+        }
+#endif
+        _waiters.fetch_sub(1, std::memory_order_seq_cst);
+        return notified;
+    }
+    
+    void EventCount::notify_one() {
+        _notify(false);
+    }
+    
+    void EventCount::notify_all() {
+        _notify(true);
+    }
+    
+    void EventCount::_notify(bool all) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiters.load(std::memory_order_seq_cst) == 0) return;
+        _epoch.fetch_add(1, std::memory_order_seq_cst);
+#ifdef __linux__
+        futex_wake(&_epoch, all ? INT_MAX : 1, _shared);
+#else
+        {
+            // Waiters check the epoch under _m, so the bump can not fall between check and sleep
+            std::unique_lock<std::mutex> lk(_m);
+        }
+        if (all) _cv.notify_all();
+        else _cv.notify_one();
+#endif
+    }
+
+} } }
@@ -0,0 +1,191 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OIExecutor.hpp"
+#include "OIThread.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace oi { namespace core { namespace worker {
+    
+    // Worker identity of the calling thread
+    static thread_local Executor * current_executor = nullptr;
+    static thread_local size_t current_index = 0;
+    
+    // Rounds a worker spins for new tasks before it goes to sleep
+    static const int EXECUTOR_SPIN = 64;
+    
+    Executor::Executor(size_t n_workers) {
+        if (n_workers == 0) n_workers = std::thread::hardware_concurrency();
+        if (n_workers == 0) n_workers = 1;
+        _next = 0;
+        _pending = 0;
+        _sleeping = 0;
+        _running = true;
+        for (size_t i = 0; i < n_workers; i++) {
+            Worker * w = new Worker();
+            w->thread = nullptr;
+            w->executed = 0;
+            w->stolen = 0;
+            _workers.push_back(w);
+        }
+        // Only start once every deque exists, workers steal from all of them
+        for (size_t i = 0; i < n_workers; i++) {
+            _workers[i]->thread = Threads::spawn("oi.exec." + std::to_string(i), [this, i] { _run(i); });
+        }
+    }
+    
+    Executor::~Executor() {
+        shutdown();
+        for (size_t i = 0; i < _workers.size(); i++) delete _workers[i];
+    }
+    
+    Executor * Executor::shared() {
+        static Executor executor(0);
+        return &executor;
+    }
+    
+    void Executor::submit(Task task) {
+        int self = current_worker();
+        if (!_running && self < 0) throw OIError("Executor is shut down.");
+        size_t index = self >= 0 ? (size_t) self : _next.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+        {
+            std::unique_lock<std::mutex> lk(_workers[index]->m);
+            _workers[index]->tasks.push_back(std::move(task));
+        }
+        // Pairs with the check of _pending by a worker going to sleep
+        _pending.fetch_add(1);
+        if (_sleeping.load() > 0) {
+            std::unique_lock<std::mutex> lk(_m_sleep);
+            _cv_sleep.notify_one();
+        }
+    }
+    
+    bool Executor::set_affinity(size_t worker, int cpu) {
+        if (worker >= _workers.size() || _workers[worker]->thread == nullptr) return false;
+#ifdef _WIN32
+        if (cpu < 0 || cpu >= 64) return false;
+        return SetThreadAffinityMask(_workers[worker]->thread->native_handle(), (DWORD_PTR) 1 << cpu) != 0;
+#elif defined(__linux__)
+        if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(_workers[worker]->thread->native_handle(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+    
+    size_t Executor::n_workers() {
+        return _workers.size();
+    }
+    
+    int Executor::current_worker() {
+        if (current_executor != this) return -1;
+        return (int) current_index;
+    }
+    
+    uint64_t Executor::executed() {
+        uint64_t res = 0;
+        for (size_t i = 0; i < _workers.size(); i++) res += _workers[i]->executed.load(std::memory_order_relaxed);
+        return res;
+    }
+    
+    uint64_t Executor::stolen() {
+        uint64_t res = 0;
+        for (size_t i = 0; i < _workers.size(); i++) res += _workers[i]->stolen.load(std::memory_order_relaxed);
+        return res;
+    }
+    
+    void Executor::shutdown() {
+        if (_running.exchange(false) == false) return;
+        {
+            std::unique_lock<std::mutex> lk(_m_sleep);
+            _cv_sleep.notify_all();
+        }
+        for (size_t i = 0; i < _workers.size(); i++) {
+            _workers[i]->thread->join();
+            delete _workers[i]->thread;
+            _workers[i]->thread = nullptr;
+        }
+    }
+    
+    // Own deque, newest first
+    bool Executor::_pop(size_t index, Task & task) {
+        Worker * w = _workers[index];
+        std::unique_lock<std::mutex> lk(w->m);
+        if (w->tasks.empty()) return false;
+        task = std::move(w->tasks.back());
+        w->tasks.pop_back();
+        return true;
+    }
+    
+    // Other deques, oldest first, starting with the next worker so thieves spread out
+    bool Executor::_steal(size_t index, Task & task) {
+        size_t n = _workers.size();
+        for (size_t k = 1; k < n; k++) {
+            Worker * w = _workers[(index + k) % n];
+            std::unique_lock<std::mutex> lk(w->m, std::try_to_lock);
+            if (!lk.owns_lock() || w->tasks.empty()) continue;
+            task = std::move(w->tasks.front());
+            w->tasks.pop_front();
+            _workers[index]->stolen.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+    
+    void Executor::_run(size_t index) {
+        current_executor = this;
+        current_index = index;
+        Worker * self = _workers[index];
+        int idle = 0;
+        while (true) {
+            Task task;
+            if (_pop(index, task) || _steal(index, task)) {
+                _pending.fetch_sub(1);
+                task();
+                self->executed.fetch_add(1, std::memory_order_relaxed);
+                idle = 0;
+                continue;
+            }
+            if (_pending.load() > 0) {
+                // Queued somewhere but the deque was locked by someone else; try again
+                std::this_thread::yield();
+                continue;
+            }
+            if (!_running) break;
+            if (++idle < EXECUTOR_SPIN) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(_m_sleep);
+            _sleeping.fetch_add(1);
+            _cv_sleep.wait(lk, [this]{ return _pending.load() > 0 || !_running; });
+            _sleeping.fetch_sub(1);
+            idle = 0;
+        }
+        current_executor = nullptr;
+    }
+
+} } }
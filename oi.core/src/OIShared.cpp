@@ -0,0 +1,414 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OIShared.hpp"
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace oi { namespace core { namespace worker {
+    
+    // "OISH", bumped with the layout version below
+    static const uint32_t SHM_MAGIC = 0x4f495348;
+    static const uint32_t SHM_VERSION = 1;
+    
+    static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+                  "Shared segments need address free atomics");
+    
+    static size_t shm_round_up(size_t v, size_t to) {
+        return ((v + to - 1) / to) * to;
+    }
+    
+    // Fixed part of the segment; everything else is found through offsets from here
+    struct ShmHeader {
+        std::atomic<uint32_t> magic; // stored last by the creator
+        uint32_t version;
+        uint64_t size;
+        uint64_t n_buffers;
+        uint64_t buffer_size;
+        uint64_t stride;
+        uint64_t n_queues;
+        uint64_t slots_offset;
+        uint64_t ring_offset[W_SHM_MAX_QUEUES + 1]; // [0] is the pool's free list
+    };
+    
+    struct ShmCell {
+        std::atomic<uint64_t> sequence;
+        uint64_t handle;
+    };
+    
+    // MPMCRing laid out in place, with its cells right behind it, plus the process shared
+    // EventCount its waiters sleep on
+    struct ShmRing {
+        explicit ShmRing(size_t capacity) : ec(true) {
+            mask = capacity - 1;
+            enqueue_pos = 0;
+            dequeue_pos = 0;
+            closed = 0;
+            wake_gen = 0;
+            for (size_t i = 0; i < capacity; i++) cells()[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        
+        static size_t footprint(size_t capacity) {
+            return shm_round_up(sizeof(ShmRing), OI_CACHE_LINE) + capacity * sizeof(ShmCell);
+        }
+        
+        ShmCell * cells() {
+            return (ShmCell *) ((uint8_t *) this + shm_round_up(sizeof(ShmRing), OI_CACHE_LINE));
+        }
+        
+        bool try_push(uint64_t v) {
+            ShmCell * cell;
+            uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+            for (;;) {
+                cell = &cells()[pos & mask];
+                uint64_t seq = cell->sequence.load(std::memory_order_acquire);
+                int64_t dif = (int64_t) seq - (int64_t) pos;
+                if (dif == 0) {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                } else if (dif < 0) {
+                    return false;
+                } else {
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->handle = v;
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+        
+        bool try_pop(uint64_t & v) {
+            ShmCell * cell;
+            uint64_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            for (;;) {
+                cell = &cells()[pos & mask];
+                uint64_t seq = cell->sequence.load(std::memory_order_acquire);
+                int64_t dif = (int64_t) seq - (int64_t) (pos + 1);
+                if (dif == 0) {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                } else if (dif < 0) {
+                    return false;
+                } else {
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            v = cell->handle;
+            cell->sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
+        }
+        
+        size_t size() {
+            uint64_t head = dequeue_pos.load(std::memory_order_acquire);
+            uint64_t tail = enqueue_pos.load(std::memory_order_acquire);
+            return tail > head ? (size_t) (tail - head) : 0;
+        }
+        
+        void push(W_SHM_HANDLE h) {
+            if (!try_push(h)) throw OIError("Shared ring overflow, handle released twice?");
+            ec.notify_one();
+        }
+        
+        W_SHM_HANDLE pop(W_FLOW flow, W_DEADLINE deadline) {
+            uint64_t v;
+            if (try_pop(v)) return (W_SHM_HANDLE) v;
+            if (flow == W_FLOW_NONBLOCKING) return W_SHM_NONE;
+            uint32_t gen = wake_gen.load(std::memory_order_acquire);
+            bool got = false;
+            ec.await_until([this, &v, &got, gen]() -> bool {
+                if (try_pop(v)) {
+                    got = true;
+                    return true;
+                }
+                return closed.load(std::memory_order_acquire) != 0 || wake_gen.load(std::memory_order_acquire) != gen;
+            }, deadline);
+            return got ? (W_SHM_HANDLE) v : W_SHM_NONE;
+        }
+        
+        void wake_all() {
+            wake_gen.fetch_add(1, std::memory_order_release);
+            ec.notify_all();
+        }
+        
+        uint64_t mask;
+        char _pad0[OI_CACHE_LINE - sizeof(uint64_t)];
+        std::atomic<uint64_t> enqueue_pos;
+        char _pad1[OI_CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+        std::atomic<uint64_t> dequeue_pos;
+        char _pad2[OI_CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+        std::atomic<uint32_t> closed;
+        std::atomic<uint32_t> wake_gen;
+        EventCount ec;
+    };
+    
+    static std::string shm_name(const std::string & name) {
+        if (name.empty()) throw OIError("Shared segment needs a name.");
+        return name[0] == '/' ? name : "/" + name;
+    }
+    
+    SharedObjectPool::SharedObjectPool(const std::string & name, size_t n, size_t buffer_size, size_t n_queues,
+                                       uint32_t slab_flags) {
+        _name = shm_name(name);
+        _owner = true;
+        _base = nullptr;
+        _size = 0;
+        if (n == 0 || n >= W_SHM_NONE) throw OIError("Invalid number of buffers for shared pool " + _name + ".");
+        if (n_queues > W_SHM_MAX_QUEUES) throw OIError("Too many queues for shared pool " + _name + ".");
+#ifdef __linux__
+        size_t capacity = next_pow2(n < 2 ? 2 : n);
+        size_t stride = shm_round_up(OI_CACHE_LINE + buffer_size, OI_CACHE_LINE);
+        size_t ring_size = shm_round_up(ShmRing::footprint(capacity), OI_CACHE_LINE);
+        size_t offset = shm_round_up(sizeof(ShmHeader), OI_CACHE_LINE);
+        size_t ring_offset[W_SHM_MAX_QUEUES + 1];
+        for (size_t i = 0; i <= n_queues; i++) {
+            ring_offset[i] = offset;
+            offset += ring_size;
+        }
+        size_t slots_offset = shm_round_up(offset, 4096);
+        size_t size = slots_offset + n * stride;
+        
+        // A segment left behind by a crashed creator is replaced, not reused
+        int fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            printf("Replacing stale shared segment %s\n", _name.c_str());
+            shm_unlink(_name.c_str());
+            fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        }
+        if (fd < 0) throw OIError("Failed to create shared segment " + _name + ": " + strerror(errno));
+        if (ftruncate(fd, (off_t) size) != 0) {
+            close(fd);
+            shm_unlink(_name.c_str());
+            throw OIError("Failed to size shared segment " + _name + ".");
+        }
+        _map(fd, size);
+        
+        if (slab_flags & W_SLAB_MLOCK) {
+            if (mlock(_base, _size) != 0) printf("WARNING: Could not mlock %zu byte shared segment.\n", _size);
+        }
+        if (slab_flags & W_SLAB_PREFAULT) {
+            for (size_t o = 0; o < _size; o += 4096) _base[o] = 0;
+        }
+        
+        ShmHeader * header = new (_base) ShmHeader();
+        header->version = SHM_VERSION;
+        header->size = size;
+        header->n_buffers = n;
+        header->buffer_size = buffer_size;
+        header->stride = stride;
+        header->n_queues = n_queues;
+        header->slots_offset = slots_offset;
+        for (size_t i = 0; i <= n_queues; i++) {
+            header->ring_offset[i] = ring_offset[i];
+            new (_base + ring_offset[i]) ShmRing(capacity);
+        }
+        ShmRing * free_ring = (ShmRing *) (_base + ring_offset[0]);
+        for (size_t i = 0; i < n; i++) {
+            memset(_base + slots_offset + i * stride, 0, sizeof(SharedSlot));
+            free_ring->try_push(i);
+        }
+        // Openers only trust the segment once they see the magic
+        header->magic.store(SHM_MAGIC, std::memory_order_release);
+        _attach();
+#else
+        throw OIError("Shared memory pools need Linux.");
+#endif
+    }
+    
+    SharedObjectPool::SharedObjectPool(const std::string & name) {
+        _name = shm_name(name);
+        _owner = false;
+        _base = nullptr;
+        _size = 0;
+#ifdef __linux__
+        int fd = shm_open(_name.c_str(), O_RDWR, 0600);
+        if (fd < 0) throw OIError("Failed to open shared segment " + _name + ": " + strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ShmHeader)) {
+            close(fd);
+            throw OIError("Shared segment " + _name + " is not initialized.");
+        }
+        _map(fd, (size_t) st.st_size);
+        ShmHeader * header = (ShmHeader *) _base;
+        if (header->magic.load(std::memory_order_acquire) != SHM_MAGIC || header->version != SHM_VERSION
+            || header->size != _size) {
+            munmap(_base, _size);
+            _base = nullptr;
+            throw OIError("Shared segment " + _name + " is not initialized or has another layout.");
+        }
+        _attach();
+#else
+        throw OIError("Shared memory pools need Linux.");
+#endif
+    }
+    
+    SharedObjectPool::~SharedObjectPool() {
+        for (size_t i = 0; i < _queues.size(); i++) delete _queues[i];
+#ifdef __linux__
+        if (_base != nullptr) munmap(_base, _size);
+        if (_owner) shm_unlink(_name.c_str());
+#endif
+    }
+    
+    void SharedObjectPool::_map(int fd, size_t size) {
+#ifdef __linux__
+        void * mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            if (_owner) shm_unlink(_name.c_str());
+            throw OIError("Failed to map shared segment " + _name + ".");
+        }
+        _base = (uint8_t *) mem;
+        _size = size;
+#endif
+    }
+    
+    void SharedObjectPool::_attach() {
+        ShmHeader * header = (ShmHeader *) _base;
+        _header = header;
+        _pool_ring = _base + header->ring_offset[0];
+        for (size_t i = 1; i <= header->n_queues; i++) {
+            _queues.push_back(new SharedWorkerQueue(this, _base + header->ring_offset[i]));
+        }
+    }
+    
+    W_SHM_HANDLE SharedObjectPool::acquire(W_FLOW flow, W_DEADLINE deadline) {
+        return ((ShmRing *) _pool_ring)->pop(flow, deadline);
+    }
+    
+    void SharedObjectPool::release(W_SHM_HANDLE handle) {
+        if (handle >= ((ShmHeader *) _header)->n_buffers) throw OIError("Invalid handle for shared pool " + _name + ".");
+        ((ShmRing *) _pool_ring)->push(handle);
+    }
+    
+    SharedSlot * SharedObjectPool::slot(W_SHM_HANDLE handle) {
+        ShmHeader * header = (ShmHeader *) _header;
+        if (handle >= header->n_buffers) return nullptr;
+        return (SharedSlot *) (_base + header->slots_offset + handle * header->stride);
+    }
+    
+    uint8_t * SharedObjectPool::buffer(W_SHM_HANDLE handle) {
+        SharedSlot * s = slot(handle);
+        return s == nullptr ? nullptr : (uint8_t *) s + OI_CACHE_LINE;
+    }
+    
+    SharedWorkerQueue * SharedObjectPool::queue(size_t i) {
+        if (i >= _queues.size()) throw OIError("No queue " + std::to_string(i) + " in shared pool " + _name + ".");
+        return _queues[i];
+    }
+    
+    size_t SharedObjectPool::n_queues() {
+        return _queues.size();
+    }
+    
+    size_t SharedObjectPool::buffer_size() {
+        return ((ShmHeader *) _header)->buffer_size;
+    }
+    
+    size_t SharedObjectPool::pool_size() {
+        return ((ShmRing *) _pool_ring)->size();
+    }
+    
+    size_t SharedObjectPool::pool_capacity() {
+        return ((ShmHeader *) _header)->n_buffers;
+    }
+    
+    size_t SharedObjectPool::segment_size() {
+        return _size;
+    }
+    
+    std::string SharedObjectPool::name() {
+        return _name;
+    }
+    
+    bool SharedObjectPool::owner() {
+        return _owner;
+    }
+    
+    void SharedObjectPool::notify_all() {
+        ((ShmRing *) _pool_ring)->wake_all();
+    }
+    
+    SharedWorkerQueue::SharedWorkerQueue(SharedObjectPool * pool, void * ring) {
+        _pool = pool;
+        _ring = ring;
+    }
+    
+    void SharedWorkerQueue::enqueue(W_SHM_HANDLE handle) {
+        if (handle >= _pool->pool_capacity()) throw OIError("Invalid handle for shared queue.");
+        ((ShmRing *) _ring)->push(handle);
+    }
+    
+    W_SHM_HANDLE SharedWorkerQueue::dequeue(W_FLOW flow, W_DEADLINE deadline) {
+        return ((ShmRing *) _ring)->pop(flow, deadline);
+    }
+    
+    size_t SharedWorkerQueue::queue_size() {
+        return ((ShmRing *) _ring)->size();
+    }
+    
+    void SharedWorkerQueue::close() {
+        ShmRing * ring = (ShmRing *) _ring;
+        ring->closed.store(1, std::memory_order_release);
+        ring->ec.notify_all();
+    }
+    
+    bool SharedWorkerQueue::closed() {
+        return ((ShmRing *) _ring)->closed.load(std::memory_order_acquire) != 0;
+    }
+    
+    void SharedWorkerQueue::notify_all() {
+        ((ShmRing *) _ring)->wake_all();
+    }
+    
+    SharedObjectPool * SharedWorkerQueue::pool() {
+        return _pool;
+    }
+    
+    SharedAcquisition::SharedAcquisition(SharedObjectPool * pool, W_FLOW flow, W_DEADLINE deadline) {
+        _pool = pool;
+        _set(pool->acquire(flow, deadline));
+    }
+    
+    SharedAcquisition::SharedAcquisition(SharedWorkerQueue * queue, W_FLOW flow, W_DEADLINE deadline) {
+        _pool = queue->pool();
+        _set(queue->dequeue(flow, deadline));
+    }
+    
+    SharedAcquisition::~SharedAcquisition() {
+        if (handle != W_SHM_NONE) _pool->release(handle);
+    }
+    
+    void SharedAcquisition::enqueue(SharedWorkerQueue * queue) {
+        if (handle == W_SHM_NONE) return;
+        queue->enqueue(handle);
+        _set(W_SHM_NONE);
+    }
+    
+    void SharedAcquisition::_set(W_SHM_HANDLE h) {
+        handle = h;
+        slot = h == W_SHM_NONE ? nullptr : _pool->slot(h);
+        data = h == W_SHM_NONE ? nullptr : _pool->buffer(h);
+    }
+    
+} } }
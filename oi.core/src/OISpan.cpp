@@ -0,0 +1,246 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OISpan.hpp"
+#include "OIExecutor.hpp"
+#include "OIThread.hpp"
+#include "OITimer.hpp"
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <process.h>
+#define OI_GETPID _getpid
+#else
+#include <unistd.h>
+#define OI_GETPID getpid
+#endif
+
+namespace oi { namespace core { namespace worker {
+
+    static thread_local SpanRing * t_ring = nullptr;
+    static thread_local size_t t_depth = 0;
+    static thread_local bool t_sampled = false;
+    static thread_local uint32_t t_roots = 0;
+
+    static std::atomic<bool> _write_requested(false);
+
+    SpanRing::SpanRing(uint64_t tid, const std::string & thread_name)
+    : tid(tid), thread_name(thread_name) {
+        clear();
+    }
+
+    void SpanRing::push(const char * name, uint64_t start_ns, uint64_t end_ns, uint64_t arg) {
+        uint64_t h = _head.load(std::memory_order_relaxed);
+        Slot & slot = _slots[h % W_SPAN_RING_SIZE];
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.start_ns.store(start_ns, std::memory_order_relaxed);
+        slot.end_ns.store(end_ns, std::memory_order_relaxed);
+        slot.arg.store(arg, std::memory_order_relaxed);
+        _head.store(h + 1, std::memory_order_release);
+    }
+
+    void SpanRing::read(std::vector<Span> & out) const {
+        uint64_t head = _head.load(std::memory_order_acquire);
+        uint64_t from = head > W_SPAN_RING_SIZE ? head - W_SPAN_RING_SIZE : 0;
+        size_t first = out.size();
+        for (uint64_t i = from; i < head; i++) {
+            const Slot & slot = _slots[i % W_SPAN_RING_SIZE];
+            Span span;
+            span.name = slot.name.load(std::memory_order_relaxed);
+            span.start_ns = slot.start_ns.load(std::memory_order_relaxed);
+            span.end_ns = slot.end_ns.load(std::memory_order_relaxed);
+            span.arg = slot.arg.load(std::memory_order_relaxed);
+            out.push_back(span);
+        }
+        // Slot i is rewritten once the writer reaches i + W_SPAN_RING_SIZE; drop what may be torn
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = _head.load(std::memory_order_relaxed);
+        if (now >= from + W_SPAN_RING_SIZE) {
+            uint64_t valid_from = now - W_SPAN_RING_SIZE + 1;
+            size_t torn = (size_t) std::min<uint64_t>(valid_from - from, head - from);
+            out.erase(out.begin() + first, out.begin() + first + torn);
+        }
+    }
+
+    void SpanRing::clear() {
+        _head.store(0, std::memory_order_release);
+    }
+
+    std::atomic<uint32_t> Spans::_sample_every(0);
+
+    std::mutex & Spans::_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    std::vector<SpanRing *> & Spans::_rings() {
+        static std::vector<SpanRing *> rings;
+        return rings;
+    }
+
+    std::string & Spans::_path() {
+        static std::string path;
+        return path;
+    }
+
+    void Spans::enable(uint32_t sample_every) {
+        _sample_every.store(sample_every, std::memory_order_relaxed);
+    }
+
+    void Spans::disable() {
+        enable(0);
+    }
+
+    bool Spans::enabled() {
+        return sample_every() != 0;
+    }
+
+    uint32_t Spans::sample_every() {
+        return _sample_every.load(std::memory_order_relaxed);
+    }
+
+    // Rings outlive their threads so exited threads still show up in the trace
+    SpanRing * Spans::ring() {
+        if (t_ring) return t_ring;
+        std::string name = Threads::name();
+        std::unique_lock<std::mutex> lk(_mutex());
+        std::vector<SpanRing *> & rings = _rings();
+        uint64_t tid = rings.size() + 1;
+        if (name.empty()) name = "thread." + std::to_string(tid);
+        t_ring = new SpanRing(tid, name);
+        rings.push_back(t_ring);
+        return t_ring;
+    }
+
+    void Spans::clear() {
+        std::unique_lock<std::mutex> lk(_mutex());
+        std::vector<SpanRing *> & rings = _rings();
+        for (size_t i = 0; i < rings.size(); i++) rings[i]->clear();
+    }
+
+    static void _write_json_string(FILE * f, const char * s) {
+        fputc('"', f);
+        for (; *s; s++) {
+            if (*s == '"' || *s == '\\') fputc('\\', f);
+            if ((unsigned char) *s >= 0x20) fputc(*s, f);
+        }
+        fputc('"', f);
+    }
+
+    bool Spans::write(const std::string & path) {
+        std::vector<SpanRing *> rings;
+        {
+            std::unique_lock<std::mutex> lk(_mutex());
+            rings = _rings();
+        }
+        FILE * f = fopen(path.c_str(), "w");
+        if (f == nullptr) {
+            printf("Spans: could not write %s\n", path.c_str());
+            return false;
+        }
+        int pid = (int) OI_GETPID();
+        size_t n = 0;
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        std::vector<SpanRing::Span> spans;
+        for (size_t r = 0; r < rings.size(); r++) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%llu,\"args\":{\"name\":",
+                    r == 0 ? "" : ",\n", pid, (unsigned long long) rings[r]->tid);
+            _write_json_string(f, rings[r]->thread_name.c_str());
+            fprintf(f, "}}");
+            spans.clear();
+            rings[r]->read(spans);
+            for (size_t i = 0; i < spans.size(); i++) {
+                const SpanRing::Span & s = spans[i];
+                uint64_t dur = s.end_ns > s.start_ns ? s.end_ns - s.start_ns : 0;
+                fprintf(f, ",\n{\"name\":");
+                _write_json_string(f, s.name);
+                fprintf(f, ",\"cat\":\"oi\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%llu,\"args\":{\"arg\":%llu}}",
+                        (unsigned long long) (s.start_ns / 1000), (unsigned long long) (s.start_ns % 1000),
+                        (unsigned long long) (dur / 1000), (unsigned long long) (dur % 1000),
+                        pid, (unsigned long long) rings[r]->tid, (unsigned long long) s.arg);
+                n++;
+            }
+        }
+        fprintf(f, "\n]}\n");
+        bool ok = ferror(f) == 0;
+        if (fclose(f) != 0) ok = false;
+        printf("Spans: wrote %zu spans of %zu threads to %s\n", n, rings.size(), path.c_str());
+        return ok;
+    }
+
+    void Spans::write_on_exit(const std::string & path) {
+        std::unique_lock<std::mutex> lk(_mutex());
+        // Constructed before the handler is registered, so they are destroyed after it ran
+        _rings();
+        bool registered = !_path().empty();
+        _path() = path;
+        if (!registered) std::atexit([] { Spans::write(Spans::_path()); });
+    }
+
+    static void _on_signal(int) {
+        _write_requested.store(true);
+    }
+
+    void Spans::write_on_signal(const std::string & path) {
+#ifdef SIGUSR1
+        static std::string signal_path;
+        {
+            std::unique_lock<std::mutex> lk(_mutex());
+            if (!signal_path.empty()) {
+                signal_path = path;
+                return;
+            }
+            signal_path = path;
+        }
+        std::signal(SIGUSR1, _on_signal);
+        // File IO does not belong in a signal handler or on the timer thread
+        TimerWheel::shared()->schedule_every(std::chrono::milliseconds(100), [] {
+            if (!_write_requested.exchange(false)) return;
+            Executor::shared()->submit([] {
+                std::string path;
+                {
+                    std::unique_lock<std::mutex> lk(Spans::_mutex());
+                    path = signal_path;
+                }
+                Spans::write(path);
+            });
+        });
+#else
+        (void) path;
+#endif
+    }
+
+    void ScopedSpan::_begin() {
+        _entered = true;
+        if (t_depth == 0) {
+            uint32_t every = Spans::sample_every();
+            t_sampled = every != 0 && t_roots++ % every == 0;
+        }
+        t_depth++;
+        _recording = t_sampled && t_depth <= W_SPAN_MAX_DEPTH;
+        if (_recording) _start_ns = Clock::now_ns();
+    }
+
+    void ScopedSpan::_end() {
+        t_depth--;
+        if (_recording) Spans::ring()->push(_name, _start_ns, Clock::now_ns(), _arg);
+    }
+
+} } }
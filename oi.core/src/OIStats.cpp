@@ -0,0 +1,147 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OIStats.hpp"
+#include "OIClock.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+namespace oi { namespace core { namespace worker {
+    
+    double WorkerStatsSnapshot::mean_queued_us() const {
+        if (dequeued == 0) return 0.0;
+        return (double) queued_ns / (double) dequeued / 1000.0;
+    }
+    
+    double WorkerStatsSnapshot::mean_wait_us() const {
+        if (waits == 0) return 0.0;
+        return (double) wait_ns / (double) waits / 1000.0;
+    }
+    
+    WorkerStats::WorkerStats(const std::string & name, const char * kind, int64_t depth)
+    : name(name)
+    , kind(kind) {
+        _enqueued = 0;
+        _dequeued = 0;
+        _depth = depth;
+        _max_depth = depth;
+        _min_depth = depth;
+        _queued_ns = 0;
+        _waits = 0;
+        _wait_ns = 0;
+        WorkerRegistry::_add(this);
+    }
+    
+    WorkerStats::~WorkerStats() {
+        WorkerRegistry::_remove(this);
+    }
+    
+    uint64_t WorkerStats::now_ns() {
+        return Clock::now_ns();
+    }
+    
+    void WorkerStats::on_put(size_t n) {
+        _enqueued.fetch_add(n, std::memory_order_relaxed);
+        _depth_changed(_depth.fetch_add((int64_t) n, std::memory_order_relaxed) + (int64_t) n);
+    }
+    
+    void WorkerStats::on_take(size_t n) {
+        _dequeued.fetch_add(n, std::memory_order_relaxed);
+        _depth_changed(_depth.fetch_sub((int64_t) n, std::memory_order_relaxed) - (int64_t) n);
+    }
+    
+    void WorkerStats::on_evict(size_t n) {
+        _depth_changed(_depth.fetch_sub((int64_t) n, std::memory_order_relaxed) - (int64_t) n);
+    }
+    
+    void WorkerStats::on_queued(uint64_t ns) {
+        _queued_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+    
+    void WorkerStats::on_wait(uint64_t ns) {
+        _waits.fetch_add(1, std::memory_order_relaxed);
+        _wait_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+    
+    // The marks are only updated when they move, so the common case is two relaxed loads.
+    void WorkerStats::_depth_changed(int64_t depth) {
+        int64_t mark = _max_depth.load(std::memory_order_relaxed);
+        while (depth > mark && !_max_depth.compare_exchange_weak(mark, depth, std::memory_order_relaxed)) {}
+        mark = _min_depth.load(std::memory_order_relaxed);
+        while (depth < mark && !_min_depth.compare_exchange_weak(mark, depth, std::memory_order_relaxed)) {}
+    }
+    
+    WorkerStatsSnapshot WorkerStats::snapshot() const {
+        WorkerStatsSnapshot res;
+        res.name = name;
+        res.kind = kind;
+        res.enqueued = _enqueued.load(std::memory_order_relaxed);
+        res.dequeued = _dequeued.load(std::memory_order_relaxed);
+        res.depth = _depth.load(std::memory_order_relaxed);
+        res.max_depth = _max_depth.load(std::memory_order_relaxed);
+        res.min_depth = _min_depth.load(std::memory_order_relaxed);
+        res.queued_ns = _queued_ns.load(std::memory_order_relaxed);
+        res.waits = _waits.load(std::memory_order_relaxed);
+        res.wait_ns = _wait_ns.load(std::memory_order_relaxed);
+        return res;
+    }
+    
+    std::mutex & WorkerRegistry::_mutex() {
+        static std::mutex m;
+        return m;
+    }
+    
+    std::vector<WorkerStats *> & WorkerRegistry::_all() {
+        static std::vector<WorkerStats *> all;
+        return all;
+    }
+    
+    void WorkerRegistry::_add(WorkerStats * stats) {
+        std::unique_lock<std::mutex> lk(_mutex());
+        _all().push_back(stats);
+    }
+    
+    void WorkerRegistry::_remove(WorkerStats * stats) {
+        std::unique_lock<std::mutex> lk(_mutex());
+        std::vector<WorkerStats *> & all = _all();
+        all.erase(std::remove(all.begin(), all.end(), stats), all.end());
+    }
+    
+    std::vector<WorkerStatsSnapshot> WorkerRegistry::snapshot() {
+        std::unique_lock<std::mutex> lk(_mutex());
+        std::vector<WorkerStatsSnapshot> res;
+        std::vector<WorkerStats *> & all = _all();
+        for (size_t i = 0; i < all.size(); i++) res.push_back(all[i]->snapshot());
+        return res;
+    }
+    
+    void WorkerRegistry::print() {
+        std::vector<WorkerStatsSnapshot> all = snapshot();
+        printf("%-20s %-6s %12s %12s %7s %7s %7s %11s %8s %11s\n",
+               "name", "kind", "in", "out", "depth", "max", "min", "queued(us)", "waits", "wait(us)");
+        for (size_t i = 0; i < all.size(); i++) {
+            const WorkerStatsSnapshot & s = all[i];
+            printf("%-20s %-6s %12llu %12llu %7lld %7lld %7lld %11.1f %8llu %11.1f\n",
+                   s.name.c_str(), s.kind.c_str(),
+                   (unsigned long long) s.enqueued, (unsigned long long) s.dequeued,
+                   (long long) s.depth, (long long) s.max_depth, (long long) s.min_depth,
+                   s.mean_queued_us(), (unsigned long long) s.waits, s.mean_wait_us());
+        }
+    }
+
+} } }
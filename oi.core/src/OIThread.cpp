@@ -0,0 +1,214 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OIThread.hpp"
+#include "OICensus.hpp"
+#include "OIWorker.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace oi { namespace core { namespace worker {
+    
+    static std::mutex & config_mutex() {
+        static std::mutex m;
+        return m;
+    }
+    
+    static std::map<std::string, ThreadConfig> & config_map() {
+        static std::map<std::string, ThreadConfig> configs;
+        return configs;
+    }
+    
+    static std::string trim(const std::string & s) {
+        size_t b = s.find_first_not_of(" \t");
+        if (b == std::string::npos) return "";
+        size_t e = s.find_last_not_of(" \t");
+        return s.substr(b, e - b + 1);
+    }
+    
+    static int parse_int(const std::string & s, const std::string & spec) {
+        std::string t = trim(s);
+        if (t.empty() || t.find_first_not_of("0123456789") != std::string::npos) {
+            throw OIError("Invalid number '" + s + "' in thread spec '" + spec + "'.");
+        }
+        return std::stoi(t);
+    }
+    
+    // Calls fn(prefix, value) for every "prefix=value" in a ';' separated spec
+    static void parse_spec(const std::string & spec, std::function<void(const std::string &, const std::string &)> fn) {
+        size_t i = 0;
+        while (i <= spec.size()) {
+            size_t j = spec.find(';', i);
+            if (j == std::string::npos) j = spec.size();
+            std::string entry = trim(spec.substr(i, j - i));
+            i = j + 1;
+            if (entry.empty()) continue;
+            size_t eq = entry.find('=');
+            if (eq == std::string::npos || eq == 0) throw OIError("Invalid thread spec entry '" + entry + "'.");
+            fn(trim(entry.substr(0, eq)), entry.substr(eq + 1));
+        }
+    }
+    
+    void Threads::configure(const std::string & prefix, const ThreadConfig & config) {
+        std::unique_lock<std::mutex> lk(config_mutex());
+        config_map()[prefix] = config;
+    }
+    
+    void Threads::configure_cpus(const std::string & spec) {
+        parse_spec(spec, [&spec](const std::string & prefix, const std::string & value) {
+            std::vector<int> cpus;
+            size_t i = 0;
+            while (i <= value.size()) {
+                size_t j = value.find(',', i);
+                if (j == std::string::npos) j = value.size();
+                std::string range = value.substr(i, j - i);
+                i = j + 1;
+                size_t dash = range.find('-');
+                int first = parse_int(range.substr(0, dash), spec);
+                int last = dash == std::string::npos ? first : parse_int(range.substr(dash + 1), spec);
+                if (last < first) throw OIError("Invalid cpu range '" + range + "' in thread spec '" + spec + "'.");
+                for (int c = first; c <= last; c++) cpus.push_back(c);
+            }
+            std::unique_lock<std::mutex> lk(config_mutex());
+            config_map()[prefix].cpus = cpus;
+        });
+    }
+    
+    void Threads::configure_priorities(const std::string & spec) {
+        parse_spec(spec, [&spec](const std::string & prefix, const std::string & value) {
+            int priority = parse_int(value, spec);
+            if (priority > 99) throw OIError("Invalid priority '" + value + "' in thread spec '" + spec + "'.");
+            std::unique_lock<std::mutex> lk(config_mutex());
+            config_map()[prefix].priority = priority;
+        });
+    }
+    
+    ThreadConfig Threads::config(const std::string & name) {
+        std::unique_lock<std::mutex> lk(config_mutex());
+        std::map<std::string, ThreadConfig> & configs = config_map();
+        ThreadConfig res;
+        size_t best = 0;
+        bool found = false;
+        for (std::map<std::string, ThreadConfig>::iterator it = configs.begin(); it != configs.end(); ++it) {
+            if (name.compare(0, it->first.size(), it->first) != 0) continue;
+            if (found && it->first.size() < best) continue;
+            res = it->second;
+            best = it->first.size();
+            found = true;
+        }
+        return res;
+    }
+    
+    std::thread * Threads::spawn(const std::string & name, std::function<void()> fn) {
+        return new std::thread([name, fn] {
+            apply(name);
+            fn();
+        });
+    }
+    
+    void Threads::apply(const std::string & name) {
+        set_name(name);
+        ThreadConfig cfg = config(name);
+        if (!cfg.cpus.empty() && !set_affinity(cfg.cpus)) {
+            printf("Thread %s: could not set cpu affinity.\n", name.c_str());
+        }
+        if (cfg.priority > 0 && !set_priority(cfg.priority)) {
+            printf("Thread %s: could not set real-time priority %d.\n", name.c_str(), cfg.priority);
+        }
+    }
+    
+    bool Threads::set_name(const std::string & name) {
+        Census::reset_thread_owner();
+#ifdef __linux__
+        return pthread_setname_np(pthread_self(), name.substr(0, W_THREAD_NAME_MAX).c_str()) == 0;
+#else
+        return false;
+#endif
+    }
+    
+    std::string Threads::name() {
+#ifdef __linux__
+        char buf[W_THREAD_NAME_MAX + 1];
+        if (pthread_getname_np(pthread_self(), buf, sizeof(buf)) != 0) return "";
+        return std::string(buf);
+#else
+        return "";
+#endif
+    }
+    
+    bool Threads::set_affinity(const std::vector<int> & cpus) {
+#ifdef _WIN32
+        DWORD_PTR mask = 0;
+        for (size_t i = 0; i < cpus.size(); i++) {
+            if (cpus[i] < 0 || cpus[i] >= 64) return false;
+            mask |= (DWORD_PTR) 1 << cpus[i];
+        }
+        return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < cpus.size(); i++) {
+            if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) return false;
+            CPU_SET(cpus[i], &set);
+        }
+        return !cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+    
+    std::vector<int> Threads::affinity() {
+        std::vector<int> res;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) return res;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) res.push_back(c);
+        }
+#endif
+        return res;
+    }
+    
+    bool Threads::set_priority(int priority) {
+#ifdef _WIN32
+        return SetThreadPriority(GetCurrentThread(),
+            priority > 0 ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_NORMAL) != 0;
+#elif defined(__linux__)
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        if (priority <= 0) return pthread_setschedparam(pthread_self(), SCHED_OTHER, &param) == 0;
+        int lo = sched_get_priority_min(SCHED_FIFO);
+        int hi = sched_get_priority_max(SCHED_FIFO);
+        param.sched_priority = priority < lo ? lo : (priority > hi ? hi : priority);
+        return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#else
+        return false;
+#endif
+    }
+    
+} } }
@@ -0,0 +1,335 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OITimer.hpp"
+#include "OIThread.hpp"
+#include "OIClock.hpp"
+#include <climits>
+
+namespace oi { namespace core { namespace worker {
+    
+    static const uint64_t TIMER_SLOT_MASK = TIMER_SLOTS - 1;
+    static const int TIMER_BITS = 8;
+    
+    static int lowest_bit(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(v);
+#else
+        int n = 0;
+        while (!(v & 1)) {
+            v >>= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+    
+    // First set bit at or after from in a TIMER_SLOTS bitmap, -1 if none
+    static int find_from(const uint64_t * bits, size_t from) {
+        for (size_t w = from / 64; w < TIMER_SLOTS / 64; w++) {
+            uint64_t v = bits[w];
+            if (w == from / 64) v &= ~0ULL << (from % 64);
+            if (v != 0) return (int) (w * 64 + lowest_bit(v));
+        }
+        return -1;
+    }
+    
+    TimerWheel::TimerWheel(std::chrono::microseconds tick) : TimerWheel(tick, nullptr) {}
+    
+    TimerWheel::TimerWheel(std::chrono::microseconds tick, Executor * executor) {
+        if (tick.count() <= 0) throw OIError("Timer tick must be positive.");
+        _origin = std::chrono::steady_clock::now();
+        _tick = std::chrono::duration_cast<std::chrono::steady_clock::duration>(tick);
+        _executor = executor;
+        for (size_t i = 0; i < TIMER_LEVELS * TIMER_SLOTS + 1; i++) _heads[i] = -1;
+        for (size_t l = 0; l < TIMER_LEVELS; l++) {
+            for (size_t w = 0; w < TIMER_SLOTS / 64; w++) _occupied[l][w] = 0;
+        }
+        _far_slot = (int32_t) (TIMER_LEVELS * TIMER_SLOTS);
+        _current = 0;
+        _wake_at = 0;
+        _pending = 0;
+        _firing = 0;
+        _running = true;
+        _thread = Threads::spawn("oi.timer", [this] { _run(); });
+    }
+    
+    TimerWheel::~TimerWheel() {
+        shutdown();
+    }
+    
+    TimerWheel * TimerWheel::shared() {
+        static TimerWheel wheel(std::chrono::microseconds(100));
+        // Keeps Clock::wall_ns() in step with NTP adjustments of the wall clock
+        static TimerId calibrate = wheel.schedule_every(CLOCK_CALIBRATE_INTERVAL, [] { Clock::calibrate(); });
+        (void) calibrate;
+        return &wheel;
+    }
+    
+    void TimerWheel::shutdown() {
+        {
+            std::unique_lock<std::mutex> lk(_m);
+            if (!_running) return;
+            _running = false;
+            _cv.notify_one();
+        }
+        if (_thread->get_id() != std::this_thread::get_id()) _thread->join();
+        else _thread->detach();
+        delete _thread;
+        _thread = nullptr;
+    }
+    
+    TimerWheel::TimerId TimerWheel::schedule_at(W_DEADLINE when, Callback cb) {
+        return _add(when, std::chrono::steady_clock::duration::zero(), cb);
+    }
+    
+    TimerWheel::TimerId TimerWheel::_add(W_DEADLINE when, std::chrono::steady_clock::duration period, Callback cb) {
+        std::unique_lock<std::mutex> lk(_m);
+        if (!_running) throw OIError("TimerWheel is shut down.");
+        int32_t t;
+        if (_free.empty()) {
+            t = (int32_t) _timers.size();
+            _timers.push_back(Timer());
+            _timers[t].gen = 1;
+        } else {
+            t = _free.back();
+            _free.pop_back();
+        }
+        Timer & tm = _timers[t];
+        tm.when = when;
+        tm.period = period;
+        tm.cb = cb;
+        tm.expiry = _tick_of(when);
+        _link(t);
+        _pending++;
+        // Only wake the wheel thread if it sleeps past the new timer
+        if (tm.expiry < _wake_at) _cv.notify_one();
+        return ((uint64_t) tm.gen << 32) | (uint64_t) (t + 1);
+    }
+    
+    bool TimerWheel::cancel(TimerId id) {
+        std::unique_lock<std::mutex> lk(_m);
+        int64_t t = (int64_t) (id & 0xffffffffULL) - 1;
+        bool res = false;
+        if (t >= 0 && t < (int64_t) _timers.size() && _timers[t].gen == (uint32_t) (id >> 32) && _timers[t].slot >= 0) {
+            _unlink((int32_t) t);
+            _release((int32_t) t);
+            res = true;
+        }
+        while (_executor == nullptr && _firing == id && _thread != nullptr && _thread->get_id() != std::this_thread::get_id()) {
+            _cv_fired.wait(lk);
+        }
+        return res;
+    }
+    
+    size_t TimerWheel::pending() {
+        std::unique_lock<std::mutex> lk(_m);
+        return _pending;
+    }
+    
+    std::chrono::microseconds TimerWheel::tick() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(_tick);
+    }
+    
+    // Rounds up, so a timer never fires before its deadline
+    uint64_t TimerWheel::_tick_of(W_DEADLINE when) {
+        if (when <= _origin) return 0;
+        if (when == W_NO_DEADLINE) return UINT64_MAX;
+        std::chrono::steady_clock::duration d = when - _origin;
+        return (uint64_t) ((d.count() + _tick.count() - 1) / _tick.count());
+    }
+    
+    // A timer goes into the lowest level at which its expiry shares all higher bits with
+    // _current; its slot index there is then always ahead of _current's index.
+    void TimerWheel::_link(int32_t t) {
+        Timer & tm = _timers[t];
+        if (tm.expiry < _current) tm.expiry = _current;
+        int32_t slot = _far_slot;
+        for (size_t l = 0; l < TIMER_LEVELS; l++) {
+            int shift = TIMER_BITS * (int) (l + 1);
+            if ((tm.expiry >> shift) == (_current >> shift)) {
+                size_t index = (size_t) (tm.expiry >> (TIMER_BITS * l)) & TIMER_SLOT_MASK;
+                slot = (int32_t) (l * TIMER_SLOTS + index);
+                _occupied[l][index / 64] |= 1ULL << (index % 64);
+                break;
+            }
+        }
+        tm.slot = slot;
+        tm.prev = -1;
+        tm.next = _heads[slot];
+        if (tm.next >= 0) _timers[tm.next].prev = t;
+        _heads[slot] = t;
+    }
+    
+    void TimerWheel::_unlink(int32_t t) {
+        Timer & tm = _timers[t];
+        if (tm.prev >= 0) _timers[tm.prev].next = tm.next;
+        else _heads[tm.slot] = tm.next;
+        if (tm.next >= 0) _timers[tm.next].prev = tm.prev;
+        if (_heads[tm.slot] < 0 && tm.slot != _far_slot) {
+            size_t l = tm.slot / TIMER_SLOTS;
+            size_t index = tm.slot % TIMER_SLOTS;
+            _occupied[l][index / 64] &= ~(1ULL << (index % 64));
+        }
+        tm.slot = -1;
+    }
+    
+    void TimerWheel::_release(int32_t t) {
+        Timer & tm = _timers[t];
+        tm.cb = nullptr;
+        tm.slot = -1;
+        tm.gen++;
+        if (tm.gen == 0) tm.gen = 1;
+        _free.push_back(t);
+        _pending--;
+    }
+    
+    // Next tick at which a slot fires or has to be spread over the level below
+    bool TimerWheel::_next_event(uint64_t & tick) {
+        bool found = false;
+        uint64_t c = _current;
+        int index = find_from(_occupied[0], (size_t) (c & TIMER_SLOT_MASK));
+        if (index >= 0) {
+            tick = (c & ~TIMER_SLOT_MASK) | (uint64_t) index;
+            found = true;
+        }
+        for (size_t l = 1; l < TIMER_LEVELS; l++) {
+            int shift = TIMER_BITS * (int) l;
+            size_t current_index = (size_t) (c >> shift) & TIMER_SLOT_MASK;
+            bool at_boundary = (c & ((1ULL << shift) - 1)) == 0;
+            size_t from = at_boundary ? current_index : current_index + 1;
+            if (from >= TIMER_SLOTS) continue;
+            index = find_from(_occupied[l], from);
+            if (index < 0) continue;
+            int upper = shift + TIMER_BITS;
+            uint64_t base = upper >= 64 ? 0 : (c >> upper) << upper;
+            uint64_t candidate = base | ((uint64_t) index << shift);
+            if (!found || candidate < tick) tick = candidate;
+            found = true;
+        }
+        if (_heads[_far_slot] >= 0) {
+            int shift = TIMER_BITS * (int) TIMER_LEVELS;
+            uint64_t candidate = (c & ((1ULL << shift) - 1)) == 0 ? c : ((c >> shift) + 1) << shift;
+            if (!found || candidate < tick) tick = candidate;
+            found = true;
+        }
+        return found;
+    }
+    
+    // Spreads the slots whose time has come over the lower levels (top down, so a timer can
+    // move several levels in one tick), then hands out level 0's slot for this tick.
+    void TimerWheel::_process(uint64_t tick, std::vector<int32_t> & fired) {
+        _current = tick;
+        for (size_t l = TIMER_LEVELS; l > 0; l--) {
+            int shift = TIMER_BITS * (int) l;
+            if ((tick & ((1ULL << shift) - 1)) != 0) continue;
+            int32_t slot = l == TIMER_LEVELS ? _far_slot : (int32_t) (l * TIMER_SLOTS + ((tick >> shift) & TIMER_SLOT_MASK));
+            int32_t t = _heads[slot];
+            _heads[slot] = -1;
+            if (slot != _far_slot) {
+                size_t index = slot % TIMER_SLOTS;
+                _occupied[l][index / 64] &= ~(1ULL << (index % 64));
+            }
+            while (t >= 0) {
+                int32_t next = _timers[t].next;
+                _link(t);
+                t = next;
+            }
+        }
+        int32_t slot = (int32_t) (tick & TIMER_SLOT_MASK);
+        int32_t t = _heads[slot];
+        _heads[slot] = -1;
+        _occupied[0][slot / 64] &= ~(1ULL << (slot % 64));
+        while (t >= 0) {
+            fired.push_back(t);
+            _timers[t].slot = -1;
+            t = _timers[t].next;
+        }
+    }
+    
+    void TimerWheel::_run() {
+        struct Fired {
+            TimerId id;
+            Callback cb;
+            bool periodic;
+        };
+        std::vector<int32_t> fired;
+        std::vector<Fired> due;
+        std::unique_lock<std::mutex> lk(_m);
+        while (_running) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            uint64_t now_tick = (uint64_t) ((now - _origin).count() / _tick.count());
+            uint64_t next;
+            while (_next_event(next) && next <= now_tick) {
+                _process(next, fired);
+                _current = next + 1;
+                for (size_t i = 0; i < fired.size(); i++) {
+                    int32_t t = fired[i];
+                    Timer & tm = _timers[t];
+                    Fired f;
+                    f.id = ((uint64_t) tm.gen << 32) | (uint64_t) (t + 1);
+                    f.cb = tm.cb;
+                    f.periodic = tm.period.count() > 0;
+                    if (f.periodic) {
+                        // Keep the original phase; skip the runs that are already missed
+                        tm.when += tm.period;
+                        if (tm.when <= now) tm.when += tm.period * ((now - tm.when) / tm.period + 1);
+                        tm.expiry = _tick_of(tm.when);
+                        _link(t);
+                    } else {
+                        _release(t);
+                    }
+                    due.push_back(f);
+                }
+                fired.clear();
+            }
+            // Nothing is due up to now_tick, so the ticks in between can be skipped
+            if (_current <= now_tick) _current = now_tick + 1;
+
+            if (!due.empty()) {
+                _wake_at = 0;
+                for (size_t i = 0; i < due.size(); i++) {
+                    if (_executor != nullptr) {
+                        _executor->submit(due[i].cb);
+                        continue;
+                    }
+                    int64_t t = (int64_t) (due[i].id & 0xffffffffULL) - 1;
+                    // A periodic timer may have been cancelled since it was collected
+                    if (due[i].periodic && _timers[t].gen != (uint32_t) (due[i].id >> 32)) continue;
+                    _firing = due[i].id;
+                    lk.unlock();
+                    due[i].cb();
+                    lk.lock();
+                    _firing = 0;
+                    _cv_fired.notify_all();
+                }
+                due.clear();
+                continue;
+            }
+
+            if (_next_event(next)) {
+                _wake_at = next;
+                _cv.wait_until(lk, _origin + _tick * (int64_t) next);
+            } else {
+                _wake_at = UINT64_MAX;
+                _cv.wait(lk);
+            }
+            _wake_at = 0;
+        }
+    }
+
+} } }
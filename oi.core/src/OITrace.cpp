@@ -0,0 +1,182 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "OITrace.hpp"
+#include <algorithm>
+#include <cstdio>
+
+namespace oi { namespace core { namespace worker {
+
+    static size_t _msb(uint64_t v) {
+#if defined(__GNUC__)
+        return 63 - __builtin_clzll(v);
+#else
+        size_t r = 0;
+        while (v >>= 1) r++;
+        return r;
+#endif
+    }
+
+    LatencyHistogram::LatencyHistogram() {
+        clear();
+    }
+
+    size_t LatencyHistogram::bucket(uint64_t ns) {
+        if (ns < W_HIST_SUB) return (size_t) ns;
+        size_t e = _msb(ns);
+        return (e - W_HIST_SUB_BITS + 1) * W_HIST_SUB + ((ns >> (e - W_HIST_SUB_BITS)) & (W_HIST_SUB - 1));
+    }
+
+    uint64_t LatencyHistogram::bucket_max(size_t i) {
+        if (i < W_HIST_SUB) return i;
+        size_t shift = i / W_HIST_SUB - 1;
+        uint64_t lower = (uint64_t) (W_HIST_SUB + i % W_HIST_SUB) << shift;
+        return lower + ((uint64_t) 1 << shift) - 1;
+    }
+
+    void LatencyHistogram::record(uint64_t ns) {
+        _buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t mark = _max.load(std::memory_order_relaxed);
+        while (ns > mark && !_max.compare_exchange_weak(mark, ns, std::memory_order_relaxed)) {}
+    }
+
+    void LatencyHistogram::clear() {
+        for (size_t i = 0; i < W_HIST_BUCKETS; i++) _buckets[i].store(0, std::memory_order_relaxed);
+        _count = 0;
+        _sum = 0;
+        _max = 0;
+    }
+
+    uint64_t LatencyHistogram::count() const {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t LatencyHistogram::max() const {
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    double LatencyHistogram::mean() const {
+        uint64_t n = count();
+        if (n == 0) return 0.0;
+        return (double) _sum.load(std::memory_order_relaxed) / (double) n;
+    }
+
+    uint64_t LatencyHistogram::percentile(double p) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t) (p / 100.0 * (double) n + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < W_HIST_BUCKETS; i++) {
+            seen += _buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(bucket_max(i), max());
+        }
+        return max();
+    }
+
+    std::atomic<LatencyHistogram *> Tracer::_histograms[W_TRACE_MAX_STAGES];
+
+    std::mutex & Tracer::_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    std::vector<std::string> & Tracer::_names() {
+        static std::vector<std::string> names(1, "total");
+        return names;
+    }
+
+    uint16_t Tracer::stage(const std::string & name) {
+        std::unique_lock<std::mutex> lk(_mutex());
+        std::vector<std::string> & names = _names();
+        for (size_t i = 1; i < names.size(); i++) {
+            if (names[i] == name) return (uint16_t) i;
+        }
+        if (names.size() >= W_TRACE_MAX_STAGES) {
+            printf("Tracer: no room for stage %s\n", name.c_str());
+            return 0;
+        }
+        if (_histograms[0].load() == nullptr) _histograms[0].store(new LatencyHistogram());
+        _histograms[names.size()].store(new LatencyHistogram());
+        names.push_back(name);
+        return (uint16_t) (names.size() - 1);
+    }
+
+    std::string Tracer::stage_name(uint16_t stage) {
+        std::unique_lock<std::mutex> lk(_mutex());
+        if (stage >= _names().size()) return std::string();
+        return _names()[stage];
+    }
+
+    LatencyHistogram * Tracer::histogram(uint16_t stage) {
+        if (stage >= W_TRACE_MAX_STAGES) return nullptr;
+        return _histograms[stage].load(std::memory_order_acquire);
+    }
+
+    void Tracer::collect(const TraceStamp * stamps, size_t n) {
+        if (n < 2) return;
+        // The object is done when its last branch is
+        uint64_t last = stamps[n - 1].ns;
+        for (size_t i = 1; i < n; i++) {
+            // Branches of a shared object interleave: find the stamp this one follows
+            size_t prev = i - 1;
+            for (size_t j = i; j-- > 0;) {
+                if (stamps[i].after != 0 ? stamps[j].stage == stamps[i].after
+                                         : !stamps[i].shared || stamps[j].thread == stamps[i].thread) {
+                    prev = j;
+                    break;
+                }
+            }
+            LatencyHistogram * h = histogram(stamps[i].stage);
+            // Stamps from different cores may be a few ns out of order
+            if (h) h->record(stamps[i].ns > stamps[prev].ns ? stamps[i].ns - stamps[prev].ns : 0);
+            if (stamps[i].shared && stamps[i].ns > last) last = stamps[i].ns;
+        }
+        if (last > stamps[0].ns) histogram(0)->record(last - stamps[0].ns);
+    }
+
+    void Tracer::clear() {
+        for (size_t i = 0; i < W_TRACE_MAX_STAGES; i++) {
+            LatencyHistogram * h = histogram((uint16_t) i);
+            if (h) h->clear();
+        }
+    }
+
+    void Tracer::print() {
+        std::vector<std::string> names;
+        {
+            std::unique_lock<std::mutex> lk(_mutex());
+            names = _names();
+        }
+        bool header = false;
+        for (size_t i = 0; i < names.size(); i++) {
+            LatencyHistogram * h = histogram((uint16_t) i);
+            if (h == nullptr || h->count() == 0) continue;
+            if (!header) {
+                printf("%-24s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+                header = true;
+            }
+            printf("%-24s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[i].c_str(),
+                   (unsigned long long) h->count(), h->mean() / 1000.0,
+                   h->percentile(50) / 1000.0, h->percentile(90) / 1000.0,
+                   h->percentile(99) / 1000.0, h->max() / 1000.0);
+        }
+    }
+
+} } }
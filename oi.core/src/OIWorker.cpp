@@ -17,22 +17,327 @@ along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
 
 #include "OIWorker.hpp"
 #include <type_traits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace oi { namespace core { namespace worker {
     
+    static size_t round_up(size_t v, size_t to) {
+        return ((v + to - 1) / to) * to;
+    }
+    
+    ObjectPoolBase::ObjectPoolBase(size_t n, size_t buffer_size, uint32_t slab_flags) {
+        _census = false;
+        _buffer_size = buffer_size;
+        _stride = round_up(buffer_size > 0 ? buffer_size : 1, OI_CACHE_LINE);
+        _n_slots = n;
+        _n_carved = 0;
+        _slab = nullptr;
+        _mapped = false;
+        _huge_pages = false;
+        _locked = false;
+        _slab_size = _n_slots * _stride;
+        if (_slab_size == 0) return;
+        
+#ifdef _WIN32
+        _slab_size = round_up(_slab_size, 4096);
+        _slab = (uint8_t *) _aligned_malloc(_slab_size, 4096);
+        if (_slab == nullptr) throw OIError("Failed to allocate ObjectPool slab.");
+        if (slab_flags & W_SLAB_MLOCK) _locked = VirtualLock(_slab, _slab_size) != 0;
+#else
+        size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+        void * mem = MAP_FAILED;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+        if (slab_flags & W_SLAB_HUGEPAGES) {
+            const size_t huge_page_size = 2 * 1024 * 1024;
+            size_t huge_size = round_up(_slab_size, huge_page_size);
+            mem = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem != MAP_FAILED) {
+                _slab_size = huge_size;
+                _huge_pages = true;
+            }
+        }
+#endif
+        if (mem == MAP_FAILED) {
+            _slab_size = round_up(_slab_size, page_size);
+            mem = mmap(nullptr, _slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) throw OIError("Failed to map ObjectPool slab.");
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+            // No reserved huge pages; ask for transparent huge pages instead.
+            if (slab_flags & W_SLAB_HUGEPAGES) {
+                _huge_pages = madvise(mem, _slab_size, MADV_HUGEPAGE) == 0;
+            }
+#endif
+        }
+        _slab = (uint8_t *) mem;
+        _mapped = true;
+        
+        if (slab_flags & W_SLAB_MLOCK) {
+            _locked = mlock(_slab, _slab_size) == 0;
+            if (!_locked) printf("WARNING: Could not mlock %zu byte ObjectPool slab.\n", _slab_size);
+        }
+        if (slab_flags & W_SLAB_PREFAULT) {
+            for (size_t offset = 0; offset < _slab_size; offset += page_size) {
+                _slab[offset] = 0;
+            }
+        }
+#endif
+    }
+    
+    ObjectPoolBase::~ObjectPoolBase() {
+        if (_slab == nullptr) return;
+#ifdef _WIN32
+        if (_locked) VirtualUnlock(_slab, _slab_size);
+        _aligned_free(_slab);
+#else
+        if (_locked) munlock(_slab, _slab_size);
+        if (_mapped) munmap(_slab, _slab_size);
+#endif
+        _slab = nullptr;
+    }
+    
+    uint8_t * ObjectPoolBase::_carve(size_t buffer_size) {
+        if (_slab == nullptr || buffer_size > _stride || _n_carved >= _n_slots) return nullptr;
+        uint8_t * res = &_slab[_n_carved * _stride];
+        _n_carved++;
+        return res;
+    }
+    
+    size_t ObjectPoolBase::slab_size() {
+        return _slab_size;
+    }
+    
+    size_t ObjectPoolBase::buffer_size() {
+        return _buffer_size;
+    }
+    
+    size_t ObjectPoolBase::buffer_stride() {
+        return _stride;
+    }
+    
+    bool ObjectPoolBase::huge_pages() {
+        return _huge_pages;
+    }
+    
+    bool ObjectPoolBase::locked() {
+        return _locked;
+    }
+    
+    size_t ObjectPoolBase::_thread_slot() {
+        static std::atomic<size_t> next_slot(0);
+        static thread_local size_t slot = next_slot++;
+        return slot;
+    }
+    
+    bool ObjectPoolBase::_contains(const uint8_t * p) {
+        return _slab != nullptr && p >= _slab && p < _slab + _slab_size;
+    }
+    
+    // Buffers come from the pool's slab when there is one; objects created
+    // outside of a pool allocate (and free) their own buffer.
+    uint8_t * DataObject::_allocate_buffer(size_t buffer_size, ObjectPool<DataObject> * pool) {
+        uint8_t * res = nullptr;
+        if (pool != nullptr) res = static_cast<ObjectPoolBase *>(pool)->_carve(buffer_size);
+        if (res == nullptr) res = new uint8_t[buffer_size];
+        return res;
+    }
+    
     DataObject::DataObject(size_t buffer_size, ObjectPool<DataObject> * _pool)
     : buffer_size(buffer_size)
-    , buffer(new uint8_t[buffer_size]) {
+    , buffer(_allocate_buffer(buffer_size, _pool)) {
+        _headroom = 0;
+        _tailroom = 0;
+#ifdef OI_TRACE
+        _n_trace = 0;
+#endif
         reset();
         this->_return_to_pool = _pool;
+        this->_refs = 1;
+        this->_queued_at = 0;
+        this->lane = 0;
+        this->_owns_buffer = _pool == nullptr || !static_cast<ObjectPoolBase *>(_pool)->_contains(buffer);
+        this->_census = _pool == nullptr ? nullptr : &static_cast<ObjectPoolBase *>(_pool)->_census;
+        this->_owner = W_OWNER_UNTAGGED;
+        this->_owned_at = 0;
     }
     
     DataObject::~DataObject() {
+        _release_segments();
+        if (_owns_buffer) delete [] buffer;
     };
     
+    bool DataObject::shared() const {
+        return _refs.load(std::memory_order_relaxed) > 1;
+    }
+    
+    uint16_t DataObject::owner() const {
+        return _owner.load(std::memory_order_relaxed);
+    }
+    
+    uint64_t DataObject::owned_since() const {
+        return _owned_at.load(std::memory_order_relaxed);
+    }
+    
     void DataObject::reset() {
-        data_end = 0;
-        data_start = 0;
+        data_end = _headroom;
+        data_start = _headroom;
+        _release_segments();
+#ifdef OI_TRACE
+        Tracer::collect(_trace, n_trace());
+        _n_trace.store(0, std::memory_order_relaxed);
+#endif
+    }
+    
+#ifdef OI_TRACE
+    void DataObject::trace(uint16_t stage) {
+        trace(stage, Clock::now_ns());
+    }
+    
+    // Every branch of a shared object claims its own slot; the stamps are only read once
+    // the last reference is gone, so the slots themselves need no synchronisation.
+    void DataObject::trace(uint16_t stage, uint64_t ns) {
+        _trace_after(stage, 0, ns);
+    }
+    
+    void DataObject::_trace_after(uint16_t stage, uint16_t after, uint64_t ns) {
+        if (stage == 0) return;
+        size_t i = _n_trace.fetch_add(1, std::memory_order_relaxed);
+        if (i >= W_TRACE_MAX_STAMPS) return;
+        _trace[i].stage = stage;
+        _trace[i].after = after;
+        _trace[i].thread = (uint16_t) ObjectPoolBase::_thread_slot();
+        _trace[i].shared = shared();
+        _trace[i].ns = ns;
+    }
+    
+    size_t DataObject::n_trace() const {
+        size_t n = _n_trace.load(std::memory_order_relaxed);
+        return n < W_TRACE_MAX_STAMPS ? n : W_TRACE_MAX_STAMPS;
+    }
+    
+    const TraceStamp & DataObject::trace_stamp(size_t i) const {
+        if (i >= n_trace()) throw OIError("Trace stamp out of range.");
+        return _trace[i];
+    }
+#endif
+    
+    void DataObject::reserve(size_t headroom, size_t tailroom) {
+        if (headroom + tailroom > buffer_size) throw OIError("DataObject headroom exceeds its buffer.");
+        _headroom = headroom;
+        _tailroom = tailroom;
+        data_end = _headroom;
+        data_start = _headroom;
+    }
+    
+    size_t DataObject::reserved_headroom() const {
+        return _headroom;
+    }
+    
+    size_t DataObject::reserved_tailroom() const {
+        return _tailroom;
+    }
+    
+    uint8_t * DataObject::payload() {
+        return buffer + data_start;
+    }
+    
+    size_t DataObject::payload_size() const {
+        return data_end - data_start;
+    }
+    
+    size_t DataObject::payload_capacity() const {
+        return buffer_size - _headroom - _tailroom;
+    }
+    
+    size_t DataObject::headroom() const {
+        return data_start;
+    }
+    
+    size_t DataObject::tailroom() const {
+        return buffer_size - data_end;
+    }
+    
+    uint8_t * DataObject::push_header(size_t n) {
+        if (n > data_start) throw OIError("DataObject has no headroom for a " + std::to_string(n) + " byte header.");
+        data_start -= n;
+        return buffer + data_start;
+    }
+    
+    uint8_t * DataObject::pull_header(size_t n) {
+        if (n > data_end - data_start) throw OIError("DataObject payload is shorter than the header to pull.");
+        uint8_t * res = buffer + data_start;
+        data_start += n;
+        return res;
+    }
+    
+    uint8_t * DataObject::put(size_t n) {
+        if (data_end + n + _tailroom > buffer_size) throw OIError("DataObject has no room for " + std::to_string(n) + " more payload bytes.");
+        uint8_t * res = buffer + data_end;
+        data_end += n;
+        return res;
+    }
+    
+    uint8_t * DataObject::push_trailer(size_t n) {
+        if (data_end + n > buffer_size) throw OIError("DataObject has no tailroom for a " + std::to_string(n) + " byte trailer.");
+        uint8_t * res = buffer + data_end;
+        data_end += n;
+        return res;
+    }
+    
+    void DataObject::add_segment(const uint8_t * data, size_t size, std::function<void()> release) {
+        if (_segments.size() >= W_MAX_SEGMENTS) {
+            if (release) release();
+            throw OIError("DataObject can not chain more than " + std::to_string(W_MAX_SEGMENTS) + " segments.");
+        }
+        // Pooled objects keep the capacity, so only their first chain allocates
+        if (_segments.capacity() == 0) _segments.reserve(W_MAX_SEGMENTS);
+        DataSegment s;
+        s.data = data;
+        s.size = size;
+        s.release = std::move(release);
+        _segments.push_back(std::move(s));
+    }
+    
+    size_t DataObject::n_segments() const {
+        return _segments.size();
+    }
+    
+    const DataSegment & DataObject::segment(size_t i) const {
+        return _segments.at(i);
+    }
+    
+    size_t DataObject::message_size() const {
+        size_t res = data_end - data_start;
+        for (size_t i = 0; i < _segments.size(); i++) res += _segments[i].size;
+        return res;
+    }
+    
+    size_t DataObject::gather(uint8_t * out, size_t size) const {
+        size_t total = message_size();
+        if (size < total) return 0;
+        size_t offset = data_end - data_start;
+        memcpy(out, buffer + data_start, offset);
+        for (size_t i = 0; i < _segments.size(); i++) {
+            memcpy(out + offset, _segments[i].data, _segments[i].size);
+            offset += _segments[i].size;
+        }
+        return total;
+    }
+    
+    void DataObject::_release_segments() {
+        for (size_t i = 0; i < _segments.size(); i++) {
+            if (_segments[i].release) _segments[i].release();
+        }
+        _segments.clear();
     }
     
     
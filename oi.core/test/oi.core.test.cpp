@@ -2,6 +2,14 @@
 #include <iostream>
 #include <thread>
 #include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 using namespace oi::core;
 using namespace oi::core::worker;
@@ -65,16 +73,17 @@ public:
         printf("Processor Closed\n");
     }
     
-    OICoreTest(std::string msg) {
+    OICoreTest(std::string msg, W_BACKEND backend, bool spsc) {
         runs = 1000;
         consumed = 0;
-        pool = new ObjectPool<TestObject>(2, 1024);
-        worker1 = new WorkerQueue<TestObject>(pool);
+        pool = new ObjectPool<TestObject>(2, 1024, backend);
+        if (spsc) worker1 = new WorkerQueue<TestObject, SPSC>(pool);
+        else worker1 = new WorkerQueue<TestObject>(pool, backend);
         
         std::chrono::microseconds t0 = NOWu();
         tCreate1 = new std::thread(&OICoreTest::CreateObjects, this);
         tConsume1 = new std::thread(&OICoreTest::ConsumeObjects, this);
-        tConsume2 = new std::thread(&OICoreTest::ConsumeObjects, this);
+        if (!spsc) tConsume2 = new std::thread(&OICoreTest::ConsumeObjects, this);
         //std::this_thread::sleep_for(std::chrono::milliseconds(10));
         
         //running = false;
@@ -83,13 +92,1292 @@ public:
         printf("tCreate1 closed\n");
         tConsume1->join();
         printf("tConsume1 closed\n");
-        tConsume2->join();
-        printf("tConsume2 closed\n");
+        if (!spsc) {
+            tConsume2->join();
+            printf("tConsume2 closed\n");
+        }
         worker1->close();
         printf("End of programm %lld\n", (NOWu()-t0).count());
     }
 };
 
+void TestFanOut() {
+    ObjectPool<TestObject> pool(1, 64);
+    WorkerQueue<TestObject> q1;
+    WorkerQueue<TestObject> q2;
+    {
+        DataObjectAcquisition<TestObject> doa(&pool, W_FLOW_NONBLOCKING);
+        assert(doa.data);
+        doa.data->id = 42;
+        doa.enqueue_shared(&q1);
+        doa.enqueue_shared(&q2);
+    }
+    assert(pool.pool_size() == 0);
+    {
+        DataObjectAcquisition<TestObject> doa(&q1, W_FLOW_NONBLOCKING);
+        assert(doa.data && doa.data->id == 42 && doa.data->shared());
+    }
+    assert(pool.pool_size() == 0);
+    {
+        DataObjectAcquisition<TestObject> doa(&q2, W_FLOW_NONBLOCKING);
+        assert(doa.data && doa.data->id == 42);
+    }
+    assert(pool.pool_size() == 1);
+
+    // Queues destroyed while still holding a shared object release one reference each
+    WorkerQueue<TestObject> * q_lockfree = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 8);
+    WorkerQueue<TestObject> * q_mutex = new WorkerQueue<TestObject>(W_BACKEND_MUTEX, 0);
+    WorkerQueue<TestObject, SPSC> * q_spsc = new WorkerQueue<TestObject, SPSC>(4);
+    {
+        DataObjectAcquisition<TestObject> doa(&pool, W_FLOW_NONBLOCKING);
+        assert(doa.data);
+        doa.enqueue_shared(q_lockfree);
+        doa.enqueue_shared(q_mutex);
+        doa.enqueue_shared(q_spsc);
+    }
+    assert(pool.pool_size() == 0);
+    delete q_lockfree;
+    assert(pool.pool_size() == 0);
+    delete q_mutex;
+    assert(pool.pool_size() == 0);
+    delete q_spsc;
+    assert(pool.pool_size() == 1);
+    printf("Fan-out OK\n");
+}
+
+void TestSlab() {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(4, 100, W_BACKEND_LOCKFREE, W_SLAB_HUGEPAGES | W_SLAB_PREFAULT);
+    assert(pool->buffer_stride() == 128);
+    assert(pool->slab_size() >= 4 * 128);
+    {
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+        DataObjectAcquisition<TestObject> b(pool, W_FLOW_NONBLOCKING);
+        assert(a.data && b.data);
+        assert(((uintptr_t) a.data->buffer) % 64 == 0);
+        size_t distance = a.data->buffer > b.data->buffer ? a.data->buffer - b.data->buffer : b.data->buffer - a.data->buffer;
+        assert(distance % 128 == 0 && distance < pool->slab_size());
+        memset(a.data->buffer, 0xAB, a.data->buffer_size);
+    }
+    delete pool;
+    printf("Slab OK\n");
+}
+
+void TestTiered() {
+    TieredObjectPool<TestObject> tiers;
+    tiers.add_class(2, 4096, W_BACKEND_LOCKFREE, W_SLAB_DEFAULT);
+    tiers.add_class(2, 512, W_BACKEND_MUTEX, W_SLAB_DEFAULT);
+    assert(tiers.n_classes() == 2 && tiers.max_buffer_size() == 4096);
+    assert(tiers.pool_for(100) == tiers.class_pool(0));
+    assert(tiers.pool_for(1000) == tiers.class_pool(1));
+    assert(tiers.pool_for(5000) == nullptr);
+    {
+        DataObjectAcquisition<TestObject> small(&tiers, 100, W_FLOW_NONBLOCKING);
+        DataObjectAcquisition<TestObject> medium(&tiers, 1000, W_FLOW_NONBLOCKING);
+        DataObjectAcquisition<TestObject> blob(&tiers, 100000, W_FLOW_NONBLOCKING);
+        assert(small.data->buffer_size == 512);
+        assert(medium.data->buffer_size == 4096);
+        assert(blob.data->buffer_size == 100000);
+        assert(tiers.pool_size() == 2);
+        // Smaller class exhausted: spill into the next one instead of blocking
+        DataObjectAcquisition<TestObject> spill1(&tiers, 10, W_FLOW_NONBLOCKING);
+        DataObjectAcquisition<TestObject> spill2(&tiers, 10, W_FLOW_NONBLOCKING);
+        assert(spill1.data->buffer_size == 512 && spill2.data->buffer_size == 4096);
+        DataObjectAcquisition<TestObject> none(&tiers, 10, W_FLOW_NONBLOCKING);
+        assert(!none.data);
+    }
+    assert(tiers.pool_size() == 4);
+    printf("Tiered OK\n");
+}
+
+void TestMagazines() {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(8, 64, W_BACKEND_LOCKFREE);
+    pool->enable_magazines(4);
+    for (int i = 0; i < 1000; i++) {
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+        assert(a.data);
+    }
+    assert(pool->magazine_hit_rate() > 0.99);
+    assert(pool->pool_size() == 8);
+
+    // Objects cached in this thread's magazine must still reach a blocked thread elsewhere
+    {
+        std::vector<DataObjectAcquisition<TestObject>> held;
+        for (int i = 0; i < 8; i++) held.push_back(DataObjectAcquisition<TestObject>(pool, W_FLOW_NONBLOCKING));
+        std::atomic<int> taken(0);
+        std::thread other([pool, &taken]{
+            std::vector<DataObjectAcquisition<TestObject>> got;
+            for (int i = 0; i < 8; i++) {
+                got.push_back(DataObjectAcquisition<TestObject>(pool, W_FLOW_BLOCKING));
+                if (got.back().data) taken++;
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        held.clear();
+        other.join();
+        assert(taken == 8);
+    }
+    assert(pool->pool_size() == 8);
+    delete pool;
+
+    // Magazine larger than the pool: releases never flush, the waiter is woken by their notify
+    pool = new ObjectPool<TestObject>(2, 64, W_BACKEND_LOCKFREE);
+    pool->enable_magazines(8);
+    {
+        std::atomic<bool> got(false);
+        std::thread other;
+        {
+            DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+            DataObjectAcquisition<TestObject> b(pool, W_FLOW_NONBLOCKING);
+            assert(a.data && b.data);
+            other = std::thread([pool, &got]{
+                DataObjectAcquisition<TestObject> c(pool, W_FLOW_BLOCKING);
+                got = (bool) c.data;
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        other.join();
+        assert(got);
+    }
+    assert(pool->pool_size() == 2);
+    delete pool;
+
+    // Acquired on one thread, released on another (device thread -> sender): the releaser
+    // returns to the shared pool, so the acquirer keeps refilling its own magazine in batches
+    pool = new ObjectPool<TestObject>(64, 64, W_BACKEND_LOCKFREE);
+    pool->enable_magazines(16);
+    {
+        WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 64);
+        const int n = 20000;
+        std::thread releaser([q, n]{
+            for (int i = 0; i < n; i++) {
+                DataObjectAcquisition<TestObject> in(q, W_FLOW_BLOCKING);
+                assert(in.data);
+            }
+        });
+        for (int i = 0; i < n; i++) {
+            DataObjectAcquisition<TestObject> out(pool, W_FLOW_BLOCKING);
+            assert(out.data);
+            out.enqueue(q);
+        }
+        releaser.join();
+        assert(pool->magazine_hit_rate() > 0.8);
+        delete q;
+    }
+    assert(pool->pool_size() == 64);
+    delete pool;
+
+    // A blocked acquirer wakes right when another thread releases, not on a poll
+    pool = new ObjectPool<TestObject>(1, 64, W_BACKEND_LOCKFREE);
+    pool->enable_magazines(4);
+    {
+        WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 4);
+        const int rounds = 21;
+        std::atomic<int64_t> released_at(0);
+        std::thread releaser([q, &released_at]{
+            for (int i = 0; i < rounds; i++) {
+                DataObjectAcquisition<TestObject> in(q, W_FLOW_BLOCKING);
+                assert(in.data);
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                released_at = std::chrono::steady_clock::now().time_since_epoch().count();
+            }
+        });
+        std::vector<int64_t> latencies;
+        for (int i = 0; i < rounds; i++) {
+            DataObjectAcquisition<TestObject> out(pool, W_FLOW_BLOCKING);
+            assert(out.data);
+            if (i > 0) latencies.push_back(std::chrono::steady_clock::now().time_since_epoch().count() - released_at);
+            out.enqueue(q);
+        }
+        releaser.join();
+        std::sort(latencies.begin(), latencies.end());
+        int64_t median_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::duration(latencies[latencies.size() / 2])).count();
+        printf("Magazines: blocked acquire woke %lld us after the release (median)\n", (long long) median_us);
+        assert(median_us < 200);
+        delete q;
+    }
+    assert(pool->pool_size() == 1);
+    delete pool;
+    printf("Magazines OK\n");
+}
+
+void TestOverflow() {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(8, 16, W_BACKEND_LOCKFREE);
+    W_OVERFLOW policies[] = { W_OVERFLOW_DROP_NEWEST, W_OVERFLOW_DROP_OLDEST };
+    for (int i = 0; i < 2; i++) {
+        WorkerQueue<TestObject> q_lockfree(W_BACKEND_LOCKFREE, 8, policies[i], 3);
+        WorkerQueue<TestObject> q_mutex(W_BACKEND_MUTEX, 0, policies[i], 3);
+        WorkerQueue<TestObject> * queues[] = { &q_lockfree, &q_mutex };
+        for (int j = 0; j < 2; j++) {
+            for (size_t n = 0; n < 5; n++) {
+                DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+                a.data->data_end = n;
+                a.enqueue(queues[j]);
+            }
+            assert(queues[j]->queue_size() == 3 && queues[j]->dropped() == 2);
+            assert(pool->pool_size() == 5);
+            {
+                DataObjectAcquisition<TestObject> first(queues[j], W_FLOW_NONBLOCKING);
+                // drop-newest keeps the first three, drop-oldest the last three
+                assert(first.data->data_end == (policies[i] == W_OVERFLOW_DROP_NEWEST ? 0 : 2));
+            }
+            while (queues[j]->queue_size() > 0) DataObjectAcquisition<TestObject> rest(queues[j], W_FLOW_NONBLOCKING);
+            assert(pool->pool_size() == 8);
+        }
+    }
+
+    WorkerQueue<TestObject, SPSC> q_spsc(2, W_OVERFLOW_DROP_NEWEST);
+    for (int n = 0; n < 4; n++) {
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+        a.enqueue(&q_spsc);
+    }
+    assert(q_spsc.queue_size() == 2 && q_spsc.dropped() == 2);
+    bool thrown = false;
+    try { q_spsc.set_overflow(W_OVERFLOW_DROP_OLDEST, 0); } catch (OIError & e) { thrown = true; }
+    assert(thrown);
+    while (q_spsc.queue_size() > 0) DataObjectAcquisition<TestObject> rest(&q_spsc, W_FLOW_NONBLOCKING);
+    assert(pool->pool_size() == 8);
+
+    // Per lane: only lane 0 sheds, lane 1 keeps every object. An evicted object that was
+    // fanned out stays queued in the other queue and returns to the pool after it.
+    WorkerQueue<TestObject> q_send(W_BACKEND_LOCKFREE, 8);
+    WorkerQueue<TestObject> q_write(W_BACKEND_LOCKFREE, 8);
+    q_send.set_lanes(2);
+    q_send.set_lane_overflow(0, W_OVERFLOW_DROP_OLDEST, 1);
+    assert(q_send.lane_overflow(1) == W_OVERFLOW_BLOCK && q_send.lane_limit(1) == 8);
+    for (int n = 0; n < 3; n++) {
+        DataObjectAcquisition<TestObject> bulk(pool, W_FLOW_NONBLOCKING);
+        bulk.data->data_end = n;
+        bulk.enqueue_shared(&q_send);
+        bulk.enqueue_shared(&q_write);
+        DataObjectAcquisition<TestObject> control(pool, W_FLOW_NONBLOCKING);
+        control.enqueue(&q_send, 1);
+    }
+    assert(q_send.lane_size(0) == 1 && q_send.lane_size(1) == 3 && q_send.dropped() == 2);
+    assert(q_write.queue_size() == 3 && pool->pool_size() == 2);
+    while (q_send.queue_size() > 0) DataObjectAcquisition<TestObject> rest(&q_send, W_FLOW_NONBLOCKING);
+    assert(pool->pool_size() == 5);
+    {
+        DataObjectAcquisition<TestObject> first(&q_write, W_FLOW_NONBLOCKING);
+        assert(first.data->data_end == 0);
+    }
+    while (q_write.queue_size() > 0) DataObjectAcquisition<TestObject> rest(&q_write, W_FLOW_NONBLOCKING);
+    assert(pool->pool_size() == 8);
+
+    // Blocking: a producer at the limit waits for a consumer, and gives up when the queue closes
+    WorkerQueue<TestObject> b_lockfree(W_BACKEND_LOCKFREE, 8, W_OVERFLOW_BLOCK, 2);
+    WorkerQueue<TestObject> b_mutex(W_BACKEND_MUTEX, 0, W_OVERFLOW_BLOCK, 2);
+    WorkerQueue<TestObject, SPSC> b_spsc(2);
+    WorkerQueue<TestObject> * blocking[] = { &b_lockfree, &b_mutex, &b_spsc };
+    for (int j = 0; j < 3; j++) {
+        WorkerQueue<TestObject> * q = blocking[j];
+        std::atomic<bool> done(false);
+        auto produce = [pool, q, &done] {
+            {
+                DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+                a.enqueue(q);
+            }
+            done = true;
+        };
+        for (int n = 0; n < 2; n++) produce();
+        done = false;
+        std::thread producer(produce);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        assert(!done && q->queue_size() == 2);
+        {
+            DataObjectAcquisition<TestObject> a(q, W_FLOW_NONBLOCKING);
+            assert(a.data);
+        }
+        producer.join();
+        assert(q->queue_size() == 2 && q->dropped() == 0);
+
+        done = false;
+        std::thread closed(produce);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        assert(!done);
+        q->close();
+        closed.join();
+        assert(q->queue_size() == 2 && q->dropped() == 1);
+        while (q->queue_size() > 0) DataObjectAcquisition<TestObject> rest(q, W_FLOW_NONBLOCKING);
+        assert(pool->pool_size() == 8);
+    }
+    delete pool;
+    printf("Overflow OK\n");
+}
+
+void TestLanes() {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(16, 16, W_BACKEND_LOCKFREE);
+    WorkerQueue<TestObject> q_lockfree(W_BACKEND_LOCKFREE, 16);
+    WorkerQueue<TestObject> q_mutex;
+    WorkerQueue<TestObject> * queues[] = { &q_lockfree, &q_mutex };
+    for (int j = 0; j < 2; j++) {
+        // Strict: the control message overtakes the bulk burst
+        queues[j]->set_lanes(3);
+        for (int n = 0; n < 4; n++) {
+            DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+            a.data->data_end = 0;
+            a.enqueue(queues[j]);
+        }
+        {
+            DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+            a.data->data_end = 2;
+            a.enqueue(queues[j], 2);
+        }
+        assert(queues[j]->lane_size(0) == 4 && queues[j]->lane_size(2) == 1);
+        {
+            DataObjectAcquisition<TestObject> first(queues[j], W_FLOW_NONBLOCKING);
+            assert(first.data->data_end == 2);
+        }
+        while (queues[j]->queue_size() > 0) DataObjectAcquisition<TestObject> rest(queues[j], W_FLOW_NONBLOCKING);
+
+        // Weighted 1:2, lane 1 gets two turns for every turn of lane 0
+        std::vector<uint32_t> weights;
+        weights.push_back(1);
+        weights.push_back(2);
+        queues[j]->set_lanes(weights, W_LANES_WEIGHTED);
+        for (int n = 0; n < 6; n++) {
+            DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+            a.data->data_end = n % 2;
+            a.enqueue(queues[j], (uint8_t) (n % 2));
+        }
+        size_t order[6];
+        for (int n = 0; n < 6; n++) {
+            DataObjectAcquisition<TestObject> a(queues[j], W_FLOW_NONBLOCKING);
+            order[n] = a.data->data_end;
+        }
+        assert(order[0] == 1 && order[1] == 1 && order[2] == 0 && order[3] == 1 && order[4] == 0 && order[5] == 0);
+        assert(pool->pool_size() == 16);
+    }
+    delete pool;
+    printf("Lanes OK\n");
+}
+
+void TestBatch() {
+    ObjectPool<TestObject> * pools[] = {
+        new ObjectPool<TestObject>(8, 16, W_BACKEND_MUTEX),
+        new ObjectPool<TestObject>(8, 16, W_BACKEND_LOCKFREE),
+        new ObjectPool<TestObject>(8, 16, W_BACKEND_LOCKFREE)
+    };
+    pools[2]->enable_magazines(4);
+    WorkerQueue<TestObject> q_mutex;
+    WorkerQueue<TestObject> q_lockfree(W_BACKEND_LOCKFREE, 8);
+    WorkerQueue<TestObject, SPSC> q_spsc(8);
+    WorkerQueue<TestObject> * queues[] = { &q_mutex, &q_lockfree, &q_spsc };
+    for (int j = 0; j < 3; j++) {
+        {
+            DataObjectBatch<TestObject> b(pools[j], 5, W_FLOW_BLOCKING);
+            assert(b.size() == 5 && pools[j]->pool_size() == 3);
+            for (size_t i = 0; i < b.size(); i++) b[i]->data_end = i;
+            b.enqueue(queues[j]);
+        }
+        assert(queues[j]->queue_size() == 5);
+        {
+            DataObjectBatch<TestObject> b(queues[j], 3, W_FLOW_BLOCKING);
+            assert(b.size() == 3 && b[0]->data_end == 0 && b[2]->data_end == 2);
+        }
+        assert(pools[j]->pool_size() == 6);
+        {
+            // Asking for more than is queued returns what is there
+            DataObjectBatch<TestObject> b(queues[j], 8, W_FLOW_NONBLOCKING);
+            assert(b.size() == 2 && b[0]->data_end == 3);
+            DataObjectBatch<TestObject> none(queues[j], 8, W_FLOW_NONBLOCKING);
+            assert(none.empty());
+        }
+        assert(pools[j]->pool_size() == 8);
+        {
+            DataObjectBatch<TestObject> all(pools[j], 10, W_FLOW_NONBLOCKING);
+            assert(all.size() == 8);
+            DataObjectBatch<TestObject> none(pools[j], 1, W_FLOW_NONBLOCKING);
+            assert(none.empty());
+        }
+        assert(pools[j]->pool_size() == 8);
+    }
+
+    // Tiered: fills from the smallest fitting class, then larger ones; oversized requests get blobs
+    TieredObjectPool<TestObject> tiers;
+    tiers.add_class(2, 512, W_BACKEND_MUTEX, W_SLAB_DEFAULT);
+    tiers.add_class(2, 4096, W_BACKEND_LOCKFREE, W_SLAB_DEFAULT);
+    {
+        DataObjectBatch<TestObject> b(&tiers, 100, 3, W_FLOW_NONBLOCKING);
+        assert(b.size() == 3 && b[0]->buffer_size == 512 && b[2]->buffer_size == 4096);
+        DataObjectBatch<TestObject> blobs(&tiers, 10000, 2, W_FLOW_NONBLOCKING);
+        assert(blobs.size() == 2 && blobs[1]->buffer_size == 10000);
+    }
+    assert(tiers.pool_size() == 4);
+    for (int j = 0; j < 3; j++) delete pools[j];
+    printf("Batch OK\n");
+}
+
+void TestStats() {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(4, 16, W_BACKEND_LOCKFREE);
+    WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 4, W_OVERFLOW_DROP_OLDEST, 2);
+    pool->set_name("test.pool");
+    q->set_name("test.queue");
+    assert(q->name() == "test.queue");
+    for (int n = 0; n < 3; n++) {
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+        a.enqueue(q);
+    }
+    {
+        DataObjectAcquisition<TestObject> a(q, W_FLOW_NONBLOCKING);
+        assert(a.data);
+    }
+    WorkerStatsSnapshot qs = q->stats()->snapshot();
+    assert(qs.enqueued == 3 && qs.dequeued == 1 && qs.depth == 1 && qs.max_depth == 2);
+    WorkerStatsSnapshot ps = pool->stats()->snapshot();
+    assert(ps.dequeued == 3 && ps.depth == 3 && ps.min_depth == 1);
+
+    std::vector<WorkerStatsSnapshot> all = WorkerRegistry::snapshot();
+    size_t found = 0;
+    for (size_t i = 0; i < all.size(); i++) {
+        if (all[i].name == "test.pool" || all[i].name == "test.queue") found++;
+    }
+    assert(found == 2);
+    WorkerRegistry::print();
+    delete q;
+    delete pool;
+    assert(WorkerRegistry::snapshot().size() == all.size() - 2);
+    printf("Stats OK\n");
+}
+
+void TestPipeline(Executor * executor) {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(16, 16, W_BACKEND_LOCKFREE);
+    std::atomic<int> generated(0);
+    std::atomic<int> sum(0);
+    {
+        Pipeline<TestObject> p("test");
+        WorkerQueue<TestObject> * raw = p.add_queue("raw", W_BACKEND_LOCKFREE, 16);
+        WorkerQueue<TestObject> * doubled = p.add_queue("doubled", W_BACKEND_MUTEX, 16);
+        // Declared out of order; start() sorts the stages
+        p.add_stage("sum", doubled, 1, [&sum](DataObjectAcquisition<TestObject> & in, PipelineStage<TestObject> &) {
+            sum += (int) in.data->data_end;
+        });
+        p.add_stage("double", raw, 3, [](DataObjectAcquisition<TestObject> & in, PipelineStage<TestObject> & stage) {
+            in.data->data_end *= 2;
+            stage.forward(in);
+        }).to(doubled);
+        p.add_source("gen", 1, [pool, &generated](PipelineStage<TestObject> & stage) {
+            if (generated >= 1000) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                return;
+            }
+            DataObjectAcquisition<TestObject> a(pool, W_FLOW_NONBLOCKING);
+            if (!a.data) {
+                std::this_thread::yield();
+                return;
+            }
+            a.data->data_end = 1;
+            generated++;
+            stage.produced(1);
+            stage.forward(a);
+        }).to(raw);
+        p.start(executor);
+        while (sum < 2000) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        p.stop();
+        assert(p.stage("double").stats().processed == 1000);
+        assert(p.stage("gen").stats().processed == 1000);
+        p.print_stats();
+    }
+    assert(pool->pool_size() == 16);
+    delete pool;
+    printf("Pipeline OK\n");
+}
+
+void TestExecutor() {
+    Executor executor(4);
+    std::atomic<int> done(0);
+    for (int i = 0; i < 1000; i++) {
+        // Tasks submitted from a worker go to its own deque; idle workers steal them
+        executor.submit([&executor, &done]{
+            for (int j = 0; j < 9; j++) executor.submit([&done]{ done++; });
+            done++;
+        });
+    }
+    while (done < 10000) std::this_thread::yield();
+    assert(executor.current_worker() == -1);
+
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(32, 16, W_BACKEND_LOCKFREE);
+    WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 32);
+    std::atomic<int> consumed(0);
+    ExecutorConsumer<TestObject> * consumer = new ExecutorConsumer<TestObject>(&executor, q, 2, 8,
+        [&consumed](DataObjectAcquisition<TestObject> &) { consumed++; });
+    consumer->start();
+    for (int i = 0; i < 1000; i++) {
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+        a.enqueue(q);
+    }
+    while (consumed < 1000) std::this_thread::yield();
+    consumer->stop();
+    assert(consumer->processed() == 1000);
+    delete consumer;
+
+    // A single task consumer never runs two drains at once, even with several producers
+    // racing its scheduling; one task stages feed SPSC queues on this.
+    std::atomic<int> in_drain(0);
+    std::atomic<int> max_in_drain(0);
+    consumed = 0;
+    consumer = new ExecutorConsumer<TestObject>(&executor, q, 1, 4,
+        [&consumed, &in_drain, &max_in_drain](DataObjectAcquisition<TestObject> &) {
+            int n = ++in_drain;
+            if (n > max_in_drain) max_in_drain = n;
+            std::this_thread::yield();
+            in_drain--;
+            consumed++;
+        });
+    consumer->start();
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; t++) {
+        producers.push_back(std::thread([pool, q] {
+            for (int i = 0; i < 500; i++) {
+                DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+                a.enqueue(q);
+            }
+        }));
+    }
+    for (size_t t = 0; t < producers.size(); t++) producers[t].join();
+    while (consumed < 2000) std::this_thread::yield();
+    consumer->stop();
+    assert(max_in_drain == 1);
+    delete consumer;
+    executor.shutdown();
+    assert(executor.executed() >= 10000);
+    assert(pool->pool_size() == 32);
+    delete q;
+    delete pool;
+    printf("Executor OK\n");
+}
+
+void TestEventCount() {
+    // Single object bounced between two threads through blocking acquire/dequeue,
+    // so every step sleeps; a lost wakeup would hang here.
+    W_BACKEND backends[] = { W_BACKEND_MUTEX, W_BACKEND_LOCKFREE };
+    for (int b = 0; b < 2; b++) {
+        ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(1, 16, backends[b]);
+        WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(backends[b], 1);
+        const int n = 20000;
+        std::thread consumer([q, n]{
+            for (int i = 0; i < n; i++) {
+                DataObjectAcquisition<TestObject> a(q, W_FLOW_BLOCKING);
+                assert(a.data);
+            }
+        });
+        for (int i = 0; i < n; i++) {
+            DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+            assert(a.data);
+            a.enqueue(q);
+        }
+        consumer.join();
+
+        // close() releases a consumer that is asleep on an empty queue
+        std::thread waiter([q]{
+            DataObjectAcquisition<TestObject> a(q, W_FLOW_BLOCKING);
+            assert(!a.data);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        q->close();
+        waiter.join();
+        assert(pool->pool_size() == 1);
+        delete q;
+        delete pool;
+    }
+    printf("EventCount OK\n");
+}
+
+void TestTimed() {
+    W_BACKEND backends[] = { W_BACKEND_MUTEX, W_BACKEND_LOCKFREE };
+    for (int b = 0; b < 2; b++) {
+        ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(1, 16, backends[b]);
+        WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(backends[b], 1);
+
+        // Nothing queued: gives up once the timeout has passed
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        {
+            DataObjectAcquisition<TestObject> a(q, std::chrono::milliseconds(20));
+            assert(!a.data);
+        }
+        assert(std::chrono::steady_clock::now() - t0 >= std::chrono::milliseconds(20));
+
+        // Returns as soon as an object arrives, long before the deadline
+        std::thread producer([pool, q]{
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+            a.enqueue(q);
+        });
+        t0 = std::chrono::steady_clock::now();
+        {
+            DataObjectAcquisition<TestObject> a(q, t0 + std::chrono::seconds(10));
+            assert(a.data);
+            assert(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5));
+
+            // The only object is taken: the pool times out as well, and a past deadline does not block
+            DataObjectAcquisition<TestObject> b(pool, std::chrono::milliseconds(5));
+            assert(!b.data);
+            DataObjectAcquisition<TestObject> c(pool, std::chrono::steady_clock::now() - std::chrono::seconds(1));
+            assert(!c.data);
+        }
+        producer.join();
+        assert(pool->pool_size() == 1);
+        delete q;
+        delete pool;
+    }
+    printf("Timed OK\n");
+}
+
+void TestSelect() {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(8, 16, W_BACKEND_LOCKFREE);
+    WorkerQueue<TestObject> * qa = new WorkerQueue<TestObject>(W_BACKEND_MUTEX, 8);
+    WorkerQueue<TestObject> * qb = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 8);
+    QueueSelector<TestObject> * selector = new QueueSelector<TestObject>();
+    size_t ia = selector->add(qa);
+    size_t ib = selector->add(qb);
+    assert(ia == 0 && ib == 1);
+
+    // Nothing queued: times out
+    int ready = selector->wait_for(std::chrono::milliseconds(10));
+    assert(ready == -1);
+
+    // Wakes up for whichever queue gets an object
+    std::thread producer([pool, qb]{
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+        a.enqueue(qb);
+    });
+    ready = selector->wait();
+    assert(ready == 1);
+    producer.join();
+    {
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+        a.enqueue(qa);
+    }
+    // Both ready: takes turns
+    int first = selector->wait();
+    int second = selector->wait();
+    assert(first != second);
+    for (int i = 0; i < 2; i++) {
+        DataObjectAcquisition<TestObject> a(selector->queue(selector->wait()), W_FLOW_NONBLOCKING);
+        assert(a.data);
+    }
+    ready = selector->wait_for(std::chrono::milliseconds(1));
+    assert(ready == -1);
+
+    // notify_all releases a waiter without data
+    std::thread waiter([selector]{
+        int woken = selector->wait();
+        assert(woken == -1);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    selector->notify_all();
+    waiter.join();
+
+    delete selector;
+    assert(qa->listener() == nullptr);
+    assert(pool->pool_size() == 8);
+    delete qa;
+    delete qb;
+    delete pool;
+    printf("Select OK\n");
+}
+
+void TestTimer() {
+    // 1us ticks, so the delays below cross several wheel levels
+    TimerWheel * wheel = new TimerWheel(std::chrono::microseconds(1));
+    std::mutex m;
+    std::vector<int> order;
+    std::atomic<int> early(0);
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    int delays_ms[] = { 20, 1, 5 };
+    for (int i = 0; i < 3; i++) {
+        std::chrono::steady_clock::time_point when = t0 + std::chrono::milliseconds(delays_ms[i]);
+        wheel->schedule_at(when, [&m, &order, &early, when, i]{
+            if (std::chrono::steady_clock::now() < when) early++;
+            std::unique_lock<std::mutex> lk(m);
+            order.push_back(i);
+        });
+    }
+    TimerWheel::TimerId cancelled = wheel->schedule(std::chrono::milliseconds(10), [&early]{ early += 1000; });
+    bool was_pending = wheel->cancel(cancelled);
+    bool again = wheel->cancel(cancelled);
+    assert(was_pending && !again);
+
+    std::atomic<int> ticks(0);
+    TimerWheel::TimerId periodic = wheel->schedule_every(std::chrono::milliseconds(2), [&ticks]{ ticks++; });
+
+    // Many timers with random deadlines, half of them cancelled
+    const int n = 2000;
+    std::atomic<int> fired(0);
+    std::vector<TimerWheel::TimerId> ids;
+    for (int i = 0; i < n; i++) {
+        std::chrono::steady_clock::time_point when = std::chrono::steady_clock::now() + std::chrono::microseconds(rand() % 50000);
+        ids.push_back(wheel->schedule_at(when, [&fired, &early, when]{
+            if (std::chrono::steady_clock::now() < when) early++;
+            fired++;
+        }));
+    }
+    int n_cancelled = 0;
+    for (int i = 0; i < n; i += 2) {
+        if (wheel->cancel(ids[i])) n_cancelled++;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    was_pending = wheel->cancel(periodic);
+    assert(was_pending);
+    int ticks_after_cancel = ticks;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(ticks == ticks_after_cancel);
+    assert(ticks >= 10);
+    assert(early == 0);
+    assert(fired == n - n_cancelled);
+    assert(order.size() == 3 && order[0] == 1 && order[1] == 2 && order[2] == 0);
+    assert(wheel->pending() == 0);
+    delete wheel;
+    printf("Timer OK\n");
+}
+
+void TestWaitStrategy() {
+    W_WAIT waits[] = { W_WAIT_BLOCK, W_WAIT_SPIN, W_WAIT_POLL };
+    for (int w = 0; w < 3; w++) {
+        ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(1, 16, W_BACKEND_LOCKFREE);
+        WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 1);
+        q->set_wait_strategy(waits[w]);
+        assert(q->wait_strategy() == waits[w]);
+        const int n = 2000;
+        std::thread consumer([q, n]{
+            for (int i = 0; i < n; i++) {
+                DataObjectAcquisition<TestObject> a(q, W_FLOW_BLOCKING);
+                assert(a.data);
+            }
+            // Deadlines and close() also end a busy-polling wait
+            DataObjectAcquisition<TestObject> timed(q, std::chrono::milliseconds(5));
+            assert(!timed.data);
+            DataObjectAcquisition<TestObject> closed(q, W_FLOW_BLOCKING);
+            assert(!closed.data);
+        });
+        for (int i = 0; i < n; i++) {
+            DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+            a.enqueue(q);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        q->close();
+        consumer.join();
+        assert(pool->pool_size() == 1);
+        delete q;
+        delete pool;
+    }
+    printf("Wait strategy OK\n");
+}
+
+void TestThreads() {
+    Threads::configure_cpus("oi.test=0;oi.test.x=0-1,3");
+    Threads::configure_priorities("oi.test.x=10");
+    ThreadConfig c = Threads::config("oi.test.worker");
+    assert(c.cpus.size() == 1 && c.cpus[0] == 0 && c.priority == 0);
+    // Longest prefix wins
+    c = Threads::config("oi.test.x.1");
+    assert(c.cpus.size() == 3 && c.cpus[2] == 3 && c.priority == 10);
+    assert(Threads::config("oi.other").cpus.empty());
+    bool threw = false;
+    try { Threads::configure_cpus("oi.test=a"); } catch (OIError &) { threw = true; }
+    assert(threw);
+
+    std::string name;
+    std::vector<int> cpus;
+    std::thread * t = Threads::spawn("oi.test.a_long_thread_name", [&name, &cpus]{
+        name = Threads::name();
+        cpus = Threads::affinity();
+    });
+    t->join();
+    delete t;
+#ifdef __linux__
+    assert(name == std::string("oi.test.a_long_thread_name").substr(0, W_THREAD_NAME_MAX));
+    assert(cpus.size() == 1 && cpus[0] == 0);
+#endif
+    printf("Threads OK\n");
+}
+
+void TestShared() {
+#ifdef __linux__
+    std::string name = "/oi.core.test." + std::to_string(getpid());
+    // Two mappings of one segment, as a capture and a streaming process would have
+    SharedObjectPool * producer = new SharedObjectPool(name, 4, 256, 2, W_SLAB_PREFAULT);
+    SharedObjectPool * consumer = new SharedObjectPool(name);
+    assert(producer->owner() && !consumer->owner());
+    assert(consumer->pool_capacity() == 4 && consumer->buffer_size() == 256 && consumer->n_queues() == 2);
+    assert(consumer->pool_size() == 4);
+
+    const int n = 5000;
+    std::thread reader([consumer, n]{
+        for (int i = 0; i < n; i++) {
+            SharedAcquisition a(consumer->queue(0), W_FLOW_BLOCKING);
+            assert(a.data);
+            int v;
+            memcpy(&v, a.data + a.slot->data_start, sizeof(v));
+            assert(v == i && a.slot->tag == 7);
+        }
+        // Closed in the other mapping
+        SharedAcquisition closed(consumer->queue(0), W_FLOW_BLOCKING);
+        assert(!closed.data);
+    });
+    for (int i = 0; i < n; i++) {
+        SharedAcquisition a(producer, W_FLOW_BLOCKING);
+        assert(a.data);
+        memcpy(a.data, &i, sizeof(i));
+        a.slot->data_start = 0;
+        a.slot->data_end = sizeof(i);
+        a.slot->tag = 7;
+        a.enqueue(producer->queue(0));
+        assert(!a.data);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    producer->queue(0)->close();
+    reader.join();
+    assert(producer->pool_size() == 4);
+
+    // Timeouts, and the segment outliving its creator's name
+    SharedAcquisition timed(consumer->queue(1), W_FLOW_BLOCKING, std::chrono::steady_clock::now() + std::chrono::milliseconds(5));
+    assert(!timed.data);
+    delete producer;
+    {
+        SharedAcquisition a(consumer, W_FLOW_NONBLOCKING);
+        assert(a.data);
+    }
+    bool threw = false;
+    try { SharedObjectPool gone(name); } catch (OIError &) { threw = true; }
+    assert(threw);
+    delete consumer;
+    printf("Shared OK\n");
+#endif
+}
+
+void TestHeadroom() {
+    ObjectPool<TestObject> pool(2, 128, W_BACKEND_LOCKFREE);
+    pool.set_headroom(32, 8);
+    assert(pool.payload_capacity() == 88);
+    {
+        DataObjectAcquisition<TestObject> a(&pool, W_FLOW_BLOCKING);
+        assert(a.data->headroom() == 32 && a.data->payload_size() == 0);
+        assert(a.data->payload_capacity() == 88);
+        memcpy(a.data->put(4), "body", 4);
+        uint8_t * h = a.data->push_header(2);
+        h[0] = 'h';
+        h[1] = ':';
+        assert(a.data->data_start == 30 && a.data->payload_size() == 6);
+        assert(memcmp(a.data->payload(), "h:body", 6) == 0);
+        // The payload stays where it was written
+        assert(a.data->buffer + 32 == h + 2);
+        assert(a.data->pull_header(2) == h && a.data->payload_size() == 4);
+        bool threw = false;
+        try { a.data->put(85); } catch (OIError &) { threw = true; }
+        assert(threw);
+        a.data->push_trailer(8);
+        assert(a.data->tailroom() == 84);
+        threw = false;
+        try { a.data->push_header(33); } catch (OIError &) { threw = true; }
+        assert(threw);
+        // Setting headroom needs every object back in the pool
+        threw = false;
+        try { pool.set_headroom(16); } catch (OIError &) { threw = true; }
+        assert(threw && pool.pool_size() == 1);
+    }
+    {
+        DataObjectAcquisition<TestObject> a(&pool, W_FLOW_BLOCKING);
+        DataObjectAcquisition<TestObject> b(&pool, W_FLOW_BLOCKING);
+        assert(a.data->data_start == 32 && a.data->data_end == 32);
+        assert(b.data->data_start == 32 && b.data->data_end == 32);
+    }
+
+    // Tiered pools pick classes by payload capacity, large blobs get the same headroom
+    TieredObjectPool<TestObject> tiers;
+    tiers.add_class(2, 64, W_BACKEND_LOCKFREE, W_SLAB_DEFAULT);
+    tiers.set_headroom(16);
+    tiers.add_class(2, 256, W_BACKEND_LOCKFREE, W_SLAB_DEFAULT);
+    assert(tiers.class_pool(1)->headroom() == 16);
+    assert(tiers.pool_for(48) == tiers.class_pool(0));
+    assert(tiers.pool_for(49) == tiers.class_pool(1));
+    {
+        DataObjectAcquisition<TestObject> blob(&tiers, 1000, W_FLOW_BLOCKING);
+        assert(blob.data->headroom() == 16 && blob.data->payload_capacity() >= 1000);
+        blob.data->put(1000);
+        blob.data->push_header(16);
+    }
+    printf("Headroom OK\n");
+}
+
+void TestSegments() {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(1, 64, W_BACKEND_LOCKFREE);
+    pool->set_headroom(16);
+    WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 1);
+    static const char body[] = "payload living elsewhere";
+    std::atomic<int> released(0);
+    {
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+        a.data->add_segment((const uint8_t *) body, 7, [&released] { released++; });
+        a.data->add_segment((const uint8_t *) body + 7, 17, [&released] { released++; });
+        memcpy(a.data->push_header(3), "hd:", 3);
+        assert(a.data->n_segments() == 2 && a.data->message_size() == 27);
+        a.enqueue(q);
+    }
+    // Queued objects keep their segments
+    assert(released == 0);
+    {
+        DataObjectAcquisition<TestObject> a(q, W_FLOW_BLOCKING);
+        uint8_t out[64];
+        assert(a.data->gather(out, 26) == 0);
+        assert(a.data->gather(out, sizeof(out)) == 27);
+        assert(memcmp(out, "hd:payload living elsewhere", 27) == 0);
+    }
+    // Released when the object went back to the pool
+    assert(released == 2);
+    {
+        DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING);
+        assert(a.data->n_segments() == 0 && a.data->message_size() == 0);
+        for (size_t i = 0; i < W_MAX_SEGMENTS; i++) a.data->add_segment((const uint8_t *) body, 1, nullptr);
+        bool threw = false;
+        try { a.data->add_segment((const uint8_t *) body, 1, [&released] { released++; }); } catch (OIError &) { threw = true; }
+        assert(threw && released == 3);
+    }
+    delete q;
+    delete pool;
+    printf("Segments OK\n");
+}
+
+void TestClock() {
+    // Monotonic and in step with steady_clock
+    uint64_t prev = Clock::now_ns();
+    for (int i = 0; i < 100000; i++) {
+        uint64_t t = Clock::now_ns();
+        assert(t >= prev);
+        prev = t;
+    }
+    uint64_t c0 = Clock::now_ns();
+    std::chrono::steady_clock::time_point s0 = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t elapsed = Clock::now_ns() - c0;
+    assert(elapsed >= 20000000 && elapsed < 5000000000ull);
+    assert(std::chrono::steady_clock::now() - s0 >= std::chrono::nanoseconds(elapsed - 1000000));
+
+    // The wall mapping lands within a few ms of the system clock and round trips
+    int64_t sys = (int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    assert(std::llabs(Clock::wall_ns() - sys) < 50000000);
+    uint64_t m = Clock::now_ns();
+    assert(Clock::from_wall_ns(Clock::to_wall_ns(m)) == m);
+    assert(std::llabs((WALL() - WALL(NOW())).count()) <= 1);
+
+    // TSC only where it is invariant, and it keeps the clock monotonic across the switch
+    uint64_t before = Clock::now_ns();
+    bool tsc = Clock::set_source(W_CLOCK_TSC);
+    assert(tsc == Clock::tsc_invariant());
+    assert(Clock::source() == (tsc ? W_CLOCK_TSC : W_CLOCK_MONOTONIC));
+    assert(Clock::now_ns() + 1000000 >= before);
+    assert(std::llabs(Clock::wall_ns() - sys) < 100000000);
+    Clock::set_source(W_CLOCK_MONOTONIC);
+    assert(Clock::source() == W_CLOCK_MONOTONIC);
+    printf("Clock OK (tsc %s)\n", tsc ? "yes" : "no");
+}
+
+void TestTrace() {
+    // Every value lands in a bucket whose bound is at most 1/8 above it
+    for (uint64_t v = 1; v < (1ull << 40); v = v * 3 + 1) {
+        size_t b = LatencyHistogram::bucket(v);
+        assert(b < W_HIST_BUCKETS);
+        assert(LatencyHistogram::bucket_max(b) >= v);
+        assert(LatencyHistogram::bucket_max(b) - v <= v / W_HIST_SUB);
+        if (b > 0) assert(LatencyHistogram::bucket_max(b - 1) < v);
+    }
+    assert(LatencyHistogram::bucket(UINT64_MAX) == W_HIST_BUCKETS - 1);
+
+    LatencyHistogram h;
+    assert(h.percentile(50) == 0);
+    for (uint64_t i = 1; i <= 1000; i++) h.record(i * 1000);
+    assert(h.count() == 1000 && h.max() == 1000000);
+    assert(h.percentile(50) >= 500000 && h.percentile(50) <= 500000 + 500000 / 8);
+    assert(h.percentile(99) >= 990000 && h.percentile(100) == 1000000);
+    assert(h.mean() > 500000 && h.mean() < 501000);
+
+    uint16_t a = Tracer::stage("test.a");
+    uint16_t b = Tracer::stage("test.b");
+    assert(a != 0 && b != 0 && a != b && Tracer::stage("test.a") == a);
+    assert(Tracer::stage_name(b) == "test.b");
+    TraceStamp stamps[3] = { { a, 0, 0, false, 1000 }, { b, 0, 0, false, 3000 }, { a, 0, 0, false, 2500 } };
+    // Objects of the tests before are collected too when built with OI_TRACE
+    Tracer::clear();
+    Tracer::collect(stamps, 3);
+    assert(Tracer::histogram(b)->count() == 1 && Tracer::histogram(b)->max() == 2000);
+    // Out of order stamps count as 0
+    assert(Tracer::histogram(a)->count() == 1 && Tracer::histogram(a)->max() == 0);
+    assert(Tracer::histogram(0)->max() == 1500);
+
+#ifdef OI_TRACE
+    Tracer::clear();
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(2, 64, W_BACKEND_LOCKFREE);
+    WorkerQueue<TestObject> * q = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 2);
+    q->set_name("test.trace");
+    {
+        DataObjectAcquisition<TestObject> doa(pool, W_FLOW_BLOCKING);
+        OI_TRACE_STAMP_AT(doa.data, "test.capture", Clock::now_ns() - 1000000);
+        doa.enqueue(q);
+    }
+    {
+        DataObjectAcquisition<TestObject> doa(q, W_FLOW_BLOCKING);
+        assert(doa.data->n_trace() == 3);
+        assert(Tracer::stage_name(doa.data->trace_stamp(1).stage) == "test.trace.enq");
+        assert(Tracer::stage_name(doa.data->trace_stamp(2).stage) == "test.trace.wait");
+        for (size_t i = 0; i < W_TRACE_MAX_STAMPS; i++) OI_TRACE_STAMP(doa.data, "test.sent");
+        assert(doa.data->n_trace() == W_TRACE_MAX_STAMPS);
+    }
+    // Collected when the object went back to the pool
+    assert(Tracer::histogram(Tracer::stage("test.trace.enq"))->count() == 1);
+    assert(Tracer::histogram(Tracer::stage("test.trace.wait"))->count() == 1);
+    assert(Tracer::histogram(Tracer::stage("test.sent"))->count() == W_TRACE_MAX_STAMPS - 3);
+    assert(Tracer::histogram(0)->count() == 1 && Tracer::histogram(0)->max() >= 1000000);
+
+    // Fanned out: the sender branch is stamped while the writer still holds the object
+    Tracer::clear();
+    WorkerQueue<TestObject> * q_send = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 2);
+    WorkerQueue<TestObject> * q_write = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 2);
+    q_send->set_name("test.fan.send");
+    q_write->set_name("test.fan.write");
+    {
+        DataObjectAcquisition<TestObject> doa(pool, W_FLOW_BLOCKING);
+        OI_TRACE_STAMP(doa.data, "test.fan.capture");
+        doa.enqueue_shared(q_send);
+        doa.enqueue_shared(q_write);
+    }
+    {
+        DataObjectAcquisition<TestObject> doa(q_send, W_FLOW_BLOCKING);
+        assert(doa.data->shared());
+        OI_TRACE_STAMP(doa.data, "test.fan.sent");
+    }
+    {
+        DataObjectAcquisition<TestObject> doa(q_write, W_FLOW_BLOCKING);
+        assert(doa.data->n_trace() == 6);
+    }
+    assert(Tracer::histogram(Tracer::stage("test.fan.send.enq"))->count() == 1);
+    assert(Tracer::histogram(Tracer::stage("test.fan.send.wait"))->count() == 1);
+    assert(Tracer::histogram(Tracer::stage("test.fan.sent"))->count() == 1);
+    assert(Tracer::histogram(Tracer::stage("test.fan.write.wait"))->count() == 1);
+    assert(Tracer::histogram(0)->count() == 1);
+    delete q_send;
+    delete q_write;
+    delete q;
+    delete pool;
+#endif
+    Tracer::print();
+    printf("Trace OK\n");
+}
+
+void TestSpans() {
+    SpanRing * ring = Spans::ring();
+    assert(Spans::ring() == ring);
+    ring->clear();
+    std::vector<SpanRing::Span> spans;
+    { OI_TRACE_SPAN("test.off"); }
+    ring->read(spans);
+    assert(spans.empty());
+
+    // Inner spans end (and are stored) first and lie inside their parent
+    Spans::enable();
+    {
+        ScopedSpan outer("test.outer");
+        outer.arg(42);
+        { OI_TRACE_SPAN("test.inner"); }
+    }
+    ring->read(spans);
+    assert(spans.size() == 2);
+    assert(strcmp(spans[0].name, "test.inner") == 0 && strcmp(spans[1].name, "test.outer") == 0);
+    assert(spans[1].start_ns <= spans[0].start_ns && spans[0].end_ns <= spans[1].end_ns);
+    assert(spans[1].arg == 42);
+
+    // Sampling keeps or drops whole trees
+    ring->clear();
+    Spans::enable(4);
+    for (int i = 0; i < 8; i++) {
+        OI_TRACE_SPAN("test.root");
+        OI_TRACE_SPAN("test.child");
+    }
+    spans.clear();
+    ring->read(spans);
+    assert(spans.size() == 4);
+
+    // Once wrapped, the slot the writer goes to next is left out
+    ring->clear();
+    for (size_t i = 0; i < W_SPAN_RING_SIZE + 10; i++) ring->push("test.wrap", i, i + 1, i);
+    spans.clear();
+    ring->read(spans);
+    assert(spans.size() == W_SPAN_RING_SIZE - 1 && spans.back().arg == W_SPAN_RING_SIZE + 9);
+
+    // Reading while another thread writes never returns torn spans
+    std::atomic<bool> writing(true);
+    SpanRing * other = nullptr;
+    std::atomic<bool> ready(false);
+    std::thread writer([&] {
+        other = Spans::ring();
+        ready = true;
+        for (uint64_t i = 0; writing; i++) other->push("test.race", i, i + 1, i);
+    });
+    while (!ready) std::this_thread::yield();
+    for (int r = 0; r < 50; r++) {
+        spans.clear();
+        other->read(spans);
+        for (size_t i = 0; i < spans.size(); i++) {
+            assert(spans[i].end_ns == spans[i].start_ns + 1 && spans[i].arg == spans[i].start_ns);
+            if (i > 0) assert(spans[i].arg == spans[i - 1].arg + 1);
+        }
+    }
+    writing = false;
+    writer.join();
+
+    Spans::enable();
+    { OI_TRACE_SPAN("test \"quoted\""); }
+    std::string path = "/tmp/oi.core.test.trace.json";
+    bool written = Spans::write(path);
+    assert(written);
+    FILE * f = fopen(path.c_str(), "r");
+    assert(f);
+    std::string json;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) json.append(buf, n);
+    fclose(f);
+    remove(path.c_str());
+    assert(json.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0);
+    assert(json.find("\"thread_name\"") != std::string::npos);
+    assert(json.find("\"test \\\"quoted\\\"\",\"cat\":\"oi\",\"ph\":\"X\"") != std::string::npos);
+    assert(json.compare(json.size() - 3, 3, "]}\n") == 0);
+    Spans::disable();
+    Spans::clear();
+    printf("Spans OK\n");
+}
+
+static const CensusEntry * FindOwner(const PoolCensus & c, const std::string & owner) {
+    for (size_t i = 0; i < c.owners.size(); i++) {
+        if (c.owners[i].owner == owner) return &c.owners[i];
+    }
+    return nullptr;
+}
+
+void TestCensus() {
+    ObjectPool<TestObject> * pool = new ObjectPool<TestObject>(6, 64, W_BACKEND_LOCKFREE);
+    pool->set_name("test.census");
+    WorkerQueue<TestObject> * named = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 6);
+    named->set_name("test.census.q");
+    WorkerQueue<TestObject> * unnamed = new WorkerQueue<TestObject>(W_BACKEND_LOCKFREE, 6);
+    {
+        DataObjectAcquisition<TestObject> out(pool, W_FLOW_BLOCKING);
+        bool threw = false;
+        try { pool->enable_census(); } catch (OIError &) { threw = true; }
+        assert(threw && !pool->census_enabled());
+        // Without census owner tags are left alone
+        out.data->set_owner(Census::owner("test.app"));
+        assert(out.data->owner() == W_OWNER_UNTAGGED);
+    }
+    pool->enable_census();
+    assert(pool->census_enabled() && pool->census().free == 6);
+
+    std::mutex m;
+    std::condition_variable cv;
+    bool holding = false;
+    bool done = false;
+    std::thread * holder = Threads::spawn("test.holder", [&] {
+        DataObjectAcquisition<TestObject> doa(pool, W_FLOW_BLOCKING);
+        std::unique_lock<std::mutex> lk(m);
+        holding = true;
+        cv.notify_all();
+        cv.wait(lk, [&] { return done; });
+    });
+    {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [&] { return holding; });
+    }
+    std::unique_ptr<DataObjectAcquisition<TestObject>> mine(new DataObjectAcquisition<TestObject>(pool, W_FLOW_BLOCKING));
+    { DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING); a.enqueue(named); }
+    { DataObjectAcquisition<TestObject> a(pool, W_FLOW_BLOCKING); a.enqueue(unnamed); }
+    std::unique_ptr<DataObjectAcquisition<TestObject>> app(new DataObjectAcquisition<TestObject>(pool, W_FLOW_BLOCKING));
+    app->data->set_owner(Census::owner("test.app"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+    PoolCensus c = pool->census();
+    assert(c.pool == "test.census" && c.capacity == 6 && c.free == 1);
+    std::string self = Census::owner_name(Census::thread_owner());
+    assert(FindOwner(c, "test.holder") && FindOwner(c, "test.holder")->count == 1);
+    assert(FindOwner(c, "test.census.q") && FindOwner(c, "test.census.q")->count == 1);
+    assert(FindOwner(c, "queue") && FindOwner(c, "queue")->count == 1);
+    assert(FindOwner(c, "test.app") && FindOwner(c, "test.app")->count == 1);
+    assert(FindOwner(c, self) && FindOwner(c, self)->count == 1);
+    assert(FindOwner(c, "test.holder")->oldest_ns >= 5000000);
+    assert(FindOwner(c, "test.app")->mean_age_ns >= 5000000);
+
+    // Dequeuing hands the object to the consumer thread, returning frees it
+    {
+        DataObjectAcquisition<TestObject> a(named, W_FLOW_BLOCKING);
+        c = pool->census();
+        assert(FindOwner(c, "test.census.q") == nullptr && FindOwner(c, self)->count == 2);
+    }
+    {
+        std::unique_lock<std::mutex> lk(m);
+        done = true;
+        cv.notify_all();
+    }
+    holder->join();
+    delete holder;
+    { DataObjectAcquisition<TestObject> a(unnamed, W_FLOW_BLOCKING); }
+    c = pool->census();
+    assert(c.free == 4 && c.owners.size() == 2);
+
+    bool listed = false;
+    std::vector<PoolCensus> all = Census::take();
+    for (size_t i = 0; i < all.size(); i++) listed = listed || all[i].pool == "test.census";
+    assert(listed);
+    Census::print();
+    mine.reset();
+    app.reset();
+    assert(pool->census().free == 6);
+
+    // Classes added after enable_census are tracked too
+    TieredObjectPool<TestObject> tiered;
+    tiered.enable_census();
+    tiered.add_class(2, 32, W_BACKEND_LOCKFREE, W_SLAB_DEFAULT);
+    assert(tiered.class_pool(0)->census_enabled());
+
+    delete unnamed;
+    delete named;
+    delete pool;
+    listed = false;
+    all = Census::take();
+    for (size_t i = 0; i < all.size(); i++) listed = listed || all[i].pool == "test.census";
+    assert(!listed);
+    printf("Census OK\n");
+}
+
 int main(int argc, char* argv[]) {
-    OICoreTest test("HI");
+    OICoreTest test("HI", W_BACKEND_MUTEX, false);
+    OICoreTest test_lockfree("HI", W_BACKEND_LOCKFREE, false);
+    OICoreTest test_spsc("HI", W_BACKEND_LOCKFREE, true);
+    TestFanOut();
+    TestSlab();
+    TestTiered();
+    TestMagazines();
+    TestOverflow();
+    TestLanes();
+    TestBatch();
+    TestStats();
+    TestPipeline(nullptr);
+    TestExecutor();
+    TestEventCount();
+    TestTimed();
+    TestSelect();
+    TestTimer();
+    TestWaitStrategy();
+    TestThreads();
+    TestShared();
+    TestHeadroom();
+    TestSegments();
+    TestClock();
+    TestTrace();
+    TestSpans();
+    TestCensus();
+    {
+        Executor executor(2);
+        TestPipeline(&executor);
+    }
 }
@@ -0,0 +1,209 @@
+/*
+This file is part of the OpenIMPRESS project.
+
+OpenIMPRESS is free software: you can redistribute it and/or modify
+it under the terms of the Lesser GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+OpenIMPRESS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "OICore.hpp"
+
+using namespace oi::core;
+using namespace oi::core::worker;
+
+// Measures the pool -> queue -> pool round trip that every packet takes,
+// with P producers and P consumers, for each backend with and without per-thread
+// magazines (and the SPSC queue with 1/1). Every 16th object also reports its
+// enqueue -> dequeue latency, so blocking stalls show up in the p99/max columns.
+// A second table paces a single producer so the consumer is idle before every object,
+// and shows the wake-to-process latency of each queue wait strategy.
+
+class BenchObject : public DataObject {
+public:
+    BenchObject(size_t buffer_size, ObjectPool<BenchObject> * _pool) :
+        DataObject(buffer_size, (ObjectPool<DataObject>*) _pool) {}
+};
+
+class WorkerBench {
+public:
+    ObjectPool<BenchObject> * pool;
+    WorkerQueue<BenchObject> * queue;
+    std::atomic<bool> producing;
+    std::atomic<bool> consuming;
+    std::atomic<int> producers_alive;
+    std::atomic<int> consumers_alive;
+    std::atomic<uint64_t> produced;
+    std::atomic<uint64_t> consumed;
+    std::mutex m_latency;
+    std::vector<uint64_t> latency_ns;
+
+    void Producer() {
+        uint64_t n = 0;
+        while (producing) {
+            DataObjectAcquisition<BenchObject> doa(pool, W_FLOW_BLOCKING);
+            if (!doa.data) continue;
+            uint64_t t = WorkerStats::now_ns();
+            memcpy(doa.data->buffer, &t, sizeof(t));
+            doa.data->data_end = sizeof(t);
+            doa.enqueue(queue);
+            n++;
+        }
+        produced += n;
+        producers_alive--;
+    }
+
+    void Consumer() {
+        uint64_t n = 0;
+        std::vector<uint64_t> samples;
+        while (consuming) {
+            DataObjectAcquisition<BenchObject> doa(queue, W_FLOW_BLOCKING);
+            if (!doa.data) continue;
+            if (n++ % 16 == 0) {
+                uint64_t t;
+                memcpy(&t, doa.data->buffer, sizeof(t));
+                samples.push_back(WorkerStats::now_ns() - t);
+            }
+        }
+        consumed += n;
+        std::unique_lock<std::mutex> lk(m_latency);
+        latency_ns.insert(latency_ns.end(), samples.begin(), samples.end());
+        consumers_alive--;
+    }
+
+    double hit_rate;
+    double p50_us;
+    double p99_us;
+    double max_us;
+
+    void Percentiles() {
+        p50_us = 0;
+        p99_us = 0;
+        max_us = 0;
+        if (latency_ns.empty()) return;
+        std::sort(latency_ns.begin(), latency_ns.end());
+        p50_us = latency_ns[latency_ns.size() / 2] / 1000.0;
+        p99_us = latency_ns[latency_ns.size() * 99 / 100] / 1000.0;
+        max_us = latency_ns.back() / 1000.0;
+    }
+
+    // One object every interval; the consumer waits with the given strategy in between
+    void WakeLatency(W_WAIT wait, int samples, std::chrono::microseconds interval) {
+        pool = new ObjectPool<BenchObject>(16, 64, W_BACKEND_LOCKFREE);
+        queue = new WorkerQueue<BenchObject>(W_BACKEND_LOCKFREE, pool->pool_capacity());
+        queue->set_wait_strategy(wait);
+        latency_ns.clear();
+        std::thread consumer([this, samples]{
+            for (int i = 0; i < samples; i++) {
+                DataObjectAcquisition<BenchObject> doa(queue, W_FLOW_BLOCKING);
+                uint64_t t;
+                memcpy(&t, doa.data->buffer, sizeof(t));
+                latency_ns.push_back(WorkerStats::now_ns() - t);
+            }
+        });
+        for (int i = 0; i < samples; i++) {
+            std::this_thread::sleep_for(interval);
+            DataObjectAcquisition<BenchObject> doa(pool, W_FLOW_BLOCKING);
+            uint64_t t = WorkerStats::now_ns();
+            memcpy(doa.data->buffer, &t, sizeof(t));
+            doa.data->data_end = sizeof(t);
+            doa.enqueue(queue);
+        }
+        consumer.join();
+        Percentiles();
+        delete queue;
+        delete pool;
+    }
+
+    double Run(W_BACKEND backend, bool spsc, bool magazines, int n_threads, std::chrono::milliseconds duration) {
+        pool = new ObjectPool<BenchObject>(1024, 64, backend);
+        if (magazines) pool->enable_magazines(32);
+        if (spsc) queue = new WorkerQueue<BenchObject, SPSC>(pool->pool_capacity());
+        else queue = new WorkerQueue<BenchObject>(backend, pool->pool_capacity());
+        producing = true;
+        consuming = true;
+        producers_alive = n_threads;
+        consumers_alive = n_threads;
+        produced = 0;
+        consumed = 0;
+
+        std::vector<std::thread *> threads;
+        std::chrono::microseconds t0 = NOWu();
+        for (int i = 0; i < n_threads; i++) {
+            threads.push_back(new std::thread(&WorkerBench::Producer, this));
+            threads.push_back(new std::thread(&WorkerBench::Consumer, this));
+        }
+
+        std::this_thread::sleep_for(duration);
+        producing = false;
+        consuming = false;
+        std::chrono::microseconds t1 = NOWu();
+
+        // Keep waking both sides until every thread has noticed the stop flag
+        while (producers_alive > 0 || consumers_alive > 0) {
+            queue->notify_all();
+            pool->notify_all();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i]->join();
+            delete threads[i];
+        }
+
+        double seconds = (t1 - t0).count() / 1000000.0;
+        hit_rate = pool->magazine_hit_rate();
+        Percentiles();
+        delete queue;
+        delete pool;
+        return consumed / seconds;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    int duration_ms = 1000;
+    if (argc > 1) duration_ms = std::atoi(argv[1]);
+
+    const char * names[] = { "mutex", "lockfree" };
+    W_BACKEND backends[] = { W_BACKEND_MUTEX, W_BACKEND_LOCKFREE };
+    int thread_counts[] = { 1, 2, 4, 8 };
+
+    printf("%-10s %-10s %10s %16s %10s %10s %10s\n", "backend", "magazines", "P/C", "ops/sec", "hit rate", "p99 us", "max us");
+    for (int m = 0; m < 2; m++) {
+        for (int b = 0; b < 2; b++) {
+            for (int t = 0; t < 4; t++) {
+                WorkerBench bench;
+                double ops = bench.Run(backends[b], false, m == 1, thread_counts[t], std::chrono::milliseconds(duration_ms));
+                printf("%-10s %-10s %6d/%-3d %16.0f %9.1f%% %10.1f %10.1f\n", names[b], m == 1 ? "yes" : "no",
+                       thread_counts[t], thread_counts[t], ops, bench.hit_rate * 100, bench.p99_us, bench.max_us);
+            }
+        }
+    }
+    WorkerBench bench;
+    double ops = bench.Run(W_BACKEND_LOCKFREE, true, false, 1, std::chrono::milliseconds(duration_ms));
+    printf("%-10s %-10s %6d/%-3d %16.0f %10s %10.1f %10.1f\n", "spsc", "no", 1, 1, ops, "", bench.p99_us, bench.max_us);
+
+    const char * wait_names[] = { "block", "spin", "poll" };
+    W_WAIT waits[] = { W_WAIT_BLOCK, W_WAIT_SPIN, W_WAIT_POLL };
+    printf("\n%-10s %10s %10s %10s\n", "wait", "p50 us", "p99 us", "max us");
+    for (int w = 0; w < 3; w++) {
+        WorkerBench wake;
+        wake.WakeLatency(waits[w], std::max(duration_ms * 2, 100), std::chrono::microseconds(200));
+        printf("%-10s %10.1f %10.1f %10.1f\n", wait_names[w], wake.p50_us, wake.p99_us, wake.max_us);
+    }
+    return 0;
+}
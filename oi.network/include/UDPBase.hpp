@@ -24,10 +24,32 @@ along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
 #include <iostream>
 #include <cstdlib>
 #include <map>
+#include <functional>
+#include <vector>
+#include <memory>
 #include <OIWorker.hpp>
+#include <OIThread.hpp>
+#include <OISpan.hpp>
 
 namespace oi { namespace core { namespace network {
     
+    // Priority lanes of the send queue; DataSender always services higher lanes first
+    const uint8_t UDP_LANE_BULK     = 0; // RGBD frame data
+    const uint8_t UDP_LANE_STREAM   = 1; // audio and body frames
+    const uint8_t UDP_LANE_CONTROL  = 2; // config, punches, heartbeats, matchmaking
+    const size_t  UDP_LANES         = 3;
+    
+    // Room kept in front of every send buffer of a connector, for the message header and
+    // the transport headers pushed in front of a payload (see DataObject::push_header)
+    const size_t  UDP_HEADROOM      = 64;
+    
+    // Bodies from this size on are chained as segments instead of copied into the send
+    // buffer; below it the copy is cheaper than keeping the body alive
+    const size_t  UDP_GATHER_MIN    = 1024;
+    
+    // Messages DataSender takes off the send queue per wakeup; bounds how long a
+    // control message that arrives meanwhile waits behind already taken frame data
+    const size_t  UDP_SEND_BATCH    = 16;
     
     class UDPMessageObject : public worker::DataObject {
     public:
@@ -37,6 +59,8 @@ namespace oi { namespace core { namespace network {
         bool default_endpoint = true;
         bool all_endpoints = false;
         void reset();
+        // Payload and segments as one buffer sequence, sent with a single sendmsg
+        void buffers(std::vector<asio::const_buffer> & out);
     };
     
     class UDPBase {
@@ -54,10 +78,14 @@ namespace oi { namespace core { namespace network {
         
         /// Init Sender with separate pool
         int InitSender(worker::ObjectPool<UDPMessageObject> * send_pool);
+        /// Init Sender with size classes; messages take the smallest buffer that fits
+        int InitSender(worker::TieredObjectPool<UDPMessageObject> * send_pools);
         int InitSender(size_t send_buffer_size, size_t recv_pool_size);
         
         /// Starts listening
         int InitReceiver(worker::ObjectPool<UDPMessageObject> * recv_pool);
+        /// Starts listening, sizing each receive buffer to the pending datagram
+        int InitReceiver(worker::TieredObjectPool<UDPMessageObject> * recv_pools);
         int InitReceiver(size_t recv_buffer_size, size_t recv_pool_size);
         
         /// Stop listening, deallocate resources.
@@ -77,8 +105,13 @@ namespace oi { namespace core { namespace network {
         virtual int Send(std::string data);
         virtual int Send(std::string data, asio::ip::udp::endpoint endpoint);
         virtual int Send(uint8_t * data, size_t len, asio::ip::udp::endpoint endpoint);
+        virtual int Send(uint8_t * data, size_t len, asio::ip::udp::endpoint endpoint, uint8_t lane);
+        // Sends data without copying it; data must stay valid until release is called
+        virtual int Send(const uint8_t * data, size_t len, asio::ip::udp::endpoint endpoint, uint8_t lane,
+                         std::function<void()> release);
         
 		worker::ObjectPool<UDPMessageObject>* send_pool();
+		worker::TieredObjectPool<UDPMessageObject>* send_pools();
 
 		worker::WorkerQueue<UDPMessageObject> * send_queue();
         //worker::WorkerQueue<UDPMessageObject> * queue_send(uint16_t msgType);
@@ -112,6 +145,11 @@ namespace oi { namespace core { namespace network {
         worker::ObjectPool<UDPMessageObject>  * _receive_pool;
         worker::WorkerQueue<UDPMessageObject> * _queue_send;
         worker::ObjectPool<UDPMessageObject>  * _send_pool;
+        worker::TieredObjectPool<UDPMessageObject> * _receive_pools;
+        worker::TieredObjectPool<UDPMessageObject> * _send_pools;
+        // Size classes wrapped around plain pools, or created for the sized Init* calls
+        std::unique_ptr<worker::TieredObjectPool<UDPMessageObject>> _owned_receive_pools;
+        std::unique_ptr<worker::TieredObjectPool<UDPMessageObject>> _owned_send_pools;
     };
     
 } } }
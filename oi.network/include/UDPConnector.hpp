@@ -19,6 +19,7 @@ along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
 #include "json.hpp"
 #include "UDPBase.hpp"
 #include "OIHeaders.hpp"
+#include "OITimer.hpp"
 
 namespace oi { namespace core { namespace network {
     
@@ -30,6 +31,7 @@ namespace oi { namespace core { namespace network {
         std::chrono::milliseconds lastSentHB;
         bool useHearbeat;
         bool connected;
+        worker::TimerWheel::TimerId heartbeat_timer;
         // list packet types this client is subscribed to?
     };
     
@@ -39,8 +41,11 @@ namespace oi { namespace core { namespace network {
         UDPConnector(std::string sendHost, int sendPort, int listenPort, asio::io_service& io_service);
         
         
+        // Sends and receives through obj_pools and reserves UDP_HEADROOM in their buffers, so
+        // pass pools that are not in use yet (and size them for payload + UDP_HEADROOM)
         int InitConnector(std::string sid, std::string guid, oi::core::OI_CLIENT_ROLE role, bool useMM);
         int InitConnector(std::string sid, std::string guid, oi::core::OI_CLIENT_ROLE role, bool useMM, worker::ObjectPool<UDPMessageObject> * obj_pool);
+        int InitConnector(std::string sid, std::string guid, oi::core::OI_CLIENT_ROLE role, bool useMM, worker::TieredObjectPool<UDPMessageObject> * obj_pools);
         
         
         int AddEndpoint(std::string host, std::string port);
@@ -64,10 +69,14 @@ namespace oi { namespace core { namespace network {
         
         // Communication with matchmaking server
         void Update();
-        void Register();
-        void Punch(UDPEndpoint * udpep);
-        int MMSend(std::string json_str);
-        int MMSend(std::string json_str, asio::ip::udp::endpoint);
+        void Register(worker::W_FLOW f = worker::W_FLOW_BLOCKING);
+        // Call without _m_endpoints held
+        void Punch(asio::ip::udp::endpoint ep, worker::W_FLOW f);
+        // Timer callbacks on the shared timer wheel
+        void Heartbeat(UDPEndpoint * udpep);
+        void RegisterTimeout();
+        int MMSend(std::string json_str, worker::W_FLOW f = worker::W_FLOW_BLOCKING);
+        int MMSend(std::string json_str, asio::ip::udp::endpoint, worker::W_FLOW f = worker::W_FLOW_BLOCKING);
         
         int DataSender();
         
@@ -76,6 +85,7 @@ namespace oi { namespace core { namespace network {
         std::chrono::milliseconds connectionTimeout;
         std::chrono::milliseconds mm_lastRegister;
         std::chrono::milliseconds mm_registerInterval;
+        worker::TimerWheel::TimerId _register_timer;
         
         std::string localIP;
         std::string socketID;
@@ -86,7 +96,9 @@ namespace oi { namespace core { namespace network {
         
         bool _useMM;
         
-        worker::ObjectPool<UDPMessageObject> * _mm_buffer_pool;
+        worker::TieredObjectPool<UDPMessageObject> * _mm_buffer_pools;
+        // Pools InitConnector created itself (default pools, or size classes around obj_pool)
+        std::unique_ptr<worker::TieredObjectPool<UDPMessageObject>> _owned_mm_buffer_pools;
         worker::WorkerQueue<UDPMessageObject> * _mm_receive_queue;
         
         //asio::ip::udp::endpoint _mm_endpoint;
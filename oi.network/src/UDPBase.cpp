@@ -28,12 +28,19 @@ namespace oi { namespace core { namespace network {
     UDPMessageObject::~UDPMessageObject() {};
     
     void UDPMessageObject::reset() {
-        data_end = 0;
-        data_start = 0;
+        DataObject::reset();
         default_endpoint = true;
         all_endpoints = false;
     }
     
+    void UDPMessageObject::buffers(std::vector<asio::const_buffer> & out) {
+        out.clear();
+        out.push_back(asio::buffer(&buffer[data_start], data_end - data_start));
+        for (size_t i = 0; i < n_segments(); i++) {
+            out.push_back(asio::buffer(segment(i).data, segment(i).size));
+        }
+    }
+    
     UDPBase::UDPBase(int listenPort, int sendPort, std::string sendHost, asio::io_service & io_service)
     : _io_service(io_service), _socket(io_service, udp::endpoint(udp::v4(), listenPort)), _resolver(io_service) {
         this->_send_port = sendPort;
@@ -57,38 +64,61 @@ namespace oi { namespace core { namespace network {
         return InitSender(shared_pool) && InitReceiver(shared_pool);
     }
     
+    // Pools created here are owned by (and freed with) this UDPBase; pools passed in stay the caller's
     int UDPBase::Init(size_t shared_pool_size, size_t shared_buffer_size) {
-        worker::ObjectPool<UDPMessageObject> * shared_pool = new worker::ObjectPool<UDPMessageObject>(shared_pool_size, shared_buffer_size);
-        return Init(shared_pool);
+        if (_sender_initialized || _receiver_initialized) return -1;
+        _owned_send_pools.reset(new worker::TieredObjectPool<UDPMessageObject>());
+        _owned_send_pools->add_class(shared_pool_size, shared_buffer_size, worker::W_BACKEND_MUTEX, worker::W_SLAB_DEFAULT);
+        return InitSender(_owned_send_pools.get()) && InitReceiver(_owned_send_pools.get());
     }
     
     int UDPBase::InitSender(size_t send_buffer_size, size_t send_pool_size) {
-        worker::ObjectPool<UDPMessageObject> * send_pool = new worker::ObjectPool<UDPMessageObject>(send_buffer_size, send_pool_size);
-        return InitSender(send_pool);
+        if (_sender_initialized) return -1;
+        _owned_send_pools.reset(new worker::TieredObjectPool<UDPMessageObject>());
+        _owned_send_pools->add_class(send_buffer_size, send_pool_size, worker::W_BACKEND_MUTEX, worker::W_SLAB_DEFAULT);
+        return InitSender(_owned_send_pools.get());
     }
     
     int UDPBase::InitReceiver(size_t recv_buffer_size, size_t recv_pool_size) {
-        worker::ObjectPool<UDPMessageObject> * recv_pool = new worker::ObjectPool<UDPMessageObject>(recv_buffer_size, recv_pool_size);
-        return InitReceiver(recv_pool);
-        
+        if (_receiver_initialized) return -1;
+        _owned_receive_pools.reset(new worker::TieredObjectPool<UDPMessageObject>());
+        _owned_receive_pools->add_class(recv_buffer_size, recv_pool_size, worker::W_BACKEND_MUTEX, worker::W_SLAB_DEFAULT);
+        return InitReceiver(_owned_receive_pools.get());
     }
     
     int UDPBase::InitSender(worker::ObjectPool<UDPMessageObject> * send_pool) {
         if (_sender_initialized) return -1;
+        _owned_send_pools.reset(new worker::TieredObjectPool<UDPMessageObject>());
+        _owned_send_pools->add_class(send_pool);
+        return InitSender(_owned_send_pools.get());
+    }
+    
+    int UDPBase::InitSender(worker::TieredObjectPool<UDPMessageObject> * send_pools) {
+        if (_sender_initialized) return -1;
         
-        _send_pool = send_pool;
-        _queue_send = new worker::WorkerQueue<UDPMessageObject>();
-        _send_thread = new std::thread(&UDPBase::DataSender, this);
+        _send_pools = send_pools;
+        _send_pool = send_pools->class_pool(send_pools->n_classes()-1);
+        _queue_send = new worker::WorkerQueue<UDPMessageObject>(_send_pool->backend(), _send_pool->pool_capacity());
+        _queue_send->set_lanes(UDP_LANES);
+        _send_thread = worker::Threads::spawn("oi.udp.send", [this] { DataSender(); });
         _sender_initialized = true; // Todo wait/check if sender really starts in thread?
         return 1;
     }
     
     int UDPBase::InitReceiver(worker::ObjectPool<UDPMessageObject> * recv_pool) {
         if (_receiver_initialized) return -1;
+        _owned_receive_pools.reset(new worker::TieredObjectPool<UDPMessageObject>());
+        _owned_receive_pools->add_class(recv_pool);
+        return InitReceiver(_owned_receive_pools.get());
+    }
+    
+    int UDPBase::InitReceiver(worker::TieredObjectPool<UDPMessageObject> * recv_pools) {
+        if (_receiver_initialized) return -1;
         
-        _receive_pool = recv_pool;
+        _receive_pools = recv_pools;
+        _receive_pool = recv_pools->class_pool(recv_pools->n_classes()-1);
         _queue_receive = new worker::WorkerQueue<UDPMessageObject>();
-        _listen_thread = new std::thread(&UDPBase::DataListener, this);
+        _listen_thread = worker::Threads::spawn("oi.udp.recv", [this] { DataListener(); });
         _receiver_initialized = true; // Todo wait/check if receiver really starts in thread?
         return 1;
     }
@@ -124,6 +154,10 @@ namespace oi { namespace core { namespace network {
 	worker::ObjectPool<UDPMessageObject> * UDPBase::send_pool() {
 		return _send_pool;
 	}
+
+	worker::TieredObjectPool<UDPMessageObject> * UDPBase::send_pools() {
+		return _send_pools;
+	}
     
     worker::WorkerQueue<UDPMessageObject> * UDPBase::send_queue() {
         return _queue_send;
@@ -147,8 +181,12 @@ namespace oi { namespace core { namespace network {
         return *resolver.resolve(query);
     }
     
-    // Add message to outgoing queue by copying the buffer
     int UDPBase::Send(uint8_t * data, size_t length, asio::ip::udp::endpoint endpoint) {
+        return Send(data, length, endpoint, UDP_LANE_BULK);
+    }
+    
+    // Add message to outgoing queue by copying the buffer
+    int UDPBase::Send(uint8_t * data, size_t length, asio::ip::udp::endpoint endpoint, uint8_t lane) {
         //uint16_t data_type = data[0] | (data[1] << 8);
         //worker::WorkerQueue<UDPMessageObject> * q = queue_send(data_type);
         //if (q == NULL) return -1;
@@ -164,15 +202,13 @@ namespace oi { namespace core { namespace network {
             if (_queue_map.count(key) == 1) p = _queue_map[key];
         }*/
         
-        worker::DataObjectAcquisition<UDPMessageObject> doa_s(_send_pool, worker::W_FLOW_BLOCKING);
+        worker::DataObjectAcquisition<UDPMessageObject> doa_s(_send_pools, length, worker::W_FLOW_BLOCKING);
         if (!doa_s.data) return -1;
         
-        memcpy((uint8_t *) &(doa_s.data->buffer[0]), data, length);
-        doa_s.data->data_start = 0;
-        doa_s.data->data_end = length;
+        memcpy(doa_s.data->put(length), data, length);
         doa_s.data->endpoint = endpoint;
         doa_s.data->default_endpoint = false;
-        doa_s.enqueue(_queue_send); // Allways queue to send queue!
+        doa_s.enqueue(_queue_send, lane); // Allways queue to send queue!
         return length;
     }
     
@@ -185,30 +221,53 @@ namespace oi { namespace core { namespace network {
     }
     
     int UDPBase::Send(std::string data, asio::ip::udp::endpoint endpoint) {
-        return Send((uint8_t *) data.c_str(), data.length(), endpoint);
+        if (data.length() < UDP_GATHER_MIN) return Send((uint8_t *) data.c_str(), data.length(), endpoint);
+        // The queued message keeps the string alive until it was sent
+        std::shared_ptr<std::string> body = std::make_shared<std::string>(std::move(data));
+        return Send((const uint8_t *) body->c_str(), body->length(), endpoint, UDP_LANE_BULK, [body] {});
+    }
+    
+    int UDPBase::Send(const uint8_t * data, size_t length, asio::ip::udp::endpoint endpoint, uint8_t lane,
+                      std::function<void()> release) {
+        worker::DataObjectAcquisition<UDPMessageObject> doa_s(_send_pools, 0, worker::W_FLOW_BLOCKING);
+        if (!doa_s.data) {
+            if (release) release();
+            return -1;
+        }
+        doa_s.data->add_segment(data, length, std::move(release));
+        doa_s.data->endpoint = endpoint;
+        doa_s.data->default_endpoint = false;
+        doa_s.enqueue(_queue_send, lane);
+        return length;
     }
     
     int UDPBase::DataSender() {
         _running = true;
+        std::vector<asio::const_buffer> gather;
         while (_running) {
-            // Send data from our queue
-            worker::DataObjectAcquisition<UDPMessageObject> doa_s(_queue_send, worker::W_FLOW_BLOCKING);
-            if (!_running || !doa_s.data) continue;
+            // Send everything that is ready, up to UDP_SEND_BATCH messages per wakeup
+            worker::DataObjectBatch<UDPMessageObject> batch_s(_queue_send, UDP_SEND_BATCH, worker::W_FLOW_BLOCKING);
+            if (!_running || batch_s.empty()) continue;
+            worker::ScopedSpan span("udp.send");
+            span.arg(batch_s.size());
             
-            asio::error_code ec;
-            asio::socket_base::message_flags mf = 0;
-            try {
-                // TODO: should we start from buffer[..data_start] ?
-                if (doa_s.data->default_endpoint) doa_s.data->endpoint = _endpoint;
-                size_t data_len = doa_s.data->data_end-doa_s.data->data_start;
-                //printf("Unqueued OUT (%ld bytes): %s:%d (Default? %n)\n",
-                //       data_len, doa_s.data->endpoint.address().to_string().c_str(), doa_s.data->endpoint.port(), doa_s.data->default_endpoint);
-                _socket.send_to(asio::buffer(&(doa_s.data->buffer[doa_s.data->data_start]), data_len),
-                                doa_s.data->endpoint, mf, ec);
-            } catch (std::exception& e) {
-                std::cerr << "Exception while sending (Code " << ec << "): " << e.what() << std::endl;
-                _running = false;
-                return -1;
+            for (size_t i = 0; i < batch_s.size(); i++) {
+                UDPMessageObject * msg = batch_s[i];
+                msg->buffers(gather);
+                asio::error_code ec;
+                asio::socket_base::message_flags mf = 0;
+                try {
+                    // TODO: should we start from buffer[..data_start] ?
+                    if (msg->default_endpoint) msg->endpoint = _endpoint;
+                    //printf("Unqueued OUT (%ld bytes): %s:%d (Default? %n)\n",
+                    //       msg->message_size(), msg->endpoint.address().to_string().c_str(), msg->endpoint.port(), msg->default_endpoint);
+                    _socket.send_to(gather, msg->endpoint, mf, ec);
+                    OI_TRACE_STAMP(msg, "udp.sent");
+                } catch (std::exception& e) {
+                    std::cerr << "Exception while sending (Code " << ec << "): " << e.what() << std::endl;
+                    _running = false;
+                    return -1;
+                }
             }
         }
         
@@ -253,12 +312,26 @@ namespace oi { namespace core { namespace network {
                 }
 				*/
                 
+                // Wait for the next datagram, so its size picks the buffer class
+                _socket.wait(udp::socket::wait_read, ec);
+                if (!_running) break;
+                if (ec) {
+                    printf("Error waiting for data %s\n", ec.message().c_str());
+                    continue;
+                }
+                OI_TRACE_SPAN("udp.recv");
+                // Linux reports the size of the next datagram; other platforms may report
+                // all pending bytes, so never ask for more than the largest class.
+                size_t pending = _socket.available(ec);
+                if (ec || pending > _receive_pools->max_buffer_size()) pending = _receive_pools->max_buffer_size();
+                
                 // will throw exception on timeout
-                worker::DataObjectAcquisition<UDPMessageObject> doa_r(_receive_pool, worker::W_FLOW_BLOCKING);
+                worker::DataObjectAcquisition<UDPMessageObject> doa_r(_receive_pools, pending, worker::W_FLOW_BLOCKING);
 				doa_r.release(); // by default, release data back to pool...
 
 				worker::WorkerQueue<UDPMessageObject> * return_queue = _queue_receive;
                 if (!_running) break;
+                if (!doa_r.data) continue;
                 
                 size_t len = _socket.receive_from(asio::buffer(doa_r.data->buffer, doa_r.data->buffer_size), recv_endpoint, mf, ec);
                 if (!_running) {
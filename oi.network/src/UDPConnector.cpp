@@ -30,6 +30,7 @@ namespace oi { namespace core { namespace network {
     
     UDPEndpoint::UDPEndpoint(asio::ip::udp::endpoint ep) {
         endpoint = ep;
+        heartbeat_timer = 0;
     }
     
     UDPConnector::UDPConnector(std::string sendHost, int sendPort, asio::io_service& io_service) :
@@ -39,26 +40,45 @@ namespace oi { namespace core { namespace network {
     UDPBase(listenPort, sendPort, sendHost, io_service) {}
     
     int UDPConnector::InitConnector(std::string sid, std::string guid, OI_CLIENT_ROLE role, bool useMM) {
-        return InitConnector(sid, guid, role, useMM, new worker::ObjectPool<UDPMessageObject>(64, 4096));
+        if (_sender_initialized) return -1;
+        _owned_mm_buffer_pools.reset(new worker::TieredObjectPool<UDPMessageObject>());
+        _owned_mm_buffer_pools->add_class(64, worker::W_TIER_SMALL, worker::W_BACKEND_MUTEX, worker::W_SLAB_DEFAULT);
+        _owned_mm_buffer_pools->add_class(16, worker::W_TIER_MEDIUM, worker::W_BACKEND_MUTEX, worker::W_SLAB_DEFAULT);
+        return InitConnector(sid, guid, role, useMM, _owned_mm_buffer_pools.get());
     }
     
+    // Punches, heartbeats and commands get their own small buffer class,
+    // so they never wait for (or hold) buffers of obj_pool.
     int UDPConnector::InitConnector(std::string sid, std::string guid, OI_CLIENT_ROLE role, bool useMM, worker::ObjectPool<UDPMessageObject> * obj_pool) {
+        if (_sender_initialized) return -1;
+        _owned_mm_buffer_pools.reset(new worker::TieredObjectPool<UDPMessageObject>());
+        _owned_mm_buffer_pools->add_class(64, worker::W_TIER_SMALL, obj_pool->backend(), worker::W_SLAB_DEFAULT);
+        _owned_mm_buffer_pools->add_class(obj_pool);
+        return InitConnector(sid, guid, role, useMM, _owned_mm_buffer_pools.get());
+    }
+    
+    int UDPConnector::InitConnector(std::string sid, std::string guid, OI_CLIENT_ROLE role, bool useMM, worker::TieredObjectPool<UDPMessageObject> * obj_pools) {
+        if (_sender_initialized) return -1;
+        // Message headers are pushed in front of the payloads sent from these pools
+        if (obj_pools->headroom() < UDP_HEADROOM) obj_pools->set_headroom(UDP_HEADROOM);
         this->socketID = sid;
         this->guid = guid;
         this->role = role;
         this->_useMM = useMM;
         
-        _mm_buffer_pool = obj_pool;
+        _mm_buffer_pools = obj_pools;
         
         //if (useMM) {
             _mm_receive_queue = new worker::WorkerQueue<UDPMessageObject>();
             localIP = get_local_ip();
-            UDPBase::InitReceiver(_mm_buffer_pool);
+            UDPBase::InitReceiver(_mm_buffer_pools);
             
             // Manually initialize sender with UDPConnector implementation
-            _send_pool = _mm_buffer_pool;
-            _queue_send = new worker::WorkerQueue<UDPMessageObject>();
-            _send_thread = new std::thread(&UDPConnector::DataSender, this);
+            _send_pools = _mm_buffer_pools;
+            _send_pool = _send_pools->class_pool(_send_pools->n_classes()-1);
+            _queue_send = new worker::WorkerQueue<UDPMessageObject>(_send_pool->backend(), _send_pools->pool_capacity());
+            _queue_send->set_lanes(UDP_LANES);
+            _send_thread = worker::Threads::spawn("oi.udp.send", [this] { DataSender(); });
             _sender_initialized = true;
             
             UDPBase::RegisterQueue((uint8_t) oi::core::OI_LEGACY_MSG_FAMILY_MM, _mm_receive_queue, worker::Q_IO_IN);
@@ -74,7 +94,12 @@ namespace oi { namespace core { namespace network {
         mm_lastRegister = (milliseconds)0;
         _connected = false;
         
-        update_thread = new std::thread(&UDPConnector::Update, this);
+        _register_timer = 0;
+        if (_useMM) {
+            Register();
+            _register_timer = worker::TimerWheel::shared()->schedule_every(mm_registerInterval, [this] { RegisterTimeout(); });
+        }
+        update_thread = worker::Threads::spawn("oi.udp.update", [this] { Update(); });
         
         return 1;
     }
@@ -93,55 +118,37 @@ namespace oi { namespace core { namespace network {
     }
     
     int UDPConnector::AddEndpoint(asio::ip::udp::endpoint ep) {
-        std::unique_lock<std::mutex> lk(_m_endpoints);
         int res = 0;
-        std::pair<std::string, uint16_t> epkey = std::make_pair(ep.address().to_string(), (uint16_t) ep.port());
-        if (endpoints.count(epkey) < 1) {
-            endpoints[epkey] = new UDPEndpoint(ep);
-			printf("Endpoint: %s:%d\n",
-				ep.address().to_string().c_str(), ep.port());
-            res = 1;
-        } else {
-            endpoints[epkey]->endpoint = ep;
+        {
+            std::unique_lock<std::mutex> lk(_m_endpoints);
+            std::pair<std::string, uint16_t> epkey = std::make_pair(ep.address().to_string(), (uint16_t) ep.port());
+            if (endpoints.count(epkey) < 1) {
+                UDPEndpoint * udpep = new UDPEndpoint(ep);
+                endpoints[epkey] = udpep;
+                udpep->heartbeat_timer = worker::TimerWheel::shared()->schedule_every(HBInterval, [this, udpep] { Heartbeat(udpep); });
+				printf("Endpoint: %s:%d\n",
+					ep.address().to_string().c_str(), ep.port());
+                res = 1;
+            } else {
+                endpoints[epkey]->endpoint = ep;
+            }
+            endpoints[epkey]->lastSentHB = NOW();
         }
         
-        Punch(endpoints[epkey]);
-        Punch(endpoints[epkey]);
+        // Not under _m_endpoints: DataSender needs it to send (and so free) buffers we may wait for
+        Punch(ep, worker::W_FLOW_BLOCKING);
+        Punch(ep, worker::W_FLOW_BLOCKING);
         return res;
     }
     
     
-    // This thread (re-)establishes connection, seends heartbeats, etc.
+    // Re-registering and heartbeats run on timers (RegisterTimeout, Heartbeat),
+    // this thread handles the messages from the matchmaking server and endpoints.
     void UDPConnector::Update() {
         _running = true;
         while (_running) {
-            milliseconds currentTime = oi::core::NOW();
-            
-            // SEND REGISTER
-            if (_useMM && !_connected && currentTime>mm_lastRegister + mm_registerInterval) {
-                Register();
-                mm_lastRegister = currentTime;
-            }
-            
-            // for each cliend handle heartbeat...
-            {
-                std::unique_lock<std::mutex> lk(_m_endpoints);
-                map<std::pair<std::string, uint16_t>, UDPEndpoint *>::iterator ep_it;
-                for (ep_it = endpoints.begin(); ep_it != endpoints.end(); ep_it++) {
-                    if (ep_it->second->connected && currentTime > ep_it->second->lastReceivedHB + connectionTimeout) {
-                        ep_it->second->connected = false;
-                    }
-                    
-                    // ep_it->second->connected &&
-                    if (currentTime > ep_it->second->lastSentHB + HBInterval) {
-                        ep_it->second->lastSentHB = currentTime;
-                        Punch(ep_it->second);
-                    }
-                }
-            }
-            
             { // Handle incomming messages
-                worker::DataObjectAcquisition<UDPMessageObject> mmdata(_mm_receive_queue, oi::core::worker::W_FLOW_NONBLOCKING);
+                worker::DataObjectAcquisition<UDPMessageObject> mmdata(_mm_receive_queue, worker::W_FLOW_BLOCKING);
                 if (!mmdata.data) continue;
                 uint8_t magicByte = mmdata.data->buffer[0];
                 if (magicByte == OI_LEGACY_MSG_FAMILY_MM) {
@@ -250,26 +257,45 @@ namespace oi { namespace core { namespace network {
     }
     
     void UDPConnector::Close() {
+        // Timer callbacks take _m_endpoints, so cancel (and wait for them) without holding it
+        std::vector<worker::TimerWheel::TimerId> timers;
+        timers.push_back(_register_timer);
+        {
+            std::unique_lock<std::mutex> lk(_m_endpoints);
+            map<std::pair<std::string, uint16_t>, UDPEndpoint *>::iterator ep_it;
+            for (ep_it = endpoints.begin(); ep_it != endpoints.end(); ep_it++) timers.push_back(ep_it->second->heartbeat_timer);
+        }
+        for (size_t i = 0; i < timers.size(); i++) {
+            if (timers[i] != 0) worker::TimerWheel::shared()->cancel(timers[i]);
+        }
         UDPBase::Close();
+        // Wakes Update() if it is waiting for a message
+        _mm_receive_queue->close();
         update_thread->join();
     }
     
     int UDPConnector::OISendString(uint8_t msg_family, uint8_t msg_type, std::string msg, OI_MESSAGE_FORMAT oimf, asio::ip::udp::endpoint ep) {
-        worker::DataObjectAcquisition<UDPMessageObject> data_send(send_pool(), oi::core::worker::W_FLOW_BLOCKING);
+        size_t body_length = msg.length();
+        bool chain = body_length >= UDP_GATHER_MIN;
+        worker::DataObjectAcquisition<UDPMessageObject> data_send(send_pools(), chain ? 0 : body_length, oi::core::worker::W_FLOW_BLOCKING);
         if (!data_send.data) return -1;
-        OIHeaderHelper oih = oi::core::OIHeaderHelper::OIHeaderHelper::InitMsgHeader(&(data_send.data->buffer[0]), false);
+        if (chain) {
+            // Large bodies stay in the string, the message keeps it alive until it was sent
+            std::shared_ptr<std::string> body = std::make_shared<std::string>(std::move(msg));
+            data_send.data->add_segment((const uint8_t *) body->c_str(), body_length, [body] {});
+        } else {
+            memcpy(data_send.data->put(body_length), msg.c_str(), body_length);
+        }
+        OIHeaderHelper oih = oi::core::OIHeaderHelper::OIHeaderHelper::InitMsgHeader(data_send.data->push_header(sizeof(OI_MSG_HEADER)), false);
         oih.oi_msg_header->msg_family = msg_family;
         oih.oi_msg_header->msg_type = msg_type;
         oih.oi_msg_header->msg_format = oimf;
         oih.oi_msg_header->msg_sequence = next_sequence_id();
-        oih.oi_msg_header->body_length = msg.length();
-        oih.oi_msg_header->send_time = NOW().count();
-        memcpy(oih.data, msg.c_str(), oih.oi_msg_header->body_length);
-        data_send.data->data_start = 0;
-        data_send.data->data_end = oih.oi_msg_header->body_start + oih.oi_msg_header->body_length;
+        oih.oi_msg_header->body_length = body_length;
+        oih.oi_msg_header->send_time = WALL().count();
         data_send.data->endpoint = ep;
         data_send.data->default_endpoint = false;
-        data_send.enqueue(send_queue());
+        data_send.enqueue(send_queue(), UDP_LANE_CONTROL);
         return 1;
     }
     
@@ -278,26 +304,24 @@ namespace oi { namespace core { namespace network {
     }
     
     
-    int UDPConnector::MMSend(std::string json_str) {
-        return MMSend(json_str, _endpoint);
+    int UDPConnector::MMSend(std::string json_str, worker::W_FLOW f) {
+        return MMSend(json_str, _endpoint, f);
     }
     
-    int UDPConnector::MMSend(std::string json_str, asio::ip::udp::endpoint ep) {
+    int UDPConnector::MMSend(std::string json_str, asio::ip::udp::endpoint ep, worker::W_FLOW f) {
         //if (!_useMM) { printf("ERROR sending MM message: not using matchmaking.\n"); return -1; }
-        worker::DataObjectAcquisition<UDPMessageObject> data_send(send_pool(), oi::core::worker::W_FLOW_BLOCKING);
+        worker::DataObjectAcquisition<UDPMessageObject> data_send(send_pools(), json_str.length(), f);
         if (!data_send.data)  { printf("ERROR sending MM message: no free buffer.\n"); return -1; }
-        data_send.data->buffer[0] = OI_LEGACY_MSG_FAMILY_MM;
-        memcpy(&(data_send.data->buffer[1]), json_str.c_str(), json_str.length());
-        data_send.data->data_start = 0;
-        data_send.data->data_end = json_str.length()+1;
+        memcpy(data_send.data->put(json_str.length()), json_str.c_str(), json_str.length());
+        *data_send.data->push_header(1) = OI_LEGACY_MSG_FAMILY_MM;
         data_send.data->endpoint = ep;
         data_send.data->default_endpoint = false;
-        data_send.enqueue(send_queue());
+        data_send.enqueue(send_queue(), UDP_LANE_CONTROL);
         
         return json_str.length()+1;
     }
     
-    void UDPConnector::Register() {
+    void UDPConnector::Register(worker::W_FLOW f) {
         if (!_useMM) return;
         json register_msg;
         register_msg["packageType"] = "register";
@@ -308,7 +332,7 @@ namespace oi { namespace core { namespace network {
         
         printf("REGISTER: %s\n", register_msg.dump().c_str());
         
-        MMSend(register_msg.dump());
+        MMSend(register_msg.dump(), f);
         
         //stringstream ss;
         //ss << "d{\"packageType\":\"register\",\"socketID\":\"" << socketID << "\",\"isSender\":" << (string)(is_sender ? "true" : "false") << ",\"localIP\":\"" << localIP << "\",\"UID\":\"" << guid << "\"}";
@@ -316,20 +340,44 @@ namespace oi { namespace core { namespace network {
         //Send(json, _remote_endpoint);
     }
     
-    void UDPConnector::Punch(UDPEndpoint * udpep) {
+    // Timer callbacks share the timer thread with every other timer in the process,
+    // so they never wait for a buffer; a message that finds none is retried on the next tick.
+    void UDPConnector::RegisterTimeout() {
+        if (_connected) return;
+        Register(worker::W_FLOW_NONBLOCKING);
+        mm_lastRegister = NOW();
+    }
+    
+    void UDPConnector::Heartbeat(UDPEndpoint * udpep) {
+        OI_TRACE_SPAN("udp.heartbeat");
+        asio::ip::udp::endpoint ep;
+        {
+            std::unique_lock<std::mutex> lk(_m_endpoints);
+            if (udpep->connected && NOW() > udpep->lastReceivedHB + connectionTimeout) {
+                udpep->connected = false;
+            }
+            udpep->lastSentHB = NOW();
+            ep = udpep->endpoint;
+        }
+        Punch(ep, worker::W_FLOW_NONBLOCKING);
+    }
+    
+    void UDPConnector::Punch(asio::ip::udp::endpoint ep, worker::W_FLOW f) {
         // TODO: header!
         json punch_msg;
         punch_msg["type"] = "punch";
-        udpep->lastSentHB = NOW();
-        MMSend(punch_msg.dump(), udpep->endpoint);
+        MMSend(punch_msg.dump(), ep, f);
         //OISendString(OI_MSG_FAMILY_MM, 0x00, register_msg.dump(), OI_MESSAGE_FORMAT_JSON, udpep->endpoint);
     }
     
     int UDPConnector::DataSender() {
         _running = true;
+        std::vector<asio::const_buffer> gather;
         while (_running) {
             worker::DataObjectAcquisition<UDPMessageObject> doa_s(_queue_send, worker::W_FLOW_BLOCKING);
             if (!_running || !doa_s.data) continue;
+            worker::ScopedSpan span("udp.send");
+            span.arg(doa_s.data->message_size());
             
             asio::error_code ec;
             asio::socket_base::message_flags mf = 0;
@@ -354,12 +402,13 @@ namespace oi { namespace core { namespace network {
                     }
                 }
                 
-                size_t data_len = doa_s.data->data_end-doa_s.data->data_start;
+                doa_s.data->buffers(gather);
                 
                 for(std::vector<asio::ip::udp::endpoint>::iterator it = targets.begin(); it != targets.end(); ++it) {
-                    //printf("Unqueued OUT (%ld bytes): %s:%d\n", data_len, it->address().to_string().c_str(), it->port());
-                    _socket.send_to(asio::buffer(&(doa_s.data->buffer[doa_s.data->data_start]), data_len), *it, mf, ec);
+                    //printf("Unqueued OUT (%ld bytes): %s:%d\n", doa_s.data->message_size(), it->address().to_string().c_str(), it->port());
+                    _socket.send_to(gather, *it, mf, ec);
                 }
+                OI_TRACE_STAMP(doa_s.data, "udp.sent");
                 
                 
             } catch (std::exception& e) {
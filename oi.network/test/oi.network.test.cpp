@@ -66,6 +66,10 @@ public:
         udp.RegisterQueue(PKG_TYPE_A, inA, Q_IO_IN);
         udp.RegisterQueue(PKG_TYPE_B, inB, Q_IO_IN);
         
+        QueueSelector<UDPMessageObject> inputs;
+        inputs.add(inA);
+        inputs.add(inB);
+        
         srand(time(0));
         
         udp.Init(&bufferPool);
@@ -90,23 +94,23 @@ public:
         
         while (running) {
             if (received_a >= runs && received_b >= runs && sent_a >= runs && sent_b >= runs) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
                 continue; // idle thread...
             }
             
-            { // Check if there is incomming data in A queue...
-                DataObjectAcquisition<UDPMessageObject> doa(inA, W_FLOW_NONBLOCKING);
-                if (doa.data) {
+            // Handle incomming data in the A and B queues until the next send is due
+            W_DEADLINE next_send = std::chrono::steady_clock::now() + std::chrono::milliseconds(13 + rand() % 6);
+            int ready;
+            while ((ready = inputs.wait(next_send)) >= 0) {
+                DataObjectAcquisition<UDPMessageObject> doa(inputs.queue(ready), W_FLOW_NONBLOCKING);
+                if (!doa.data) continue;
+                if (ready == 0) {
                     TEST_PACKET_A * a_in = (TEST_PACKET_A *) &doa.data->buffer[0];
                     assert(a_in->packetType == PKG_TYPE_A);
                     assert(a_in->src == dst);
                     assert(a_in->data >= 0 && a_in->data <= runs);
                     received_a += 1;
-                }
-            }
-            
-            { // Check if there is incomming data in B queue...
-                DataObjectAcquisition<UDPMessageObject> doa(inB, W_FLOW_NONBLOCKING);
-                if (doa.data) {
+                } else {
                     TEST_PACKET_B * b_in = (TEST_PACKET_B *) &doa.data->buffer[0];
                     assert(b_in->packetType == PKG_TYPE_B);
                     assert(b_in->src == dst);
@@ -116,10 +120,6 @@ public:
             }
             
             
-            // Do some work...
-            std::this_thread::sleep_for(std::chrono::milliseconds(13 + rand() % 6));
-            
-            
             if (sent_a < runs) {
                 DataObjectAcquisition<UDPMessageObject> doa(&bufferPool, W_FLOW_NONBLOCKING);
                 if (doa.data) {
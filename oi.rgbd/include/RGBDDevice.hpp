@@ -55,10 +55,22 @@ namespace oi { namespace core { namespace rgbd {
     class RGBDDevice {
     public:
         RGBDDevice(RGBDDeviceInterface& device, RGBDStreamIO& io);
+        // Cancels the config timer, waiting for a broadcast that is running
+        ~RGBDDevice();
+        RGBDDevice(const RGBDDevice&) = delete;
+        RGBDDevice& operator=(const RGBDDevice&) = delete;
         //int UpdateStreamConfig(CONFIG_STRUCT cfg);
         
+        // Frame timestamps are NOW() (monotonic) values; deltas are taken from them
+        // and they are converted with WALL() for the headers.
         int QueueAudioFrame(uint32_t sequence, float * samples, size_t n_samples, uint16_t freq, uint16_t channels, std::chrono::milliseconds timestamp);
         int QueueBodyFrame(oi::core::BODY_STRUCT * bodies, uint16_t n_bodies, std::chrono::milliseconds timestamp);
+        // Send samples/bodies without copying them; they must stay valid until release is called.
+        // Without release they are copied, as above.
+        int QueueAudioFrame(uint32_t sequence, float * samples, size_t n_samples, uint16_t freq, uint16_t channels, std::chrono::milliseconds timestamp,
+                            std::function<void()> release);
+        int QueueBodyFrame(oi::core::BODY_STRUCT * bodies, uint16_t n_bodies, std::chrono::milliseconds timestamp,
+                           std::function<void()> release);
         int QueueRGBDFrame(uint64_t sequence, uint8_t * rgbdata, uint8_t * depthdata, std::chrono::milliseconds timestamp);
         int QueueRGBDFrame(uint64_t sequence, uint8_t * rgbdata, uint16_t * depthdata, std::chrono::milliseconds timestamp);
         int QueueRGBDFrame(uint64_t sequence, uint8_t * rgbdata, uint8_t * depth_any, uint16_t * depth_ushort, std::chrono::milliseconds timestamp);
@@ -73,8 +85,9 @@ namespace oi { namespace core { namespace rgbd {
         
         uint32_t _audio_samples_counter;
     private:
+        // Runs every _config_send_interval on the shared timer wheel
         int HandleStream();
-        std::thread * handleStreamThread;
+        worker::TimerWheel::TimerId _config_timer;
 		
 		RGBDStreamIO * _io;
         
@@ -83,6 +96,7 @@ namespace oi { namespace core { namespace rgbd {
 		std::chrono::milliseconds _prev_body_frame;
         uint32_t fps_counter;
         CONFIG_STRUCT _stream_config;
+        bool _print_stats;
         
         std::chrono::milliseconds _config_send_interval = (std::chrono::milliseconds) 5000;
         std::chrono::milliseconds _last_config_sent;
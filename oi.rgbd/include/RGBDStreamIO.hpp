@@ -26,13 +26,6 @@ along with OpenIMPRESS. If not, see <https://www.gnu.org/licenses/>.
 namespace oi { namespace core { namespace rgbd {
 
 
-	class ScheduledRGBDCommand {
-	public:
-		std::chrono::milliseconds time;
-		nlohmann::json cmd;
-		bool operator() (ScheduledRGBDCommand left, ScheduledRGBDCommand right);
-	};
-
 	class RGBDStreamerConfig {
 	public:
 		RGBDStreamerConfig(int argc, char *argv[]);
@@ -47,12 +40,31 @@ namespace oi { namespace core { namespace rgbd {
 		std::string deviceSerial = ""; //
 		std::string pipeline = "opengl";
 		float maxDepth = 8.0f;
+		// How the sender waits for packets: "block", "spin" or "poll" (burns a core)
+		std::string sendWait = "spin";
+		// Per thread name prefix (oi.udp.send, oi.udp.recv, oi.udp.update, oi.rgbd.cmd, oi.rgbd.read,
+		// oi.exec.N, oi.timer, oi.stage.<name>): CPU sets like "oi.udp=2,3;oi.exec=4-7"
+		// and SCHED_FIFO priorities like "oi.udp.send=50"
+		std::string threadCpus = "";
+		std::string threadPriorities = "";
+		// Tick source of the process clock: "monotonic" or "tsc" (only taken where the TSC is invariant)
+		std::string clockSource = "monotonic";
+		// Record one in spanSample frames/packets per thread as timeline spans (0: off), written
+		// as Chrome trace JSON to spanFile at exit and on SIGUSR1
+		int spanSample = 0;
+		std::string spanFile = "oi.trace.json";
+		// Track who holds the frame buffers; printed with the stream stats and when a pool runs dry
+		bool poolCensus = false;
+		// Print worker, pipeline, span and census stats with every config broadcast
+		bool printStats = false;
 	};
 
 	class RGBDStreamIO {
 	public:
 		oi::core::worker::ObjectPool<oi::core::network::UDPMessageObject> * empty_frame();
+		oi::core::worker::TieredObjectPool<oi::core::network::UDPMessageObject> * frame_pools();
 		oi::core::worker::WorkerQueue<oi::core::network::UDPMessageObject> * live_frame_queue();
+		oi::core::worker::Pipeline<oi::core::network::UDPMessageObject> * pipeline();
 		RGBDStreamIO(RGBDStreamerConfig streamer_cfg, asio::io_service & io_service);
 		RGBDStreamerConfig get_stream_config();
 		uint32_t next_sequence_id();
@@ -62,25 +74,28 @@ namespace oi { namespace core { namespace rgbd {
 		oi::core::network::UDPConnector * _udpc;
 
 		oi::core::worker::ObjectPool<oi::core::network::UDPMessageObject>  * _frame_pool;
+		oi::core::worker::TieredObjectPool<oi::core::network::UDPMessageObject> * _frame_pools;
 
 		oi::core::worker::WorkerQueue<oi::core::network::UDPMessageObject> * _commands_queue;
 		oi::core::worker::WorkerQueue<oi::core::network::UDPMessageObject> * _queue_live;
-		oi::core::worker::WorkerQueue<oi::core::network::UDPMessageObject> * _queue_write;
+		oi::core::worker::WorkerQueue<oi::core::network::UDPMessageObject, oi::core::worker::SPSC> * _queue_write;
 
 		int Commands();
-		int Live();
 		int Reader();
-		int Writer();
+		// Pipeline stages: forward live data to the sender and the recorder, write live data when recording
+		void Live(oi::core::worker::DataObjectAcquisition<oi::core::network::UDPMessageObject> & doa_s,
+			oi::core::worker::PipelineStage<oi::core::network::UDPMessageObject> & stage);
+		void Writer(oi::core::worker::DataObjectAcquisition<oi::core::network::UDPMessageObject> & doa_s,
+			oi::core::worker::PipelineStage<oi::core::network::UDPMessageObject> & stage);
 
+		oi::core::worker::Pipeline<oi::core::network::UDPMessageObject> * _pipeline;
 		std::thread * _commands_thread; // handle queue of li ve data...
-		std::thread * _live_thread; // handle queue of li ve data...
-		std::thread * _write_thread; // write live data when recording...
 		std::thread * _read_thread; // read data when replaying
 		
-		mutable std::recursive_mutex pq_mutex;
-		std::priority_queue<ScheduledRGBDCommand, std::vector<ScheduledRGBDCommand>, ScheduledRGBDCommand> scheduled_commands;
+		// Runs msg on the shared timer wheel at its "time" (epoch ms, WALL() clock) or right away.
+		// The one-shot holds this and is never cancelled: like the threads and pipeline above,
+		// it relies on the stream living until the process exits.
 		void ScheduleCommand(nlohmann::json msg);
-		int32_t HandleScheduledCommands();
 
 		void HandleCommand(nlohmann::json cmd);
 	};
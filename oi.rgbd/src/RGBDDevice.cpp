@@ -29,6 +29,7 @@ using namespace oi::core::network;
 RGBDDevice::RGBDDevice(RGBDDeviceInterface& device, RGBDStreamIO& io) {
     this->_device = &device;
 	this->_io = &io;
+	this->_print_stats = io.get_stream_config().printStats;
     
     _stream_config.header.packageFamily = OI_LEGACY_MSG_FAMILY_RGBD;
     _stream_config.header.packageType = OI_MSG_TYPE_RGBD_CONFIG;
@@ -69,110 +70,119 @@ RGBDDevice::RGBDDevice(RGBDDeviceInterface& device, RGBDStreamIO& io) {
     std::string guid = device.device_guid();
     memcpy(&(_stream_config.guid[0]), guid.c_str(), guid.length()+1);
     
-    handleStreamThread = new std::thread(&RGBDDevice::HandleStream, this);
+    fps_counter = 0;
+    _config_timer = TimerWheel::shared()->schedule_every(_config_send_interval, [this] { HandleStream(); });
+}
+
+RGBDDevice::~RGBDDevice() {
+    TimerWheel::shared()->cancel(_config_timer);
 }
 
 int RGBDDevice::HandleStream() {
-    //worker::ObjectPool<UDPMessageObject> bufferPool(32 , 4096);
-    //worker::WorkerQueue<UDPMessageObject> cmdqueue(&bufferPool);
-    //_udpc->RegisterQueue(OI_LEGACY_MSG_FAMILY_RGBD_CMD, &cmdqueue, Q_IO_IN);
-    while (true) {
-		fps_counter = 0;
-        std::this_thread::sleep_for(_config_send_interval);
-        printf("SENT CONFIG: %d bytes. FPS: %d\n", SendConfig(), fps_counter/(int)(_config_send_interval.count() / 1000));
-        //DataObjectAcquisition<UDPMessageObject> data_in(&cmdqueue, W_TYPE_QUEUED, W_FLOW_NONBLOCKING);
-        //data_in.release();
+    printf("SENT CONFIG: %d bytes. FPS: %d\n", SendConfig(), fps_counter/(int)(_config_send_interval.count() / 1000));
+    fps_counter = 0;
+    if (_print_stats) {
+        WorkerRegistry::print();
+        _io->pipeline()->print_stats();
+        Tracer::print();
+        Census::print();
     }
     return 1;
 }
 
 int RGBDDevice::SendConfig() {
     _stream_config.header.sequence = _io->next_sequence_id();
-    _stream_config.header.timestamp = NOW().count();
+    _stream_config.header.timestamp = WALL().count();
     
-    DataObjectAcquisition<UDPMessageObject> data_out(_io->empty_frame(), W_FLOW_BLOCKING);
+    // Called from the shared timer wheel: never wait for a buffer, the next interval resends
+    DataObjectAcquisition<UDPMessageObject> data_out(_io->frame_pools(), sizeof(CONFIG_STRUCT), W_FLOW_NONBLOCKING);
     if (!data_out.data) {
         std::cout << "\nERROR: No free buffers available" << std::endl;
+        Census::print();
         return -1;
     }
     
     int data_len = sizeof(CONFIG_STRUCT);
-    memcpy(&(data_out.data->buffer[0]), (unsigned char *) &_stream_config, data_len);
-    data_out.data->data_end = data_len;
-    data_out.enqueue(_io->live_frame_queue());
+    memcpy(data_out.data->put(data_len), (unsigned char *) &_stream_config, data_len);
+    data_out.enqueue(_io->live_frame_queue(), UDP_LANE_CONTROL);
     return data_len;
 }
 
 int RGBDDevice::QueueAudioFrame(uint32_t sequence, float * samples, size_t n_samples, uint16_t freq, uint16_t channels, std::chrono::milliseconds timestamp) {
+    return QueueAudioFrame(sequence, samples, n_samples, freq, channels, timestamp, nullptr);
+}
+
+int RGBDDevice::QueueAudioFrame(uint32_t sequence, float * samples, size_t n_samples, uint16_t freq, uint16_t channels, std::chrono::milliseconds timestamp,
+                                std::function<void()> release) {
     _audio_samples_counter += n_samples;
     
-    DataObjectAcquisition<UDPMessageObject> data_out(_io->empty_frame(), W_FLOW_BLOCKING);
+    size_t audio_block_size = sizeof(float) * n_samples;
+    DataObjectAcquisition<UDPMessageObject> data_out(_io->frame_pools(), release ? 0 : audio_block_size, W_FLOW_BLOCKING);
     if (!data_out.data) {
         std::cout << "\nERROR: No free buffers available" << std::endl;
+        Census::print();
+        if (release) release();
         return -1;
     }
     
-    data_out.data->data_start = 0;
-    AUDIO_HEADER_STRUCT * audio_header = (AUDIO_HEADER_STRUCT *) &(data_out.data->buffer[0]);
-    size_t header_size = sizeof(AUDIO_HEADER_STRUCT);
+    if (release) data_out.data->add_segment((const uint8_t *) samples, audio_block_size, release);
+    else memcpy(data_out.data->put(audio_block_size), samples, audio_block_size);
+    
+    /*
+    for (int i = 0; i < n_samples; i++) {
+        unsigned short sample = (unsigned short) (samples[i] * 32767);
+        memcpy(&(dc->dataBuffer[writeOffset]), &sample, sizeof(sample));
+        writeOffset += sizeof(sample);
+    }
+    */
+    
+    AUDIO_HEADER_STRUCT * audio_header = (AUDIO_HEADER_STRUCT *) data_out.data->push_header(sizeof(AUDIO_HEADER_STRUCT));
     
     audio_header->header.packageFamily = OI_LEGACY_MSG_FAMILY_AUDIO;
     audio_header->header.packageType = OI_MSG_TYPE_AUDIO_DEFAULT_FRAME;
     audio_header->header.partsTotal = 1;
     audio_header->header.currentPart = 1;
     audio_header->header.sequence = _io->next_sequence_id();
-    audio_header->header.timestamp = timestamp.count();
+    audio_header->header.timestamp = WALL(timestamp).count();
     
     audio_header->channels = channels;
     audio_header->frequency = freq;
     audio_header->samples = n_samples;
     
-    size_t audio_block_size = sizeof(float) * n_samples;
-    uint8_t * data = &(data_out.data->buffer[header_size]);
-    size_t writeOffset = 0;
-    
-    memcpy(data, samples, audio_block_size);
-    writeOffset += audio_block_size;
-    
-    /*
-    for (int i = 0; i < n_samples; i++) {
-        unsigned short sample = (unsigned short) (samples[i] * 32767);
-        memcpy(&(dc->dataBuffer[writeOffset]), &sample, sizeof(sample));
-        writeOffset += sizeof(sample);
-    }
-    */
-    
-    size_t data_len = header_size + writeOffset;
-    data_out.data->data_end = data_len;
-    data_out.enqueue(_io->live_frame_queue());
+    size_t data_len = data_out.data->message_size();
+    data_out.enqueue(_io->live_frame_queue(), UDP_LANE_STREAM);
     return data_len;
 }
 
 int RGBDDevice::QueueBodyFrame(oi::core::BODY_STRUCT * bodies, uint16_t n_bodies, std::chrono::milliseconds timestamp) {
+	return QueueBodyFrame(bodies, n_bodies, timestamp, nullptr);
+}
+
+int RGBDDevice::QueueBodyFrame(oi::core::BODY_STRUCT * bodies, uint16_t n_bodies, std::chrono::milliseconds timestamp,
+                               std::function<void()> release) {
 	int res = 0;
-	DataObjectAcquisition<UDPMessageObject> data_out(_io->empty_frame(), W_FLOW_BLOCKING);
+	size_t data_size = sizeof(BODY_STRUCT) * n_bodies;
+	DataObjectAcquisition<UDPMessageObject> data_out(_io->frame_pools(), release ? 0 : data_size, W_FLOW_BLOCKING);
 	if (!data_out.data) {
 		std::cout << "\nERROR: No free buffers available" << std::endl;
+		Census::print();
+		if (release) release();
 		return -1;
 	}
-	data_out.data->data_start = 0;
-	BODY_HEADER_STRUCT * body_header = (BODY_HEADER_STRUCT *) &(data_out.data->buffer[0]);
-	static size_t header_size = sizeof(BODY_HEADER_STRUCT);
-	body_header->header.timestamp = timestamp.count();
+	if (release) data_out.data->add_segment((const uint8_t *) bodies, data_size, release);
+	else memcpy(data_out.data->put(data_size), bodies, data_size);
+	BODY_HEADER_STRUCT * body_header = (BODY_HEADER_STRUCT *) data_out.data->push_header(sizeof(BODY_HEADER_STRUCT));
+	body_header->header.timestamp = WALL(timestamp).count();
 	body_header->header.packageFamily = OI_LEGACY_MSG_FAMILY_MOCAP;
 	body_header->header.packageType = OI_MSG_TYPE_MOCAP_BODY_FRAME_KINECTV2;
 	body_header->header.partsTotal = 1;
 	body_header->header.currentPart = 1;
 	body_header->header.sequence = _io->next_sequence_id();
 	body_header->n_bodies = n_bodies;
-	uint8_t * data = &(data_out.data->buffer[header_size]);
-	size_t data_size = sizeof(BODY_STRUCT) * n_bodies;
-	memcpy(data, bodies, data_size);
 
-	int d_data_len = header_size + data_size;
-	data_out.data->data_end = d_data_len;
+	int d_data_len = data_out.data->message_size();
 	res += d_data_len;
-	data_out.enqueue(_io->live_frame_queue());
+	data_out.enqueue(_io->live_frame_queue(), UDP_LANE_STREAM);
 	return res;
 }
 
@@ -186,6 +196,8 @@ int RGBDDevice::QueueRGBDFrame(uint64_t sequence, uint8_t * rgbdata, uint16_t *
 
 int RGBDDevice::QueueRGBDFrame(uint64_t sequence, uint8_t * rgbdata, uint8_t * depth_any, uint16_t * depth_ushort, std::chrono::milliseconds timestamp) {
     int res = 0;
+    ScopedSpan frame_span("rgbd.frame");
+    frame_span.arg(sequence);
     std::chrono::milliseconds delta = timestamp - _prev_frame;
     _prev_frame = timestamp;
     
@@ -197,16 +209,33 @@ int RGBDDevice::QueueRGBDFrame(uint64_t sequence, uint8_t * rgbdata, uint8_t * d
     int frame_height =_device->frame_height();
     
     { // Scope buffer access
-        DataObjectAcquisition<UDPMessageObject> data_out(_io->empty_frame(), W_FLOW_BLOCKING);
+        static size_t header_size = sizeof(RGBD_HEADER_STRUCT);
+        DataObjectAcquisition<UDPMessageObject> data_out(_io->frame_pools(), MAX_UDP_PACKET_SIZE - header_size, W_FLOW_BLOCKING);
         if (!data_out.data) {
             std::cout << "\nERROR: No free buffers available" << std::endl;
+            Census::print();
             return -1;
         }
-        data_out.data->data_start = 0;
-        RGBD_HEADER_STRUCT * rgbd_header = (RGBD_HEADER_STRUCT *) &(data_out.data->buffer[0]);
-        static size_t header_size = sizeof(RGBD_HEADER_STRUCT);
+        OI_TRACE_STAMP_AT(data_out.data, "rgbd.capture", (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp).count());
+    
+        // COMPRESS COLOR
+        long unsigned int _jpegSize = MAX_UDP_PACKET_SIZE - header_size;
+        unsigned char* _compressedImage = (unsigned char*) data_out.data->payload();
+    
+        { // Scope span
+            OI_TRACE_SPAN("rgbd.encode");
+            tjhandle _jpegCompressor = tjInitCompress();
+            tjCompress2(_jpegCompressor, rgbdata, frame_width, 0, frame_height, _device->color_pixel_format(),
+                        &_compressedImage, &_jpegSize, TJSAMP_444, JPEG_QUALITY,
+                        TJFLAG_FASTDCT);
+            tjDestroy(_jpegCompressor);
+        }
+        data_out.data->put(_jpegSize);
+        OI_TRACE_STAMP(data_out.data, "rgbd.encode");
+    
+        RGBD_HEADER_STRUCT * rgbd_header = (RGBD_HEADER_STRUCT *) data_out.data->push_header(header_size);
     
-        rgbd_header->header.timestamp = timestamp.count();
+        rgbd_header->header.timestamp = WALL(timestamp).count();
         rgbd_header->delta_t = deltaValue;
     
         // Send color data first...
@@ -215,80 +244,74 @@ int RGBDDevice::QueueRGBDFrame(uint64_t sequence, uint8_t * rgbdata, uint8_t * d
         rgbd_header->header.partsTotal = 1;
         rgbd_header->header.currentPart = 1;
         rgbd_header->header.sequence = _io->next_sequence_id();
-        rgbd_header->header.timestamp = timestamp.count();
+        rgbd_header->header.timestamp = WALL(timestamp).count();
         rgbd_header->startRow = (uint16_t) 0;             // ... we can fit the whole...
         rgbd_header->endRow = (uint16_t) frame_height; //...RGB data in one packet
     
-        uint8_t * data = &(data_out.data->buffer[header_size]);
-    
-        // COMPRESS COLOR
-        long unsigned int _jpegSize = MAX_UDP_PACKET_SIZE - header_size;
-        unsigned char* _compressedImage = (unsigned char*) data;
-    
-        tjhandle _jpegCompressor = tjInitCompress();
-        tjCompress2(_jpegCompressor, rgbdata, frame_width, 0, frame_height, _device->color_pixel_format(),
-                    &_compressedImage, &_jpegSize, TJSAMP_444, JPEG_QUALITY,
-                    TJFLAG_FASTDCT);
-        int c_data_len = header_size + _jpegSize;
-        data_out.data->data_end = c_data_len;
+        int c_data_len = data_out.data->payload_size();
         res += c_data_len;
         data_out.enqueue(_io->live_frame_queue());
-        tjDestroy(_jpegCompressor);
     }
     
     
     uint16_t linesPerMessage = (uint16_t)(MAX_UDP_PACKET_SIZE - sizeof(RGBD_HEADER_STRUCT)) / (2 * frame_width);
-    for (uint16_t startRow = 0; startRow < frame_height; startRow += linesPerMessage) {
-        uint16_t endRow = startRow + linesPerMessage;
-        if (startRow >= endRow) break;
-        if (endRow >= frame_height) endRow = frame_height;
-        DataObjectAcquisition<UDPMessageObject> data_out(_io->empty_frame(), W_FLOW_BLOCKING);
-        if (!data_out.data) {
+    size_t blockSize = linesPerMessage * frame_width * sizeof(uint16_t);
+    uint16_t startRow = 0;
+    while (linesPerMessage > 0 && startRow < frame_height) {
+        // Acquire and enqueue the remaining depth blocks together; the pool may hand out fewer
+        size_t blocksLeft = (frame_height - startRow + linesPerMessage - 1) / linesPerMessage;
+        OI_TRACE_SPAN("rgbd.depth");
+        DataObjectBatch<UDPMessageObject> batch_out(_io->frame_pools(), blockSize, blocksLeft, W_FLOW_BLOCKING);
+        if (batch_out.empty()) {
             std::cout << "\nERROR: No free buffers available" << std::endl;
+            Census::print();
             return -1;
         }
-        data_out.data->data_start = 0;
-        RGBD_HEADER_STRUCT * rgbd_header = (RGBD_HEADER_STRUCT *) &(data_out.data->buffer[0]);
-        static size_t header_size = sizeof(RGBD_HEADER_STRUCT);
-        rgbd_header->header.timestamp = timestamp.count();
-        rgbd_header->delta_t = deltaValue;
-        rgbd_header->header.packageFamily = OI_LEGACY_MSG_FAMILY_RGBD;
-        rgbd_header->header.packageType = OI_MSG_TYPE_RGBD_DEPTH_BLOCK;
-        rgbd_header->header.partsTotal = 1;
-        rgbd_header->header.currentPart = 1;
-        rgbd_header->header.sequence = _io->next_sequence_id();
-        rgbd_header->header.timestamp = timestamp.count();
-        rgbd_header->startRow = startRow;             // ... we can fit the whole...
-        rgbd_header->endRow = endRow; //...RGB data in one packet
-        
-        size_t writeOffset = header_size;
-        
-        if (depth_any != NULL) {
-            size_t depthLineSizeR = frame_width * _device->raw_depth_stride();
-            size_t depthLineSizeW = frame_width * 2;
-            size_t readOffset = startRow*depthLineSizeR;
-            for (int line = startRow; line < endRow; line++) {
-                for (int i = 0; i < frame_width; i++) {
-                    float depthValue = 0;
-                    memcpy(&depthValue, &depth_any[readOffset + i * 4], sizeof(depthValue));
-                    unsigned short depthValueShort = (unsigned short)(depthValue);
-                    memcpy(&(data_out.data->buffer[writeOffset + i * 2]), &depthValueShort, sizeof(depthValueShort));
+        for (size_t b = 0; b < batch_out.size(); b++) {
+            uint16_t endRow = startRow + linesPerMessage;
+            if (endRow < startRow || endRow >= frame_height) endRow = frame_height;
+            UDPMessageObject * block = batch_out[b];
+            OI_TRACE_STAMP_AT(block, "rgbd.capture", (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp).count());
+            
+            if (depth_any != NULL) {
+                size_t depthLineSizeR = frame_width * _device->raw_depth_stride();
+                size_t depthLineSizeW = frame_width * 2;
+                size_t readOffset = startRow*depthLineSizeR;
+                for (int line = startRow; line < endRow; line++) {
+                    uint8_t * row = block->put(depthLineSizeW);
+                    for (int i = 0; i < frame_width; i++) {
+                        float depthValue = 0;
+                        memcpy(&depthValue, &depth_any[readOffset + i * 4], sizeof(depthValue));
+                        unsigned short depthValueShort = (unsigned short)(depthValue);
+                        memcpy(&row[i * 2], &depthValueShort, sizeof(depthValueShort));
+                    }
+                    readOffset += depthLineSizeR;
                 }
-                writeOffset += depthLineSizeW;
-                readOffset += depthLineSizeR;
+            } else if (depth_ushort != NULL) {
+                size_t startRowStart = startRow * frame_width;
+                // for pixel (in all lines), two bytes:
+                size_t bytesToCopy = (endRow - startRow) * frame_width * sizeof(depth_ushort[0]);
+                memcpy(block->put(bytesToCopy), &(depth_ushort[startRowStart]), bytesToCopy);
             }
-        } else if (depth_ushort != NULL) {
-            size_t startRowStart = startRow * frame_width;
-            // for pixel (in all lines), two bytes:
-            size_t bytesToCopy = (endRow - startRow) * frame_width * sizeof(depth_ushort[0]);
-            memcpy(&(data_out.data->buffer[writeOffset]), &(depth_ushort[startRowStart]), bytesToCopy);
-            writeOffset += bytesToCopy;
+            OI_TRACE_STAMP(block, "rgbd.depth");
+            
+            RGBD_HEADER_STRUCT * rgbd_header = (RGBD_HEADER_STRUCT *) block->push_header(sizeof(RGBD_HEADER_STRUCT));
+            rgbd_header->header.timestamp = WALL(timestamp).count();
+            rgbd_header->delta_t = deltaValue;
+            rgbd_header->header.packageFamily = OI_LEGACY_MSG_FAMILY_RGBD;
+            rgbd_header->header.packageType = OI_MSG_TYPE_RGBD_DEPTH_BLOCK;
+            rgbd_header->header.partsTotal = 1;
+            rgbd_header->header.currentPart = 1;
+            rgbd_header->header.sequence = _io->next_sequence_id();
+            rgbd_header->header.timestamp = WALL(timestamp).count();
+            rgbd_header->startRow = startRow;             // ... we can fit the whole...
+            rgbd_header->endRow = endRow; //...RGB data in one packet
+            
+            int d_data_len = block->payload_size();
+            res += d_data_len;
+            startRow = endRow;
         }
-        
-        int d_data_len = writeOffset;
-        data_out.data->data_end = d_data_len;
-        res += d_data_len;
-        data_out.enqueue(_io->live_frame_queue());
+        batch_out.enqueue(_io->live_frame_queue());
     }
     
     fps_counter++;
@@ -308,39 +331,42 @@ int RGBDDevice::QueueBodyIndexFrame(unsigned char * bidata, int width, int heigh
 	unsigned short deltaValue = (unsigned short)delta.count();
 	int res = 0;
 
-	DataObjectAcquisition<UDPMessageObject> data_out(_io->empty_frame(), W_FLOW_BLOCKING);
+	static size_t header_size = sizeof(RGBD_HEADER_STRUCT);
+	DataObjectAcquisition<UDPMessageObject> data_out(_io->frame_pools(), MAX_UDP_PACKET_SIZE - header_size, W_FLOW_BLOCKING);
 	if (!data_out.data) {
 		std::cout << "\nERROR: No free buffers available" << std::endl;
+		Census::print();
 		return -1;
 	}
-	data_out.data->data_start = 0;
-	RGBD_HEADER_STRUCT * rgbd_header = (RGBD_HEADER_STRUCT *) &(data_out.data->buffer[0]);
-	static size_t header_size = sizeof(RGBD_HEADER_STRUCT);
+	OI_TRACE_STAMP_AT(data_out.data, "rgbd.capture", (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp).count());
+
+	// COMPRESS COLOR
+	long unsigned int _jpegSize = MAX_UDP_PACKET_SIZE - header_size;
+	unsigned char* _compressedImage = (unsigned char*) data_out.data->payload();
+
+	tjhandle _jpegCompressor = tjInitCompress();
+	tjCompress2(_jpegCompressor, bidata, width, 0, height, pix_fmt,
+		&_compressedImage, &_jpegSize, TJSAMP_GRAY, 75,
+		TJFLAG_FASTDCT);
+	tjDestroy(_jpegCompressor);
+	data_out.data->put(_jpegSize);
+	OI_TRACE_STAMP(data_out.data, "rgbd.bidx.encode");
+
+	RGBD_HEADER_STRUCT * rgbd_header = (RGBD_HEADER_STRUCT *) data_out.data->push_header(header_size);
 
 	rgbd_header->header.packageFamily = OI_LEGACY_MSG_FAMILY_RGBD;
 	rgbd_header->header.packageType = OI_MSG_TYPE_RGBD_BODY_ID_TEXTURE_BLOCK; // _BLOCK?, even though its a whole one?
 	rgbd_header->header.partsTotal = 1;
 	rgbd_header->header.currentPart = 1;
 	rgbd_header->header.sequence = _io->next_sequence_id();
-	rgbd_header->header.timestamp = timestamp.count();
+	rgbd_header->header.timestamp = WALL(timestamp).count();
 	rgbd_header->delta_t = deltaValue;
 	rgbd_header->startRow = 0;
 	rgbd_header->endRow = _device->frame_height();
-	uint8_t * data = &(data_out.data->buffer[header_size]);
 
-	// COMPRESS COLOR
-	long unsigned int _jpegSize = MAX_UDP_PACKET_SIZE - header_size;
-	unsigned char* _compressedImage = (unsigned char*)data;
-
-	tjhandle _jpegCompressor = tjInitCompress();
-	tjCompress2(_jpegCompressor, bidata, width, 0, height, pix_fmt,
-		&_compressedImage, &_jpegSize, TJSAMP_GRAY, 75,
-		TJFLAG_FASTDCT);
-	int c_data_len = header_size + _jpegSize;
-	data_out.data->data_end = c_data_len;
+	int c_data_len = data_out.data->payload_size();
 	res += c_data_len;
 	data_out.enqueue(_io->live_frame_queue());
-	tjDestroy(_jpegCompressor);
 
 	return res;
 }
@@ -22,33 +22,73 @@ using namespace oi::core::worker;
 using namespace oi::core::network;
 using namespace nlohmann;
 
-bool ScheduledRGBDCommand::operator()(ScheduledRGBDCommand left, ScheduledRGBDCommand right) {
-	return left.time > right.time;
-}
-
 ObjectPool<oi::core::network::UDPMessageObject>* oi::core::rgbd::RGBDStreamIO::empty_frame() {
 	return _frame_pool;
 }
 
+TieredObjectPool<oi::core::network::UDPMessageObject>* oi::core::rgbd::RGBDStreamIO::frame_pools() {
+	return _frame_pools;
+}
+
 WorkerQueue<oi::core::network::UDPMessageObject>* oi::core::rgbd::RGBDStreamIO::live_frame_queue() {
 	return _queue_live;
 }
 
 RGBDStreamIO::RGBDStreamIO(RGBDStreamerConfig streamer_cfg, asio::io_service& io_service) {
 	this->_rgbdstreamer_config = streamer_cfg;
+	// Before any of the stream's threads (and the shared executor and timer) start
+	Threads::configure_cpus(streamer_cfg.threadCpus);
+	Threads::configure_priorities(streamer_cfg.threadPriorities);
+	if (streamer_cfg.clockSource == "tsc") Clock::set_source(W_CLOCK_TSC);
+	if (streamer_cfg.spanSample > 0) {
+		Spans::enable(streamer_cfg.spanSample);
+		Spans::write_on_exit(streamer_cfg.spanFile);
+		Spans::write_on_signal(streamer_cfg.spanFile);
+	}
 
 	// TODO: max packet size may depend on the device, so this should be more dynamic...
 	//  ... also: rgbd streamer should make their packets fit int o these objects...
-	_frame_pool =		new ObjectPool<UDPMessageObject>(128, MAX_UDP_PACKET_SIZE);
-	_queue_live =		new WorkerQueue<UDPMessageObject>();
-	_queue_write =		new WorkerQueue<UDPMessageObject>();
+	_frame_pool =		new ObjectPool<UDPMessageObject>(128, MAX_UDP_PACKET_SIZE + UDP_HEADROOM, W_BACKEND_LOCKFREE,
+		W_SLAB_HUGEPAGES | W_SLAB_PREFAULT);
+	// Depth blocks are acquired on the device thread and released on the sender/executor
+	// threads, which hand them straight back to the shared ring; the device thread's
+	// magazine refills from it in batches.
+	_frame_pool->enable_magazines(16);
+	// Config, audio, body frames and control messages use the smaller classes
+	_frame_pools =		new TieredObjectPool<UDPMessageObject>();
+	_frame_pools->add_class(64, W_TIER_SMALL, W_BACKEND_LOCKFREE, W_SLAB_PREFAULT);
+	_frame_pools->add_class(32, W_TIER_MEDIUM, W_BACKEND_LOCKFREE, W_SLAB_PREFAULT);
+	_frame_pools->add_class(_frame_pool);
+	// RGBDDevice writes payloads first and pushes the packet headers in front of them
+	_frame_pools->set_headroom(UDP_HEADROOM);
+	if (streamer_cfg.poolCensus) _frame_pools->enable_census();
+	_frame_pools->class_pool(0)->set_name("rgbd.pool.small");
+	_frame_pools->class_pool(1)->set_name("rgbd.pool.medium");
+	_frame_pool->set_name("rgbd.pool.frame");
+	_queue_live =		new WorkerQueue<UDPMessageObject>(W_BACKEND_LOCKFREE, _frame_pools->pool_capacity());
+	// Same lanes as the send queue, so Live() forwards config and audio ahead of depth blocks
+	_queue_live->set_lanes(UDP_LANES);
+	// Live() is the only producer and Writer() the only consumer of the write queue.
+	// The live queue also receives config broadcasts from RGBDDevice::HandleStream, so it stays MPMC.
+	_queue_write =		new WorkerQueue<UDPMessageObject, SPSC>(_frame_pools->pool_capacity());
 	_commands_queue =	new WorkerQueue<UDPMessageObject>();
+	_queue_live->set_name("rgbd.live");
+	_queue_write->set_name("rgbd.write");
+	_commands_queue->set_name("rgbd.commands");
 
 	this->_udpc = new UDPConnector(streamer_cfg.mmHost, streamer_cfg.mmPort, streamer_cfg.listenPort, io_service);
 	// TODO device serial not always set...
 	this->_udpc->InitConnector(streamer_cfg.socketID, streamer_cfg.deviceSerial, OI_CLIENT_ROLE_PRODUCE,
-		streamer_cfg.useMatchMaking, _frame_pool);
+		streamer_cfg.useMatchMaking, _frame_pools);
 	this->_udpc->RegisterQueue(OI_LEGACY_MSG_FAMILY_DATA, _commands_queue, worker::Q_IO_IN);
+	// When the network falls behind, shed the stalest depth/color blocks at the send queue so their
+	// buffers go back to the pool instead of stalling the capture thread. Config, heartbeats and audio
+	// keep the default blocking policy and are never dropped. Evicting a block only releases the send
+	// queue's reference; the recorder still gets it through the write queue.
+	this->_udpc->send_queue()->set_lane_overflow(UDP_LANE_BULK, W_OVERFLOW_DROP_OLDEST, 64);
+	this->_udpc->send_queue()->set_name("rgbd.send");
+	if (streamer_cfg.sendWait == "block") this->_udpc->send_queue()->set_wait_strategy(W_WAIT_BLOCK);
+	else if (streamer_cfg.sendWait == "poll") this->_udpc->send_queue()->set_wait_strategy(W_WAIT_POLL);
 
 	for (int i = 0; i < streamer_cfg.default_endpoints.size(); ++i) {
 		std::pair<std::string, std::string> ep = streamer_cfg.default_endpoints[i];
@@ -56,10 +96,20 @@ RGBDStreamIO::RGBDStreamIO(RGBDStreamerConfig streamer_cfg, asio::io_service& io
 		printf("RGBD Streamer target: %s:%s\n", ep.first.c_str(), ep.second.c_str());
 	}
 
-	_commands_thread =	new std::thread(&RGBDStreamIO::Commands,	this);
-	_live_thread =		new std::thread(&RGBDStreamIO::Live,		this);
-	_write_thread =		new std::thread(&RGBDStreamIO::Writer,		this);
-	_read_thread =		new std::thread(&RGBDStreamIO::Reader,		this);
+	// live -> (send, write); Live must stay at one task, it is the only producer of the SPSC write queue.
+	// A one task stage never has two drains running on the executor at once (ExecutorConsumer max_tasks).
+	_pipeline =			new Pipeline<UDPMessageObject>("rgbd");
+	_pipeline->add_stage("live", _queue_live, 1,
+		[this](DataObjectAcquisition<UDPMessageObject> & doa, PipelineStage<UDPMessageObject> & stage) { Live(doa, stage); })
+		.to(_udpc->send_queue())
+		.to(_queue_write);
+	_pipeline->add_stage("writer", _queue_write, 1,
+		[this](DataObjectAcquisition<UDPMessageObject> & doa, PipelineStage<UDPMessageObject> & stage) { Writer(doa, stage); });
+	// Stages run as tasks on the process wide executor, so streams share its workers instead of each owning threads
+	_pipeline->start(Executor::shared());
+
+	_commands_thread =	Threads::spawn("oi.rgbd.cmd",	[this] { Commands(); });
+	_read_thread =		Threads::spawn("oi.rgbd.read",	[this] { Reader(); });
 
 }
 
@@ -74,11 +124,7 @@ uint32_t oi::core::rgbd::RGBDStreamIO::next_sequence_id() {
 
 int oi::core::rgbd::RGBDStreamIO::Commands() {
 	while (true) {
-
-		int32_t nextCommandTimeout = HandleScheduledCommands();
-
-		// Don't wait longer than until when the next command is due:
-		worker::DataObjectAcquisition<UDPMessageObject> doa_p(_commands_queue, nextCommandTimeout);
+		worker::DataObjectAcquisition<UDPMessageObject> doa_p(_commands_queue, W_FLOW_BLOCKING);
 		if (!doa_p.data) continue;
 
 		OI_LEGACY_HEADER * header = (OI_LEGACY_HEADER*) &(doa_p.data->buffer[doa_p.data->data_start]);
@@ -97,65 +143,35 @@ int oi::core::rgbd::RGBDStreamIO::Commands() {
 }
 
 void oi::core::rgbd::RGBDStreamIO::ScheduleCommand(nlohmann::json cmd) {
-	ScheduledRGBDCommand sc;
-	sc.cmd = cmd;
+	std::chrono::milliseconds time = WALL();
 	if (cmd.find("time") != cmd.end() && cmd["time"].is_number()) {
-		sc.time = std::chrono::milliseconds(cmd["time"].get<long long>());
-	} else {
-		sc.time = NOW();
+		time = std::chrono::milliseconds(cmd["time"].get<long long>());
 	}
-	printf("Command: %s in %llu ms.\n", cmd.dump(-1).c_str(), (sc.time - NOW()).count());
-	std::lock_guard<std::recursive_mutex> l(pq_mutex);
-	scheduled_commands.push(sc);
-}
-
-int32_t oi::core::rgbd::RGBDStreamIO::HandleScheduledCommands() {
-	std::chrono::milliseconds t = NOW();
-	std::lock_guard<std::recursive_mutex> l(pq_mutex);
-	while (!scheduled_commands.empty() && scheduled_commands.top().time <= t) {
-		HandleCommand(scheduled_commands.top().cmd);
-		scheduled_commands.pop();
-	}
-	if (!scheduled_commands.empty()) {
-		// if not empty, .time must be bigger than t (after the loop above), so this should be a positive number...
-		return (scheduled_commands.top().time - t).count();
-	}
-	return -1;
+	std::chrono::milliseconds delay = time - WALL();
+	printf("Command: %s in %lld ms.\n", cmd.dump(-1).c_str(), (long long) delay.count());
+	TimerWheel::shared()->schedule(delay, [this, cmd] { HandleCommand(cmd); });
 }
 
 void oi::core::rgbd::RGBDStreamIO::HandleCommand(json cmd) {
-	std::chrono::milliseconds t = NOW();
+	std::chrono::milliseconds t = WALL();
 	printf("Executing command: %s (t: %llu)\n", cmd.dump(-1).c_str(), t.count());
 }
 
-int oi::core::rgbd::RGBDStreamIO::Live() {
-	while (true) {
-		// Send data from our queue
-		worker::DataObjectAcquisition<UDPMessageObject> doa_s(_queue_live, worker::W_FLOW_BLOCKING);
-		if (!doa_s.data) continue;
-
-		doa_s.data->default_endpoint = false;
-		doa_s.data->all_endpoints = true;
-		doa_s.enqueue(_udpc->send_queue());
-		// if (recording) ...
-		doa_s.enqueue(_queue_write);
-	}
-
-	_queue_live->notify_all();
-	printf("END Live");
-	return 0;
+Pipeline<UDPMessageObject> * oi::core::rgbd::RGBDStreamIO::pipeline() {
+	return _pipeline;
 }
 
-int oi::core::rgbd::RGBDStreamIO::Writer() {
-	while (true) {
-		// Send data from our queue
-		worker::DataObjectAcquisition<UDPMessageObject> doa_s(_queue_write, worker::W_FLOW_BLOCKING);
-		if (!doa_s.data) continue;
-	}
+void oi::core::rgbd::RGBDStreamIO::Live(DataObjectAcquisition<UDPMessageObject> & doa_s, PipelineStage<UDPMessageObject> & stage) {
+	OI_TRACE_SPAN("rgbd.live");
+	doa_s.data->default_endpoint = false;
+	doa_s.data->all_endpoints = true;
+	// Same buffer goes to the sender and the recorder; it returns to the pool after both are done.
+	// if (recording) ...
+	stage.forward(doa_s);
+}
 
-	_queue_write->notify_all();
-	printf("END Writer");
-	return 0;
+void oi::core::rgbd::RGBDStreamIO::Writer(DataObjectAcquisition<UDPMessageObject> &, PipelineStage<UDPMessageObject> &) {
+	// Nothing is recorded yet; releasing the acquisition hands the buffer back
 }
 
 int oi::core::rgbd::RGBDStreamIO::Reader() {
@@ -197,6 +213,14 @@ void RGBDStreamerConfig::Parse(int argc, char *argv[]) {
 	std::string serialParam("-sn");
 	std::string pipelineParam("-pp");
 	std::string maxDepthParam("-md");
+	std::string sendWaitParam("-sw");
+	std::string threadCpusParam("-cpu");
+	std::string threadPrioritiesParam("-rt");
+	std::string clockSourceParam("-clk");
+	std::string spanSampleParam("-sp");
+	std::string spanFileParam("-spf");
+	std::string poolCensusParam("-pc");
+	std::string printStatsParam("-stats");
 
 
 	// TODO: add endpoint list parsing!
@@ -222,6 +246,30 @@ void RGBDStreamerConfig::Parse(int argc, char *argv[]) {
 		else if (maxDepthParam.compare(argv[count]) == 0) {
 			this->maxDepth = std::stof(argv[count + 1]);
 		}
+		else if (sendWaitParam.compare(argv[count]) == 0) {
+			this->sendWait = argv[count + 1];
+		}
+		else if (threadCpusParam.compare(argv[count]) == 0) {
+			this->threadCpus = argv[count + 1];
+		}
+		else if (threadPrioritiesParam.compare(argv[count]) == 0) {
+			this->threadPriorities = argv[count + 1];
+		}
+		else if (clockSourceParam.compare(argv[count]) == 0) {
+			this->clockSource = argv[count + 1];
+		}
+		else if (spanSampleParam.compare(argv[count]) == 0) {
+			this->spanSample = std::stoi(argv[count + 1]);
+		}
+		else if (spanFileParam.compare(argv[count]) == 0) {
+			this->spanFile = argv[count + 1];
+		}
+		else if (poolCensusParam.compare(argv[count]) == 0) {
+			this->poolCensus = std::stoi(argv[count + 1]) == 1;
+		}
+		else if (printStatsParam.compare(argv[count]) == 0) {
+			this->printStats = std::stoi(argv[count + 1]) == 1;
+		}
 		else if (useMMParam.compare(argv[count]) == 0) {
 			this->useMatchMaking = std::stoi(argv[count + 1]) == 1;
 		}